@@ -1,6 +1,7 @@
 import os
 import socket
 import ctypes
+import struct
 import time
 
 Addr = ctypes.c_ubyte * 4
@@ -8,9 +9,97 @@ Addr = ctypes.c_ubyte * 4
 PLASMA_ID_SIZE = 20
 ID = ctypes.c_ubyte * PLASMA_ID_SIZE
 
+# These must be kept in sync with plasma_error in plasma.h.
+PLASMA_OK = 0
+PLASMA_OUT_OF_MEMORY = 1
+PLASMA_CHANNEL_UNAVAILABLE = 2
+PLASMA_OBJECT_EXISTS = 3
+PLASMA_OBJECT_ABORTED = 4
+PLASMA_CONTENT_NOT_FOUND = 5
+
+# These must be kept in sync with plasma_notification_type in plasma.h.
+PLASMA_NOTIFICATION_SEALED = 0
+PLASMA_NOTIFICATION_EVICTED = 1
+PLASMA_NOTIFICATION_DELETED = 2
+# The layout of plasma_notification in plasma.h.
+PLASMA_NOTIFICATION_FORMAT = "{}si".format(PLASMA_ID_SIZE)
+PLASMA_NOTIFICATION_SIZE = struct.calcsize(PLASMA_NOTIFICATION_FORMAT)
+
+# This must be kept in sync with PLASMA_MAX_METADATA_TAG_SIZE in plasma.h.
+PLASMA_MAX_METADATA_TAG_SIZE = 32
+
+# This must be kept in sync with PLASMA_NUM_SIZE_CLASSES in plasma.h.
+PLASMA_NUM_SIZE_CLASSES = 15
+
+class SizeClassStats(ctypes.Structure):
+  _fields_ = [("slot_size", ctypes.c_int64),
+              ("num_slabs", ctypes.c_int64),
+              ("num_slots", ctypes.c_int64),
+              ("num_used_slots", ctypes.c_int64),
+              ("bytes_requested", ctypes.c_int64)]
+
+class AllocatorStats(ctypes.Structure):
+  _fields_ = [("slab_size", ctypes.c_int64),
+              ("small_object_threshold", ctypes.c_int64),
+              ("size_classes", SizeClassStats * PLASMA_NUM_SIZE_CLASSES),
+              ("footprint", ctypes.c_int64),
+              ("bytes_allocated", ctypes.c_int64),
+              ("bytes_free", ctypes.c_int64)]
+
+class RingNotification(ctypes.Structure):
+  _fields_ = [("object_id", ID),
+              ("type", ctypes.c_int),
+              ("data_size", ctypes.c_int64),
+              ("metadata_size", ctypes.c_int64)]
+
+class SubscriptionFilter(ctypes.Structure):
+  _fields_ = [("include_existing", ctypes.c_int64),
+              ("id_prefix_size", ctypes.c_int64),
+              ("id_prefix", ID),
+              ("metadata_tag_size", ctypes.c_int64),
+              ("metadata_tag", ctypes.c_ubyte * PLASMA_MAX_METADATA_TAG_SIZE)]
+
+class ManagerAddr(ctypes.Structure):
+  _fields_ = [("addr", Addr),
+              ("port", ctypes.c_int)]
+
 class PlasmaID(ctypes.Structure):
   _fields_ = [("plasma_id", ID)]
 
+class ObjectBuffer(ctypes.Structure):
+  _fields_ = [("data", ctypes.c_void_p),
+              ("data_size", ctypes.c_int64),
+              ("metadata", ctypes.c_void_p),
+              ("metadata_size", ctypes.c_int64),
+              ("digest", ctypes.c_uint64)]
+
+class ObjectStream(object):
+  """An object that may still be being written, see PlasmaClient.get_stream.
+
+  Attributes:
+    buffer (buffer): The object's data. Only the part that wait reports as
+      ready may be read.
+  """
+
+  def __init__(self, plasma_client, object_buffer):
+    self.client = plasma_client.client
+    self.data = object_buffer.data
+    self.buffer = plasma_client.buffer_from_memory(object_buffer.data, object_buffer.data_size)
+
+  def wait(self, num_bytes, timeout_ms=-1):
+    """Wait until the first num_bytes bytes of the object have been written.
+
+    Args:
+      num_bytes (int): The number of bytes to wait for.
+      timeout_ms (int): The maximum number of milliseconds to wait. If this is
+        -1, there is no timeout.
+
+    Returns:
+      The number of bytes at the beginning of the object that can be read, or
+        -1 if the object was aborted before it was sealed.
+    """
+    return self.client.plasma_wait_bytes(ctypes.c_void_p(self.data), ctypes.c_int64(num_bytes), ctypes.c_int64(timeout_ms))
+
 def make_plasma_id(string):
   if len(string) != PLASMA_ID_SIZE:
     raise Exception("PlasmaIDs must be {} characters long".format(PLASMA_ID_SIZE))
@@ -25,13 +114,16 @@ class PlasmaClient(object):
   strings.
   """
 
-  def __init__(self, socket_name, addr=None, port=None):
+  def __init__(self, socket_name, addr=None, port=None, use_channel=False):
     """Initialize the PlasmaClient.
 
     Args:
       socket_name (str): Name of the socket the plasma store is listening at.
       addr (str): IPv4 address of plasma manager attached to the plasma store.
       port (int): Port number of the plasma manager attached to the plasma store.
+      use_channel (bool): If True, send create, seal, contains, release and
+        delete requests through a shared memory channel instead of the socket
+        where the store supports it.
     """
     if port is not None:
       if not isinstance(port, int):
@@ -43,12 +135,25 @@ class PlasmaClient(object):
     self.client = ctypes.cdll.LoadLibrary(plasma_client_library)
 
     self.client.plasma_store_connect.restype = ctypes.c_void_p
-    self.client.plasma_create.restype = None
+    self.client.plasma_store_connect_channel.restype = ctypes.c_void_p
+    self.client.plasma_create.restype = ctypes.c_int
     self.client.plasma_get.restype = None
+    self.client.plasma_get_many.restype = ctypes.c_int64
+    self.client.plasma_get_stream.restype = ctypes.c_int
+    self.client.plasma_wait_bytes.restype = ctypes.c_int64
+    self.client.plasma_mark_bytes_ready.restype = None
     self.client.plasma_contains.restype = None
     self.client.plasma_seal.restype = None
+    self.client.plasma_release.restype = None
     self.client.plasma_delete.restype = None
+    self.client.plasma_abort.restype = None
+    self.client.plasma_create_alias.restype = ctypes.c_int
     self.client.plasma_subscribe.restype = ctypes.c_int
+    self.client.plasma_subscribe_filtered.restype = ctypes.c_int
+    self.client.plasma_subscribe_ring.restype = ctypes.c_int
+    self.client.plasma_get_notification.restype = ctypes.c_int
+    self.client.plasma_get_allocator_stats.restype = None
+    self.client.plasma_locate.restype = ctypes.c_int64
 
     self.buffer_from_memory = ctypes.pythonapi.PyBuffer_FromMemory
     self.buffer_from_memory.argtypes = [ctypes.c_void_p, ctypes.c_int64]
@@ -58,7 +163,10 @@ class PlasmaClient(object):
     self.buffer_from_read_write_memory.argtypes = [ctypes.c_void_p, ctypes.c_int64]
     self.buffer_from_read_write_memory.restype = ctypes.py_object
 
-    self.store_conn = ctypes.c_void_p(self.client.plasma_store_connect(socket_name))
+    if use_channel:
+      self.store_conn = ctypes.c_void_p(self.client.plasma_store_connect_channel(socket_name))
+    else:
+      self.store_conn = ctypes.c_void_p(self.client.plasma_store_connect(socket_name))
 
     if addr is not None and port is not None:
       self.manager_conn = self.client.plasma_manager_connect(addr, port)
@@ -75,13 +183,22 @@ class PlasmaClient(object):
       size (int): The size in bytes of the created buffer.
       metadata (buffer): An optional buffer encoding whatever metadata the user
         wishes to encode.
+
+    Raises:
+      Exception: If an object with this ID has already been created, or if the
+        store does not have enough memory for the object, even after evicting
+        all objects that can be evicted.
     """
     # This is used to hold the address of the buffer.
     data = ctypes.c_void_p()
     # Turn the metadata into the right type.
     metadata = buffer("") if metadata is None else metadata
     metadata = (ctypes.c_ubyte * len(metadata)).from_buffer_copy(metadata)
-    self.client.plasma_create(self.store_conn, make_plasma_id(object_id), size, ctypes.cast(metadata, ctypes.POINTER(ctypes.c_ubyte * len(metadata))), len(metadata), ctypes.byref(data))
+    error_code = self.client.plasma_create(self.store_conn, make_plasma_id(object_id), size, ctypes.cast(metadata, ctypes.POINTER(ctypes.c_ubyte * len(metadata))), len(metadata), ctypes.byref(data))
+    if error_code == PLASMA_OBJECT_EXISTS:
+      raise Exception("An object with this ID has already been created.")
+    if error_code == PLASMA_OUT_OF_MEMORY:
+      raise Exception("The plasma store ran out of memory.")
     return self.buffer_from_read_write_memory(data, size)
 
   def get(self, object_id):
@@ -100,6 +217,64 @@ class PlasmaClient(object):
     buf = self.client.plasma_get(self.store_conn, make_plasma_id(object_id), ctypes.byref(size), ctypes.byref(data), ctypes.byref(metadata_size), ctypes.byref(metadata))
     return self.buffer_from_memory(data, size)
 
+  def get_many(self, object_ids, num_ready=None, timeout_ms=-1):
+    """Get several objects from the PlasmaStore with a single request.
+
+    This call blocks until num_ready of the objects have been sealed or until
+    the timeout expires, whichever happens first. The retrieved buffers are
+    immutable.
+
+    Args:
+      object_ids (List[str]): A list of strings used to identify the objects.
+      num_ready (int): The number of objects that need to be available before
+        the call returns. By default, wait for all of them.
+      timeout_ms (int): The maximum number of milliseconds to wait. If this is
+        -1, there is no timeout.
+
+    Returns:
+      A list with one entry per object ID. The entry is the object's buffer if
+        the object is available and None otherwise.
+    """
+    num_object_ids = len(object_ids)
+    if num_ready is None:
+      num_ready = num_object_ids
+    ids = (PlasmaID * num_object_ids)(*[make_plasma_id(object_id) for object_id in object_ids])
+    buffers = (ObjectBuffer * num_object_ids)()
+    self.client.plasma_get_many(self.store_conn, ctypes.c_int64(num_object_ids), ids, ctypes.c_int64(num_ready), ctypes.c_int64(timeout_ms), buffers)
+    return [self.buffer_from_memory(buf.data, buf.data_size) if buf.data is not None else None for buf in buffers]
+
+  def get_stream(self, object_id, timeout_ms=-1):
+    """Get an object that may still be being written.
+
+    This call blocks until the object has been created or until the timeout
+    expires. Use the wait method of the returned stream before reading a part
+    of the object.
+
+    Args:
+      object_id (str): A string used to identify an object.
+      timeout_ms (int): The maximum number of milliseconds to wait. If this is
+        -1, there is no timeout.
+
+    Returns:
+      An ObjectStream for the object, or None if the object has not been
+        created in time.
+    """
+    buf = ObjectBuffer()
+    if self.client.plasma_get_stream(self.store_conn, make_plasma_id(object_id), ctypes.c_int64(timeout_ms), ctypes.byref(buf)) == 0:
+      return None
+    return ObjectStream(self, buf)
+
+  def mark_bytes_ready(self, memory_buffer, bytes_ready):
+    """Tell readers of an unsealed object how much of it has been written.
+
+    Args:
+      memory_buffer (buffer): The buffer that create returned for the object.
+      bytes_ready (int): The number of bytes at the beginning of the object
+        that have been written.
+    """
+    data = ctypes.addressof(ctypes.c_char.from_buffer(memory_buffer))
+    self.client.plasma_mark_bytes_ready(ctypes.c_void_p(data), ctypes.c_int64(bytes_ready))
+
   def get_metadata(self, object_id):
     """Create a buffer from the PlasmaStore based on object ID.
 
@@ -143,6 +318,19 @@ class PlasmaClient(object):
     """
     self.client.plasma_seal(self.store_conn, make_plasma_id(object_id))
 
+  def release(self, object_id):
+    """Tell the PlasmaStore that this client no longer uses an object.
+
+    Every create and get holds a reference to the object until it is released
+    (or the client disconnects). Objects that are referenced are never evicted
+    or freed. Buffers for the object must not be accessed after it has been
+    released.
+
+    Args:
+      object_id (str): A string used to identify an object.
+    """
+    self.client.plasma_release(self.store_conn, make_plasma_id(object_id))
+
   def delete(self, object_id):
     """Delete the buffer in the PlasmaStore for a particular object ID.
 
@@ -153,6 +341,69 @@ class PlasmaClient(object):
     """
     self.client.plasma_delete(self.store_conn, make_plasma_id(object_id))
 
+  def abort(self, object_id):
+    """Throw away an object that this client created but has not sealed.
+
+    Calls to get_many that wait for the object return None for it, and the
+    wait method of its streams returns -1.
+
+    Args:
+      object_id (str): A string used to identify an object.
+    """
+    self.client.plasma_abort(self.store_conn, make_plasma_id(object_id))
+
+  def digest(self, object_id, timeout_ms=-1):
+    """Get the digest of the contents of a sealed object.
+
+    Args:
+      object_id (str): A string used to identify an object.
+      timeout_ms (int): The maximum number of milliseconds to wait for the
+        object. If this is -1, there is no timeout.
+
+    Returns:
+      The digest, which is 0 if the PlasmaStore does not compute digests, or
+        None if the object has not been sealed in time.
+    """
+    buf = ObjectBuffer()
+    if self.client.plasma_get_many(self.store_conn, ctypes.c_int64(1), ctypes.byref(make_plasma_id(object_id)), ctypes.c_int64(1), ctypes.c_int64(timeout_ms), ctypes.byref(buf)) == 0:
+      return None
+    self.release(object_id)
+    return buf.digest
+
+  def create_alias(self, object_id, digest, size, metadata_size=0):
+    """Create a sealed object from contents that the PlasmaStore already has.
+
+    The object shares memory with the objects that have these contents. This
+    only works if the store computes digests, and only once all clients have
+    released an object with these contents after it was sealed.
+
+    Args:
+      object_id (str): A string used to identify the new object.
+      digest (int): The digest of the contents, see digest.
+      size (int): The size in bytes of the object's data.
+      metadata_size (int): The size in bytes of the object's metadata.
+
+    Returns:
+      PLASMA_OK if the object has been created, PLASMA_OBJECT_EXISTS if an
+        object with this ID already exists, or PLASMA_CONTENT_NOT_FOUND if the
+        store does not have the contents.
+    """
+    return self.client.plasma_create_alias(self.store_conn, make_plasma_id(object_id), ctypes.c_uint64(digest), ctypes.c_int64(size), ctypes.c_int64(metadata_size))
+
+  def allocator_stats(self):
+    """Get statistics about the memory allocator of the PlasmaStore.
+
+    Returns:
+      A dictionary with the fields of plasma_allocator_stats in plasma.h. The
+        value of "size_classes" is a list with a dictionary for every size
+        class of the slab allocator.
+    """
+    stats = AllocatorStats()
+    self.client.plasma_get_allocator_stats(self.store_conn, ctypes.byref(stats))
+    result = {name: getattr(stats, name) for name, _ in AllocatorStats._fields_}
+    result["size_classes"] = [{name: getattr(size_class, name) for name, _ in SizeClassStats._fields_} for size_class in stats.size_classes]
+    return result
+
   def transfer(self, addr, port, object_id):
     """Transfer local object with id object_id to another plasma instance
 
@@ -165,24 +416,139 @@ class PlasmaClient(object):
       raise Exception("Not connected to the plasma manager socket")
     self.client.plasma_transfer(self.manager_conn, addr, port, make_plasma_id(object_id))
 
-  def subscribe(self):
-    """Subscribe to notifications about sealed objects."""
-    fd = self.client.plasma_subscribe(self.store_conn)
+  def fetch(self, addr, port, object_ids):
+    """Pull objects from another plasma instance into the local store.
+
+    This returns right away. Use get or get_many to wait for the objects.
+    Objects that are already in the local store or that are already being
+    fetched are not transferred again.
+
+    Args:
+      addr (str): IPv4 address of the plasma manager that has the objects, or
+        None to fetch the objects from the closest plasma manager that the
+        object directory knows to have them, once one has them.
+      port (int): Port number of the plasma manager that has the objects.
+      object_ids (List[str]): A list of strings used to identify the objects.
+    """
+    if self.manager_conn == -1:
+      raise Exception("Not connected to the plasma manager socket")
+    num_object_ids = len(object_ids)
+    ids = (PlasmaID * num_object_ids)(*[make_plasma_id(object_id) for object_id in object_ids])
+    self.client.plasma_fetch(self.manager_conn, ctypes.c_int64(num_object_ids), ids, addr, port or 0)
+
+  def locate(self, object_id):
+    """Find the plasma managers whose stores have an object.
+
+    This needs plasma managers that share an object directory.
+
+    Args:
+      object_id (str): A string used to identify an object.
+
+    Returns:
+      A list of the IPv4 addresses and ports of the plasma managers, the
+        closest to the local plasma manager first.
+    """
+    if self.manager_conn == -1:
+      raise Exception("Not connected to the plasma manager socket")
+    max_managers = 16
+    while True:
+      managers = (ManagerAddr * max_managers)()
+      num_managers = self.client.plasma_locate(self.manager_conn, make_plasma_id(object_id), ctypes.c_int64(max_managers), managers)
+      if num_managers <= max_managers:
+        return [(".".join(str(byte) for byte in manager.addr), manager.port) for manager in managers[:num_managers]]
+      max_managers = num_managers
+
+  def broadcast(self, object_id, managers):
+    """Send a local object to many other plasma instances.
+
+    The plasma managers forward the object to each other along a tree while it
+    arrives, so this is much faster than transferring it to each of them. This
+    returns right away. Use get on the other instances to wait for the object.
+
+    Args:
+      object_id (str): A string used to identify an object.
+      managers (List[Tuple[str, int]]): The IPv4 addresses and ports of the
+        plasma managers that the object is sent to.
+    """
+    if self.manager_conn == -1:
+      raise Exception("Not connected to the plasma manager socket")
+    num_managers = len(managers)
+    addrs = (ctypes.c_char_p * num_managers)(*[addr for addr, _ in managers])
+    ports = (ctypes.c_int * num_managers)(*[port for _, port in managers])
+    self.client.plasma_broadcast(self.manager_conn, make_plasma_id(object_id), ctypes.c_int64(num_managers), addrs, ports)
+
+  def subscribe(self, use_ring=False, include_existing=False, id_prefix="", metadata_tag=""):
+    """Subscribe to notifications about sealed objects.
+
+    This can be called at any time. Only the notifications about objects that
+    match both id_prefix and metadata_tag are sent.
+
+    Args:
+      use_ring (bool): If True, get the notifications through a ring in shared
+        memory, which also carries the sizes of the objects.
+      include_existing (bool): If True, first get a notification for every
+        sealed object that already exists.
+      id_prefix (str): Only get notifications about objects whose IDs start
+        with this.
+      metadata_tag (str): Only get notifications about objects whose metadata
+        starts with this.
+    """
+    if len(id_prefix) > PLASMA_ID_SIZE:
+      raise Exception("The ID prefix can be at most {} bytes long.".format(PLASMA_ID_SIZE))
+    if len(metadata_tag) > PLASMA_MAX_METADATA_TAG_SIZE:
+      raise Exception("The metadata tag can be at most {} bytes long.".format(PLASMA_MAX_METADATA_TAG_SIZE))
+    subscription_filter = SubscriptionFilter(include_existing=int(include_existing),
+                                             id_prefix_size=len(id_prefix),
+                                             metadata_tag_size=len(metadata_tag))
+    ctypes.memmove(subscription_filter.id_prefix, id_prefix, len(id_prefix))
+    ctypes.memmove(subscription_filter.metadata_tag, metadata_tag, len(metadata_tag))
+    self.notification_ring = None
+    if use_ring:
+      ring = ctypes.c_void_p()
+      fd = self.client.plasma_subscribe_ring(self.store_conn, ctypes.byref(subscription_filter), ctypes.byref(ring))
+      if fd == -1:
+        raise Exception("The plasma store could not set up a notification ring.")
+      self.notification_ring = ring
+      self.notification_fd = fd
+      return
+    fd = self.client.plasma_subscribe_filtered(self.store_conn, ctypes.byref(subscription_filter))
     self.notification_sock = socket.fromfd(fd, socket.AF_UNIX, socket.SOCK_STREAM)
     # Make the socket non-blocking.
     self.notification_sock.setblocking(0)
 
-  def get_next_notification(self):
-    """Get the next notification from the notification socket."""
-    if not self.notification_sock:
+  def get_next_notification(self, with_sizes=False):
+    """Get the next notification from the notification socket.
+
+    Args:
+      with_sizes (bool): If True, also return the data and metadata sizes of
+        the object. This needs a subscription with use_ring=True.
+
+    Returns:
+      A tuple of the object ID and the notification type, which is either
+        PLASMA_NOTIFICATION_SEALED, PLASMA_NOTIFICATION_EVICTED or
+        PLASMA_NOTIFICATION_DELETED, followed by
+        the data size and the metadata size if with_sizes is True.
+    """
+    if getattr(self, "notification_ring", None):
+      notification = RingNotification()
+      self.client.plasma_get_notification(self.notification_fd, self.notification_ring, ctypes.c_int64(-1), ctypes.byref(notification))
+      object_id = str(bytearray(notification.object_id))
+      if with_sizes:
+        return (object_id, notification.type, notification.data_size, notification.metadata_size)
+      return (object_id, notification.type)
+    if with_sizes:
+      raise Exception("Object sizes are only sent through a notification ring.")
+    if not getattr(self, "notification_sock", None):
       raise Exception("To get notifications, first call subscribe.")
-    # Loop until we've read PLASMA_ID_SIZE bytes from the socket.
-    while True:
+    # Loop until we've read PLASMA_NOTIFICATION_SIZE bytes from the socket. The
+    # store sends many notifications at once, so one may arrive in pieces.
+    message_data = ""
+    while len(message_data) < PLASMA_NOTIFICATION_SIZE:
       try:
-        message_data = self.notification_sock.recv(PLASMA_ID_SIZE)
+        data = self.notification_sock.recv(PLASMA_NOTIFICATION_SIZE - len(message_data))
       except socket.error:
         time.sleep(0.001)
       else:
-        assert len(message_data) == PLASMA_ID_SIZE
-        break
-    return message_data
+        assert len(data) > 0
+        message_data += data
+    return struct.unpack(PLASMA_NOTIFICATION_FORMAT, message_data)
@@ -0,0 +1,204 @@
+#include "compress.h"
+
+#include <string.h>
+
+/* The number of bits of the hash of four bytes that is used to find earlier
+ * occurrences of them. */
+#define COMPRESS_HASH_BITS 12
+
+/* Copies are at least this long. */
+#define COMPRESS_MIN_MATCH 4
+
+/* Copies reach at most this many bytes back, so that the distance fits into
+ * two bytes. */
+#define COMPRESS_MAX_OFFSET 65535
+
+/* A run length that does not fit into the four bits of the token is
+ * continued in the following bytes. */
+#define COMPRESS_RUN_MASK 15
+
+int64_t plasma_compress_bound(int64_t size) {
+  return size + size / 255 + 16;
+}
+
+uint32_t compress_read32(const uint8_t *data) {
+  uint32_t word;
+  memcpy(&word, data, sizeof(word));
+  return word;
+}
+
+uint32_t compress_hash(uint32_t word) {
+  return (word * UINT32_C(2654435761)) >> (32 - COMPRESS_HASH_BITS);
+}
+
+/* Write the continuation of a run length that does not fit into the token.
+ * Return the new end of the output, or NULL if there is no room. */
+uint8_t *compress_write_length(uint8_t *out, uint8_t *out_end, int64_t length) {
+  for (; length >= 255; length -= 255) {
+    if (out == out_end) {
+      return NULL;
+    }
+    *out++ = 255;
+  }
+  if (out == out_end) {
+    return NULL;
+  }
+  *out++ = (uint8_t) length;
+  return out;
+}
+
+/* Write a run of literals followed by a copy of match_length bytes from
+ * offset bytes back. If match_length is 0, this is the last run of the block
+ * and there is no copy. Return the new end of the output, or NULL if there is
+ * no room. */
+uint8_t *compress_write_sequence(uint8_t *out,
+                                 uint8_t *out_end,
+                                 const uint8_t *literals,
+                                 int64_t num_literals,
+                                 int64_t offset,
+                                 int64_t match_length) {
+  if (out == out_end) {
+    return NULL;
+  }
+  int64_t match_code = match_length > 0 ? match_length - COMPRESS_MIN_MATCH : 0;
+  uint8_t *token = out++;
+  *token = (num_literals < COMPRESS_RUN_MASK ? num_literals : COMPRESS_RUN_MASK)
+           << 4;
+  *token |= match_code < COMPRESS_RUN_MASK ? match_code : COMPRESS_RUN_MASK;
+  if (num_literals >= COMPRESS_RUN_MASK &&
+      (out = compress_write_length(out, out_end,
+                                   num_literals - COMPRESS_RUN_MASK)) == NULL) {
+    return NULL;
+  }
+  if (out_end - out < num_literals) {
+    return NULL;
+  }
+  memcpy(out, literals, num_literals);
+  out += num_literals;
+  if (match_length == 0) {
+    return out;
+  }
+  if (out_end - out < 2) {
+    return NULL;
+  }
+  *out++ = (uint8_t) offset;
+  *out++ = (uint8_t) (offset >> 8);
+  if (match_code >= COMPRESS_RUN_MASK) {
+    out = compress_write_length(out, out_end, match_code - COMPRESS_RUN_MASK);
+  }
+  return out;
+}
+
+int64_t plasma_compress(const uint8_t *source,
+                        int64_t size,
+                        uint8_t *destination,
+                        int64_t capacity) {
+  /* The positions of the last occurrences of four byte values, by hash. */
+  int64_t table[1 << COMPRESS_HASH_BITS];
+  for (int i = 0; i < (1 << COMPRESS_HASH_BITS); ++i) {
+    table[i] = -1;
+  }
+  const uint8_t *end = source + size;
+  const uint8_t *input = source;
+  const uint8_t *anchor = source;
+  uint8_t *out = destination;
+  uint8_t *out_end = destination + capacity;
+  while (end - input >= COMPRESS_MIN_MATCH) {
+    uint32_t word = compress_read32(input);
+    uint32_t hash = compress_hash(word);
+    int64_t candidate = table[hash];
+    table[hash] = input - source;
+    if (candidate < 0 || input - source - candidate > COMPRESS_MAX_OFFSET ||
+        compress_read32(source + candidate) != word) {
+      /* Data without matches is skipped faster and faster, so incompressible
+       * blocks cost little time. */
+      input += 1 + ((input - anchor) >> 6);
+      continue;
+    }
+    const uint8_t *match = source + candidate;
+    int64_t match_length = COMPRESS_MIN_MATCH;
+    while (input + match_length < end &&
+           input[match_length] == match[match_length]) {
+      ++match_length;
+    }
+    out = compress_write_sequence(out, out_end, anchor, input - anchor,
+                                  input - match, match_length);
+    if (out == NULL) {
+      return -1;
+    }
+    input += match_length;
+    anchor = input;
+  }
+  out = compress_write_sequence(out, out_end, anchor, end - anchor, 0, 0);
+  return out == NULL ? -1 : out - destination;
+}
+
+/* Read the continuation of a run length. Return the new position in the
+ * input, or NULL if the input ends first. */
+const uint8_t *decompress_read_length(const uint8_t *input,
+                                      const uint8_t *end,
+                                      int64_t *length) {
+  uint8_t byte;
+  do {
+    if (input == end) {
+      return NULL;
+    }
+    byte = *input++;
+    *length += byte;
+  } while (byte == 255);
+  return input;
+}
+
+int64_t plasma_decompress(const uint8_t *source,
+                          int64_t size,
+                          uint8_t *destination,
+                          int64_t capacity) {
+  const uint8_t *input = source;
+  const uint8_t *end = source + size;
+  uint8_t *out = destination;
+  uint8_t *out_end = destination + capacity;
+  while (input < end) {
+    uint8_t token = *input++;
+    int64_t num_literals = token >> 4;
+    if (num_literals == COMPRESS_RUN_MASK &&
+        (input = decompress_read_length(input, end, &num_literals)) == NULL) {
+      return -1;
+    }
+    if (end - input < num_literals || out_end - out < num_literals) {
+      return -1;
+    }
+    memcpy(out, input, num_literals);
+    input += num_literals;
+    out += num_literals;
+    if (input == end) {
+      /* The last run has no copy. */
+      break;
+    }
+    if (end - input < 2) {
+      return -1;
+    }
+    int64_t offset = input[0] | (input[1] << 8);
+    input += 2;
+    int64_t match_length = token & COMPRESS_RUN_MASK;
+    if (match_length == COMPRESS_RUN_MASK &&
+        (input = decompress_read_length(input, end, &match_length)) == NULL) {
+      return -1;
+    }
+    match_length += COMPRESS_MIN_MATCH;
+    if (offset == 0 || offset > out - destination ||
+        out_end - out < match_length) {
+      return -1;
+    }
+    const uint8_t *match = out - offset;
+    if (offset >= match_length) {
+      memcpy(out, match, match_length);
+    } else {
+      /* The copy repeats the bytes it produces, so go byte by byte. */
+      for (int64_t i = 0; i < match_length; ++i) {
+        out[i] = match[i];
+      }
+    }
+    out += match_length;
+  }
+  return out - destination;
+}
@@ -0,0 +1,53 @@
+/* COMPRESS: Fast compression of blocks of object data
+ *
+ * Plasma Managers use this to compress the objects that they send to each
+ * other. The format follows LZ4: a block is a sequence of literal runs, each
+ * followed by a copy of at least four earlier bytes at most 64KB back, which
+ * makes compression and decompression cheap enough to keep up with a fast
+ * network link. Blocks are independent of each other, so every block can be
+ * decompressed straight to its place in the object. */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <inttypes.h>
+
+/**
+ * The size in bytes of the largest compressed block of size bytes.
+ *
+ * @param size The size in bytes of the uncompressed block.
+ * @return The number of bytes that plasma_compress may need for it.
+ */
+int64_t plasma_compress_bound(int64_t size);
+
+/**
+ * Compress a block.
+ *
+ * @param source The bytes to compress.
+ * @param size The number of bytes to compress.
+ * @param destination The compressed bytes are written here.
+ * @param capacity The size in bytes of the destination.
+ * @return The size in bytes of the compressed block, or -1 if it does not
+ *         fit into capacity bytes.
+ */
+int64_t plasma_compress(const uint8_t *source,
+                        int64_t size,
+                        uint8_t *destination,
+                        int64_t capacity);
+
+/**
+ * Decompress a block that plasma_compress produced.
+ *
+ * @param source The compressed bytes.
+ * @param size The size in bytes of the compressed block.
+ * @param destination The decompressed bytes are written here.
+ * @param capacity The size in bytes of the destination.
+ * @return The size in bytes of the decompressed block, or -1 if the block is
+ *         corrupt or does not fit into capacity bytes.
+ */
+int64_t plasma_decompress(const uint8_t *source,
+                          int64_t size,
+                          uint8_t *destination,
+                          int64_t capacity);
+
+#endif /* COMPRESS_H */
@@ -0,0 +1,70 @@
+#include "digest.h"
+
+#include <string.h>
+
+#define DIGEST_PRIME_1 UINT64_C(0x9e3779b185ebca87)
+#define DIGEST_PRIME_2 UINT64_C(0xc2b2ae3d27d4eb4f)
+#define DIGEST_PRIME_3 UINT64_C(0x165667b19e3779f9)
+#define DIGEST_PRIME_4 UINT64_C(0x85ebca77c2b2ae63)
+#define DIGEST_PRIME_5 UINT64_C(0x27d4eb2f165667c5)
+
+uint64_t digest_rotate(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+/* The words are read with memcpy, because objects and their tails need not
+ * be aligned. */
+uint64_t digest_read(const uint8_t *data) {
+  uint64_t word;
+  memcpy(&word, data, sizeof(word));
+  return word;
+}
+
+uint64_t digest_round(uint64_t accumulator, uint64_t word) {
+  accumulator += word * DIGEST_PRIME_2;
+  return digest_rotate(accumulator, 31) * DIGEST_PRIME_1;
+}
+
+uint64_t digest_merge(uint64_t hash, uint64_t accumulator) {
+  hash ^= digest_round(0, accumulator);
+  return hash * DIGEST_PRIME_1 + DIGEST_PRIME_4;
+}
+
+uint64_t plasma_digest(const uint8_t *data, int64_t size) {
+  const uint8_t *end = data + size;
+  uint64_t hash;
+  if (size >= 32) {
+    uint64_t accumulators[4] = {DIGEST_PRIME_1 + DIGEST_PRIME_2,
+                                DIGEST_PRIME_2, 0, -DIGEST_PRIME_1};
+    for (; data + 32 <= end; data += 32) {
+      for (int i = 0; i < 4; ++i) {
+        accumulators[i] =
+            digest_round(accumulators[i], digest_read(data + 8 * i));
+      }
+    }
+    hash = digest_rotate(accumulators[0], 1) +
+           digest_rotate(accumulators[1], 7) +
+           digest_rotate(accumulators[2], 12) +
+           digest_rotate(accumulators[3], 18);
+    for (int i = 0; i < 4; ++i) {
+      hash = digest_merge(hash, accumulators[i]);
+    }
+  } else {
+    hash = DIGEST_PRIME_5;
+  }
+  hash += (uint64_t) size;
+  for (; data + 8 <= end; data += 8) {
+    hash ^= digest_round(0, digest_read(data));
+    hash = digest_rotate(hash, 27) * DIGEST_PRIME_1 + DIGEST_PRIME_4;
+  }
+  for (; data < end; ++data) {
+    hash ^= *data * DIGEST_PRIME_5;
+    hash = digest_rotate(hash, 11) * DIGEST_PRIME_1;
+  }
+  hash ^= hash >> 33;
+  hash *= DIGEST_PRIME_2;
+  hash ^= hash >> 29;
+  hash *= DIGEST_PRIME_3;
+  hash ^= hash >> 32;
+  return hash == 0 ? 1 : hash;
+}
@@ -0,0 +1,25 @@
+/* DIGEST: Fast non-cryptographic hash of object contents
+ *
+ * The store uses the digest to find objects with identical contents. It
+ * follows the structure of XXH64: four independent accumulators consume 32
+ * bytes per step, which keeps several multipliers busy at once and lets the
+ * compiler vectorize the loop, and the tail and the length are mixed in at
+ * the end. Equal digests only make equal contents likely, so callers compare
+ * the bytes before relying on them. */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <inttypes.h>
+
+/**
+ * Compute the digest of a buffer.
+ *
+ * @param data The bytes to hash.
+ * @param size The number of bytes.
+ * @return The digest. This is never 0, so that 0 can mean that there is no
+ *         digest.
+ */
+uint64_t plasma_digest(const uint8_t *data, int64_t size);
+
+#endif /* DIGEST_H */
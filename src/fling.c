@@ -25,11 +25,17 @@ int send_fd(int conn, int fd, const char *payload, int size) {
 
   init_msg(&msg, &iov, buf, sizeof(buf));
 
-  struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
-  header->cmsg_level = SOL_SOCKET;
-  header->cmsg_type = SCM_RIGHTS;
-  header->cmsg_len = CMSG_LEN(sizeof(int));
-  *(int *) CMSG_DATA(header) = fd;
+  if (fd >= 0) {
+    struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    *(int *) CMSG_DATA(header) = fd;
+  } else {
+    /* Only send the payload, with the same framing. */
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+  }
 
   /* send file descriptor and payload */
   return sendmsg(conn, &msg, 0) != -1 && send(conn, payload, size, 0) == -1;
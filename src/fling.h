@@ -26,7 +26,8 @@
 void init_msg(struct msghdr *msg, struct iovec *iov, char *buf, size_t buf_len);
 
 /* Send a file descriptor "fd" and a payload "payload" of size "size"
- * over the socket "conn". Return 0 on success. */
+ * over the socket "conn". If "fd" is -1, only the payload is sent, and
+ * recv_fd on the other side will return -1. Return 0 on success. */
 int send_fd(int conn, int fd, const char *payload, int size);
 
 /* Receive a file descriptor and a payload of size up to "size" from a
@@ -0,0 +1,134 @@
+#include "id_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** The number of slots of a table that has values. */
+#define ID_TABLE_MIN_CAPACITY 16
+
+/* The table grows once more than three quarters of the slots are used, which
+ * keeps the probe sequences of linear probing short. */
+#define ID_TABLE_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+/* Mix all bytes of an object ID into a hash. IDs are usually random, but
+ * their first bytes also pick the shard of the store, so they must not be the
+ * only ones that count. */
+uint64_t id_table_hash(object_id object_id) {
+  uint64_t words[3] = {0, 0, 0};
+  memcpy(words, object_id.id, sizeof(object_id.id));
+  uint64_t hash = words[0] * UINT64_C(0x9e3779b97f4a7c15);
+  hash ^= words[1] * UINT64_C(0xc2b2ae3d27d4eb4f);
+  hash ^= words[2] * UINT64_C(0x165667b19e3779f9);
+  hash ^= hash >> 32;
+  /* A hash of 0 marks an empty slot. */
+  return hash == 0 ? 1 : hash;
+}
+
+object_id *id_table_key(id_table *table, void *value) {
+  return (object_id *) ((uint8_t *) value + table->key_offset);
+}
+
+/* Return the index of the slot with the given ID, or -1 if there is none. */
+int64_t id_table_lookup(id_table *table,
+                        object_id object_id,
+                        uint64_t hash) {
+  if (table->size == 0) {
+    return -1;
+  }
+  uint64_t mask = table->capacity - 1;
+  for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+    id_table_slot *slot = &table->slots[i];
+    if (slot->hash == 0) {
+      return -1;
+    }
+    if (slot->hash == hash &&
+        memcmp(id_table_key(table, slot->value), &object_id,
+               sizeof(object_id)) == 0) {
+      return i;
+    }
+  }
+}
+
+/* Put a value into the first free slot of its probe sequence. */
+void id_table_place(id_table *table, uint64_t hash, void *value) {
+  uint64_t mask = table->capacity - 1;
+  uint64_t i = hash & mask;
+  while (table->slots[i].hash != 0) {
+    i = (i + 1) & mask;
+  }
+  table->slots[i].hash = hash;
+  table->slots[i].value = value;
+}
+
+void id_table_grow(id_table *table) {
+  int64_t old_capacity = table->capacity;
+  id_table_slot *old_slots = table->slots;
+  table->capacity =
+      old_capacity == 0 ? ID_TABLE_MIN_CAPACITY : 2 * old_capacity;
+  table->slots = calloc(table->capacity, sizeof(id_table_slot));
+  CHECK(table->slots != NULL);
+  for (int64_t i = 0; i < old_capacity; ++i) {
+    if (old_slots[i].hash != 0) {
+      id_table_place(table, old_slots[i].hash, old_slots[i].value);
+    }
+  }
+  free(old_slots);
+}
+
+void id_table_init(id_table *table, size_t key_offset) {
+  table->key_offset = key_offset;
+  table->capacity = 0;
+  table->size = 0;
+  table->slots = NULL;
+}
+
+void id_table_free(id_table *table) {
+  free(table->slots);
+  id_table_init(table, table->key_offset);
+}
+
+void *id_table_find(id_table *table, object_id object_id) {
+  int64_t i = id_table_lookup(table, object_id, id_table_hash(object_id));
+  return i == -1 ? NULL : table->slots[i].value;
+}
+
+void id_table_insert(id_table *table, void *value) {
+  if (table->size + 1 > ID_TABLE_MAX_LOAD(table->capacity)) {
+    id_table_grow(table);
+  }
+  id_table_place(table, id_table_hash(*id_table_key(table, value)), value);
+  table->size += 1;
+}
+
+void *id_table_remove(id_table *table, object_id object_id) {
+  int64_t hole = id_table_lookup(table, object_id, id_table_hash(object_id));
+  if (hole == -1) {
+    return NULL;
+  }
+  void *value = table->slots[hole].value;
+  table->slots[hole].hash = 0;
+  table->size -= 1;
+  /* Move the following values of the cluster into the hole unless that would
+   * put them before the slot that their probe sequence starts at. */
+  uint64_t mask = table->capacity - 1;
+  for (uint64_t i = (hole + 1) & mask; table->slots[i].hash != 0;
+       i = (i + 1) & mask) {
+    uint64_t home = table->slots[i].hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      table->slots[hole] = table->slots[i];
+      table->slots[i].hash = 0;
+      hole = i;
+    }
+  }
+  return value;
+}
+
+void *id_table_next(id_table *table, int64_t *index) {
+  while (*index < table->capacity) {
+    id_table_slot *slot = &table->slots[(*index)++];
+    if (slot->hash != 0) {
+      return slot->value;
+    }
+  }
+  return NULL;
+}
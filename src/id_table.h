@@ -0,0 +1,96 @@
+/* ID_TABLE: Open addressing hash table keyed by object IDs
+ *
+ * The table stores pointers to structs that contain their object ID at a
+ * fixed offset. The slots are kept in one array together with the hashes of
+ * the keys, and collisions are resolved by linear probing, so a lookup
+ * usually touches a single cache line and only compares the full ID of a
+ * value whose hash matches. Removal shifts the following values back instead
+ * of leaving tombstones, so lookups never get slower over time. */
+
+#ifndef ID_TABLE_H
+#define ID_TABLE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "common.h"
+
+typedef struct {
+  /** The hash of the key of the value, or 0 if the slot is empty. */
+  uint64_t hash;
+  /** The value in this slot. */
+  void *value;
+} id_table_slot;
+
+typedef struct {
+  /** The offset of the object ID in the values. */
+  size_t key_offset;
+  /** The number of slots. This is 0 or a power of two. */
+  int64_t capacity;
+  /** The number of values in the table. */
+  int64_t size;
+  /** The slots. */
+  id_table_slot *slots;
+} id_table;
+
+/**
+ * Initialize an empty table. This does not allocate any memory.
+ *
+ * @param table The table to initialize.
+ * @param key_offset The offset of the object ID in the values, for example
+ *        offsetof(object_table_entry, object_id).
+ * @return Void.
+ */
+void id_table_init(id_table *table, size_t key_offset);
+
+/**
+ * Free the slots of a table. The values are not freed.
+ *
+ * @param table The table.
+ * @return Void.
+ */
+void id_table_free(id_table *table);
+
+/**
+ * Look up the value with an object ID.
+ *
+ * @param table The table.
+ * @param object_id The ID to look up.
+ * @return The value or NULL if there is no value with this ID.
+ */
+void *id_table_find(id_table *table, object_id object_id);
+
+/**
+ * Add a value to a table. There must not be a value with the same ID in the
+ * table yet.
+ *
+ * @param table The table.
+ * @param value The value to add.
+ * @return Void.
+ */
+void id_table_insert(id_table *table, void *value);
+
+/**
+ * Remove the value with an object ID from a table.
+ *
+ * @param table The table.
+ * @param object_id The ID of the value to remove.
+ * @return The value that was removed or NULL if there was none.
+ */
+void *id_table_remove(id_table *table, object_id object_id);
+
+/**
+ * Iterate over the values of a table. The table must not be changed while
+ * iterating, except that the value that was just returned may be removed if
+ * *index is then decremented, because removal can move a later value into
+ * its slot. This is meant for emptying a table, since values that wrap around
+ * the end of the slots may be returned again.
+ *
+ * @param table The table.
+ * @param index The position to continue at. This must be 0 for the first
+ *        call and is advanced past the returned value.
+ * @return The next value or NULL if there are no more values.
+ */
+void *id_table_next(id_table *table, int64_t *index);
+
+#endif /* ID_TABLE_H */
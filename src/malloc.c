@@ -1,24 +1,35 @@
+/* Needed for MAP_POPULATE and memfd_create on Linux. */
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "utlist.h"
 #include "plasma.h"
-#include "uthash.h"
+#include "malloc.h"
 
 void *fake_mmap(size_t);
 int fake_munmap(void *, size_t);
+void *fake_sbrk(intptr_t);
 
 #define MMAP(s) fake_mmap(s)
 #define MUNMAP(a, s) fake_munmap(a, s)
 #define DIRECT_MMAP(s) fake_mmap(s)
 #define DIRECT_MUNMAP(a, s) fake_munmap(a, s)
+#define MORECORE(s) fake_sbrk(s)
+#define MORECORE_CANNOT_TRIM
 #define USE_DL_PREFIX
-#define HAVE_MORECORE 0
 #define DEFAULT_MMAP_THRESHOLD MAX_SIZE_T
 #define DEFAULT_GRANULARITY ((size_t) 128U * 1024U)
 
@@ -28,30 +39,96 @@ int fake_munmap(void *, size_t);
 #undef MUNMAP
 #undef DIRECT_MMAP
 #undef DIRECT_MUNMAP
+#undef MORECORE
+#undef MORECORE_CANNOT_TRIM
 #undef USE_DL_PREFIX
-#undef HAVE_MORECORE
 #undef DEFAULT_GRANULARITY
 
 struct mmap_record {
   int fd;
   void *pointer;
   int64_t size;
-  UT_hash_handle hh_fd;
-  UT_hash_handle hh_pointer;
 };
 
-/* TODO(rshin): Don't have two hash tables. */
-struct mmap_record *records_by_fd = NULL;
-struct mmap_record *records_by_pointer = NULL;
+/* Index of all segments handed out by fake_mmap, kept sorted by the segment
+ * base pointer so that a pointer can be mapped to its segment with a binary
+ * search. Segments never overlap, so this is an interval index. */
+struct mmap_record *records = NULL;
+int num_records = 0;
+int records_capacity = 0;
+
+/* If the store was started with a fixed amount of memory, all memory is carved
+ * out of this single arena by fake_sbrk and fake_mmap refuses to create new
+ * segments. Clients then only ever need to map one file. */
+struct mmap_record arena = {-1, NULL, 0};
+/* Number of bytes of the arena that have been handed out to dlmalloc. */
+int64_t arena_used = 0;
+
+/* Small objects are allocated from slabs of this many bytes, which are
+ * aligned to their size so that the slab of a slot can be found from its
+ * address. */
+#define SLAB_SIZE (64 * 1024)
+
+/* The number of bytes of a slab that can be used. With dlmalloc's overhead,
+ * the chunk of a slab is then exactly SLAB_SIZE bytes, so slabs that are
+ * carved from the top of the heap one after the other stay aligned without
+ * leaving gaps. */
+#define SLAB_USABLE_SIZE (SLAB_SIZE - CHUNK_OVERHEAD)
+
+/* The slots of a slab start after its header at this offset. */
+#define SLAB_HEADER_SIZE 64
+
+/* The sizes of the slots of the size classes. Each class is about 1.5 times
+ * larger than the one before, so at most a third of a slot is wasted. */
+const int64_t slot_sizes[PLASMA_NUM_SIZE_CLASSES] = {
+    32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+
+typedef struct slab slab;
+
+/* The header at the beginning of every slab. It lives in the shared memory
+ * like the slots, which clients never touch outside of their objects. */
+struct slab {
+  /* The index of the size class of the slots. */
+  int64_t size_class;
+  /* The number of slots that are in use. */
+  int64_t num_used;
+  /* The free slots, linked through their first bytes. Slots that have never
+   * been used are not in this list but start at next_unused. */
+  void *free_slots;
+  /* The slot after the last one that has been used so far. */
+  uint8_t *next_unused;
+  /* Pointers for the list of slabs of the size class with free slots. */
+  slab *prev;
+  slab *next;
+};
+
+struct size_class {
+  /* Slabs of this class that have free slots. Full slabs are in no list,
+   * and empty slabs are given back to dlmalloc. */
+  slab *partial_slabs;
+  /* The number of slabs of this class. */
+  int64_t num_slabs;
+  /* The number of slots of this class that are in use. */
+  int64_t num_used_slots;
+  /* The number of bytes that the allocations in the used slots asked for. */
+  int64_t bytes_requested;
+};
+
+struct size_class size_classes[PLASMA_NUM_SIZE_CLASSES];
+
+/* Allocations up to this many bytes come from the slabs. */
+int64_t slab_threshold = 0;
+
+/* Directory in which the files backing the shared memory are created. */
+const char *plasma_directory = "/tmp";
 
 const int GRANULARITY_MULTIPLIER = 2;
 
 /* Create a buffer. This is creating a temporary file and then
  * immediately unlinking it so we do not leave traces in the system. */
 int create_buffer(int64_t size) {
-  static char template[] = "/tmp/plasmaXXXXXX";
-  char file_name[32];
-  strncpy(file_name, template, 32);
+  char file_name[PATH_MAX];
+  snprintf(file_name, sizeof(file_name), "%s/plasmaXXXXXX", plasma_directory);
   int fd = mkstemp(file_name);
   if (fd < 0)
     return -1;
@@ -71,7 +148,283 @@ int create_buffer(int64_t size) {
   return fd;
 }
 
+/* Create the file descriptor backing the arena. Without an explicit directory
+ * we use an anonymous memfd where available. */
+int create_arena_buffer(int64_t *size, int use_memfd) {
+  int fd = -1;
+#ifdef SYS_memfd_create
+  if (use_memfd) {
+    fd = syscall(SYS_memfd_create, "plasma", 0);
+    if (fd >= 0 && ftruncate(fd, (off_t) *size) != 0) {
+      LOG_ERR("ftruncate error");
+      close(fd);
+      return -1;
+    }
+  }
+#endif
+  if (fd < 0) {
+    /* Files on hugetlbfs must be a multiple of the huge page size, which is
+     * reported as the block size of the file system. */
+    struct statvfs stats;
+    if (statvfs(plasma_directory, &stats) == 0 && stats.f_bsize > 0) {
+      *size = (*size + stats.f_bsize - 1) / stats.f_bsize * stats.f_bsize;
+    }
+    fd = create_buffer(*size);
+  }
+  return fd;
+}
+
+/* Open or create the named file that keeps the arena across restarts. */
+int open_arena_file(const char *arena_file, int64_t size) {
+  int fd = open(arena_file, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, (off_t) size) != 0) {
+    LOG_ERR("ftruncate error");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int init_plasma_malloc(const char *directory,
+                       int64_t arena_size,
+                       int populate,
+                       const char *arena_file,
+                       void *arena_address,
+                       int64_t small_object_threshold) {
+  if (directory != NULL) {
+    plasma_directory = directory;
+  }
+  slab_threshold = small_object_threshold;
+  if (slab_threshold > slot_sizes[PLASMA_NUM_SIZE_CLASSES - 1]) {
+    slab_threshold = slot_sizes[PLASMA_NUM_SIZE_CLASSES - 1];
+  }
+  if (arena_size == 0) {
+    return 0;
+  }
+  int fd;
+  if (arena_file != NULL) {
+    fd = open_arena_file(arena_file, arena_size);
+  } else {
+    fd = create_arena_buffer(&arena_size, directory == NULL);
+  }
+  if (fd < 0) {
+    LOG_ERR("could not create a buffer for the arena in %s",
+            arena_file != NULL ? arena_file : plasma_directory);
+    return -1;
+  }
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (populate) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+  /* The address is only a hint. The caller checks with plasma_arena_base if
+   * the arena ended up there. */
+  void *pointer =
+      mmap(arena_address, arena_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (pointer == MAP_FAILED) {
+    LOG_ERR("mmap of the arena failed");
+    close(fd);
+    return -1;
+  }
+#ifndef MAP_POPULATE
+  if (populate) {
+    /* Touch every page so the page faults happen now and not on create. */
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (int64_t i = 0; i < arena_size; i += page_size) {
+      ((volatile uint8_t *) pointer)[i] = 0;
+    }
+  }
+#endif
+  arena.fd = fd;
+  arena.pointer = pointer;
+  arena.size = arena_size;
+  arena_used = 0;
+  LOG_DEBUG("reserved arena of %" PRId64 " bytes at %p", arena_size, pointer);
+  return 0;
+}
+
+void *plasma_arena_base(void) {
+  return arena.pointer;
+}
+
+int64_t plasma_malloc_state_size(void) {
+  return sizeof(struct malloc_params) + sizeof(struct malloc_state) +
+         sizeof(int64_t) + sizeof(size_classes) + sizeof(int64_t);
+}
+
+void plasma_malloc_save_state(uint8_t *state) {
+  ensure_initialization();
+  memcpy(state, &mparams, sizeof(struct malloc_params));
+  state += sizeof(struct malloc_params);
+  memcpy(state, gm, sizeof(struct malloc_state));
+  state += sizeof(struct malloc_state);
+  memcpy(state, &arena_used, sizeof(int64_t));
+  state += sizeof(int64_t);
+  memcpy(state, size_classes, sizeof(size_classes));
+  state += sizeof(size_classes);
+  memcpy(state, &slab_threshold, sizeof(int64_t));
+}
+
+void plasma_malloc_load_state(const uint8_t *state) {
+  memcpy(&mparams, state, sizeof(struct malloc_params));
+  state += sizeof(struct malloc_params);
+  memcpy(gm, state, sizeof(struct malloc_state));
+  state += sizeof(struct malloc_state);
+  memcpy(&arena_used, state, sizeof(int64_t));
+  state += sizeof(int64_t);
+  memcpy(size_classes, state, sizeof(size_classes));
+  state += sizeof(size_classes);
+  /* The threshold decides how memory is freed, so it has to stay the same
+   * for the objects that are already there. */
+  memcpy(&slab_threshold, state, sizeof(int64_t));
+}
+
+/* Return the index of the smallest size class whose slots fit size bytes. */
+int find_size_class(size_t size) {
+  int size_class = 0;
+  while (slot_sizes[size_class] < size) {
+    size_class += 1;
+  }
+  return size_class;
+}
+
+/* Return the number of slots in a slab of a size class. */
+int64_t slots_per_slab(int size_class) {
+  return (SLAB_USABLE_SIZE - SLAB_HEADER_SIZE) / slot_sizes[size_class];
+}
+
+/* Take a slot from a slab that has free slots. */
+void *take_slot(struct size_class *c, slab *s) {
+  void *slot = s->free_slots;
+  if (slot != NULL) {
+    s->free_slots = *(void **) slot;
+  } else {
+    slot = s->next_unused;
+    s->next_unused += slot_sizes[s->size_class];
+  }
+  s->num_used += 1;
+  if (s->num_used == slots_per_slab(s->size_class)) {
+    DL_DELETE(c->partial_slabs, s);
+  }
+  return slot;
+}
+
+void *slab_malloc(size_t size) {
+  int size_class = find_size_class(size);
+  struct size_class *c = &size_classes[size_class];
+  if (c->partial_slabs == NULL) {
+    slab *s = dlmemalign(SLAB_SIZE, SLAB_USABLE_SIZE);
+    if (s == NULL) {
+      return NULL;
+    }
+    s->size_class = size_class;
+    s->num_used = 0;
+    s->free_slots = NULL;
+    s->next_unused = (uint8_t *) s + SLAB_HEADER_SIZE;
+    DL_APPEND(c->partial_slabs, s);
+    c->num_slabs += 1;
+  }
+  c->num_used_slots += 1;
+  c->bytes_requested += size;
+  return take_slot(c, c->partial_slabs);
+}
+
+void slab_free(void *pointer, size_t size) {
+  slab *s = (slab *) ((uintptr_t) pointer & ~((uintptr_t) SLAB_SIZE - 1));
+  struct size_class *c = &size_classes[s->size_class];
+  if (s->num_used == slots_per_slab(s->size_class)) {
+    DL_APPEND(c->partial_slabs, s);
+  }
+  *(void **) pointer = s->free_slots;
+  s->free_slots = pointer;
+  s->num_used -= 1;
+  c->num_used_slots -= 1;
+  c->bytes_requested -= size;
+  if (s->num_used == 0) {
+    /* Give empty slabs back, so that large objects can use the memory. */
+    DL_DELETE(c->partial_slabs, s);
+    c->num_slabs -= 1;
+    dlfree(s);
+  }
+}
+
+void *plasma_malloc(size_t size) {
+  if (size <= slab_threshold) {
+    return slab_malloc(size);
+  }
+  return dlmalloc(size);
+}
+
+void plasma_free(void *pointer, size_t size) {
+  if (size <= slab_threshold) {
+    slab_free(pointer, size);
+  } else {
+    dlfree(pointer);
+  }
+}
+
+void plasma_malloc_stats(plasma_allocator_stats *stats) {
+  memset(stats, 0, sizeof(plasma_allocator_stats));
+  stats->slab_size = SLAB_SIZE;
+  stats->small_object_threshold = slab_threshold;
+  for (int i = 0; i < PLASMA_NUM_SIZE_CLASSES; ++i) {
+    plasma_size_class_stats *class_stats = &stats->size_classes[i];
+    class_stats->slot_size = slot_sizes[i];
+    class_stats->num_slabs = size_classes[i].num_slabs;
+    class_stats->num_slots = size_classes[i].num_slabs * slots_per_slab(i);
+    class_stats->num_used_slots = size_classes[i].num_used_slots;
+    class_stats->bytes_requested = size_classes[i].bytes_requested;
+  }
+  ensure_initialization();
+  struct mallinfo info = dlmallinfo();
+  stats->footprint = info.arena;
+  stats->bytes_allocated = info.uordblks;
+  stats->bytes_free = info.fordblks;
+}
+
+/* dlmalloc grows its heap contiguously through this function when an arena
+ * has been reserved. Without an arena it always fails, so dlmalloc falls back
+ * to fake_mmap. */
+void *fake_sbrk(intptr_t increment) {
+  if (arena.pointer == NULL) {
+    return MFAIL;
+  }
+  if (arena_used + increment > arena.size || arena_used + increment < 0) {
+    return MFAIL;
+  }
+  void *old_break = (uint8_t *) arena.pointer + arena_used;
+  arena_used += increment;
+  return old_break;
+}
+
+/* Return the index of the last record whose segment starts at or below addr,
+ * or -1 if there is no such record. */
+int find_mmap_record(void *addr) {
+  int low = 0;
+  int high = num_records - 1;
+  int result = -1;
+  while (low <= high) {
+    int mid = low + (high - low) / 2;
+    if (records[mid].pointer <= addr) {
+      result = mid;
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return result;
+}
+
 void *fake_mmap(size_t size) {
+  if (arena.pointer != NULL) {
+    /* All memory has to come from the arena. */
+    return MFAIL;
+  }
+
   /* Add sizeof(size_t) so that the returned pointer is deliberately not
    * page-aligned. This ensures that the segments of memory returned by
    * fake_mmap are never contiguous. */
@@ -86,12 +439,19 @@ void *fake_mmap(size_t size) {
   /* Increase dlmalloc's allocation granularity directly. */
   mparams.granularity *= GRANULARITY_MULTIPLIER;
 
-  struct mmap_record *record = malloc(sizeof(struct mmap_record));
-  record->fd = fd;
-  record->pointer = pointer;
-  record->size = size;
-  HASH_ADD(hh_fd, records_by_fd, fd, sizeof(fd), record);
-  HASH_ADD(hh_pointer, records_by_pointer, pointer, sizeof(pointer), record);
+  if (num_records == records_capacity) {
+    records_capacity = records_capacity ? 2 * records_capacity : 16;
+    records = realloc(records, records_capacity * sizeof(struct mmap_record));
+    CHECK(records != NULL);
+  }
+  /* Insert the new record at its sorted position. */
+  int index = find_mmap_record(pointer) + 1;
+  memmove(&records[index + 1], &records[index],
+          (num_records - index) * sizeof(struct mmap_record));
+  records[index].fd = fd;
+  records[index].pointer = pointer;
+  records[index].size = size;
+  num_records += 1;
 
   /* We lie to dlmalloc about where mapped memory actually lives. */
   pointer += sizeof(size_t);
@@ -104,18 +464,18 @@ int fake_munmap(void *addr, size_t size) {
   addr -= sizeof(size_t);
   size += sizeof(size_t);
 
-  struct mmap_record *record;
-
-  HASH_FIND(hh_pointer, records_by_pointer, &addr, sizeof(addr), record);
-  if (record == NULL || record->size != size) {
+  int index = find_mmap_record(addr);
+  if (index == -1 || records[index].pointer != addr ||
+      records[index].size != size) {
     /* Reject requests to munmap that don't directly match previous
      * calls to mmap, to prevent dlmalloc from trimming. */
     return -1;
   }
-  close(record->fd);
+  close(records[index].fd);
 
-  HASH_DELETE(hh_fd, records_by_fd, record);
-  HASH_DELETE(hh_pointer, records_by_pointer, record);
+  memmove(&records[index], &records[index + 1],
+          (num_records - index - 1) * sizeof(struct mmap_record));
+  num_records -= 1;
 
   return munmap(addr, size);
 }
@@ -124,15 +484,18 @@ void get_malloc_mapinfo(void *addr,
                         int *fd,
                         int64_t *map_size,
                         ptrdiff_t *offset) {
-  struct mmap_record *record;
-  /* TODO(rshin): Implement a more efficient search through records_by_fd. */
-  for (record = records_by_fd; record != NULL; record = record->hh_fd.next) {
-    if (addr >= record->pointer && addr < record->pointer + record->size) {
-      *fd = record->fd;
-      *map_size = record->size;
-      *offset = addr - record->pointer;
-      return;
-    }
+  if (addr >= arena.pointer && addr < arena.pointer + arena.size) {
+    *fd = arena.fd;
+    *map_size = arena.size;
+    *offset = addr - arena.pointer;
+    return;
+  }
+  int index = find_mmap_record(addr);
+  if (index != -1 && addr < records[index].pointer + records[index].size) {
+    *fd = records[index].fd;
+    *map_size = records[index].size;
+    *offset = addr - records[index].pointer;
+    return;
   }
   *fd = -1;
   *map_size = 0;
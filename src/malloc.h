@@ -1,6 +1,106 @@
 #ifndef MALLOC_H
 #define MALLOC_H
 
+#include "plasma.h"
+
+/**
+ * Configure where the shared memory used by dlmalloc comes from. This must be
+ * called before the first allocation.
+ *
+ * @param directory The directory in which the memory mapped files are created,
+ *        for example a hugetlbfs mount like /dev/hugepages. If this is NULL,
+ *        /tmp is used (or an anonymous memfd for the arena where available).
+ * @param arena_size If this is nonzero, a single arena of this many bytes is
+ *        reserved up front and all objects are allocated from it. If this is
+ *        zero, a new memory mapped file is created for every segment.
+ * @param populate If this is nonzero, the arena is prefaulted so that page
+ *        faults don't happen when objects are created.
+ * @param arena_file If this is not NULL, the arena is kept in this file
+ *        instead of an unlinked one, so that its contents outlive the store.
+ *        The file is created if it does not exist.
+ * @param arena_address The address to map the arena at if possible, or NULL.
+ * @param small_object_threshold Allocations of at most this many bytes are
+ *        served from slabs of fixed size slots by plasma_malloc. If this is 0,
+ *        everything is allocated by dlmalloc.
+ * @return 0 on success and -1 if the arena could not be created.
+ */
+int init_plasma_malloc(const char *directory,
+                       int64_t arena_size,
+                       int populate,
+                       const char *arena_file,
+                       void *arena_address,
+                       int64_t small_object_threshold);
+
+/**
+ * Allocate shared memory. Small allocations are rounded up to the slot size
+ * of their size class and taken from a slab of that class, which avoids the
+ * per chunk overhead and the fragmentation of dlmalloc. The slabs themselves
+ * and all larger allocations come from dlmalloc.
+ *
+ * @param size The number of bytes to allocate.
+ * @return The address of the memory or NULL if there is not enough memory.
+ */
+void *plasma_malloc(size_t size);
+
+/**
+ * Free memory that was allocated with plasma_malloc.
+ *
+ * @param pointer The address returned by plasma_malloc.
+ * @param size The size that was passed to plasma_malloc.
+ * @return Void.
+ */
+void plasma_free(void *pointer, size_t size);
+
+/**
+ * Fill out statistics about the slabs and the dlmalloc heap.
+ *
+ * @param stats The statistics will be written here.
+ * @return Void.
+ */
+void plasma_malloc_stats(plasma_allocator_stats *stats);
+
+/**
+ * Return the address that the arena is mapped at, or NULL if there is no
+ * arena.
+ */
+void *plasma_arena_base(void);
+
+/**
+ * Return the size in bytes of the state of the allocator that
+ * plasma_malloc_save_state writes.
+ */
+int64_t plasma_malloc_state_size(void);
+
+/**
+ * Copy the state of the allocator, which lives outside of the arena, into a
+ * buffer of plasma_malloc_state_size bytes. Together with the contents of the
+ * arena file this is everything a later process needs to continue with the
+ * same heap.
+ *
+ * @param state The buffer to write the state to.
+ * @return Void.
+ */
+void plasma_malloc_save_state(uint8_t *state);
+
+/**
+ * Continue with an allocator state saved by plasma_malloc_save_state. This
+ * must be called before the first allocation, and only if the arena file is
+ * the one the state was saved for and it is mapped at the same address.
+ *
+ * @param state The saved state.
+ * @return Void.
+ */
+void plasma_malloc_load_state(const uint8_t *state);
+
+/**
+ * Create an unlinked file of the given size in the directory configured with
+ * init_plasma_malloc, which can be memory mapped and shared with clients.
+ *
+ * @param size The size in bytes of the file.
+ * @return The file descriptor of the file or -1 on failure.
+ */
+int create_buffer(int64_t size);
+
 void get_malloc_mapinfo(void *addr,
                         int *fd,
                         int64_t *map_length,
@@ -8,12 +8,18 @@
 #include <string.h>
 
 #include "common.h"
+#include "ring.h"
 
 typedef struct {
   int64_t data_size;
   int64_t metadata_size;
   int64_t create_time;
   int64_t construct_duration;
+  /** The digest of the data and metadata (see plasma_digest), or 0 if the
+   *  store does not compute digests. Objects with the same digest very
+   *  likely have the same contents, so a manager can skip sending the bytes
+   *  of an object whose contents the receiver already has. */
+  uint64_t digest;
 } plasma_object_info;
 
 /* Handle to access memory mapped file and map it into client address space */
@@ -37,14 +43,116 @@ typedef struct {
   int64_t data_size;
   /** The size in bytes of the metadata. */
   int64_t metadata_size;
+  /** The digest of the contents of a sealed object, or 0 if it is unknown
+   *  (see plasma_object_info). */
+  uint64_t digest;
 } plasma_object;
 
+/** The store puts this header in front of the data of every object, in the
+ *  same shared memory. */
+typedef struct {
+  /** The number of bytes at the beginning of the concatenated data and
+   *  metadata that have been written. The writer of an object may advance
+   *  this while the object is still unsealed, so that readers can start with
+   *  the beginning of the object. Sealing sets it to the full size. */
+  int64_t bytes_ready;
+  /** Set by the store if the object is aborted before it is sealed, so that
+   *  readers of the unsealed object stop waiting for the rest of it. This
+   *  also keeps the data as aligned as the allocations of the store. */
+  int64_t aborted;
+} plasma_object_header;
+
 enum object_status { OBJECT_NOT_FOUND = 0, OBJECT_FOUND = 1 };
 
+enum plasma_error {
+  /** The request was successful. */
+  PLASMA_OK = 0,
+  /** There is not enough memory in the store to create the object, even after
+   *  evicting all objects that can be evicted. */
+  PLASMA_OUT_OF_MEMORY,
+  /** The store cannot set up a shared memory channel on this platform. */
+  PLASMA_CHANNEL_UNAVAILABLE,
+  /** An object with the same ID has already been created. */
+  PLASMA_OBJECT_EXISTS,
+  /** An object that the request waited for was aborted by its creator, or
+   *  its creator disconnected before sealing it. */
+  PLASMA_OBJECT_ABORTED,
+  /** The store has no sealed object with the digest and sizes of an alias
+   *  request. */
+  PLASMA_CONTENT_NOT_FOUND,
+};
+
+enum plasma_notification_type {
+  /** The object has been sealed and can now be retrieved. */
+  PLASMA_NOTIFICATION_SEALED = 0,
+  /** The object has been evicted to free up memory in the store. */
+  PLASMA_NOTIFICATION_EVICTED,
+  /** The object has been deleted. */
+  PLASMA_NOTIFICATION_DELETED,
+};
+
+/** This is the message that is sent to subscribers for every notification. */
+typedef struct {
+  /** The ID of the object the notification is about. */
+  object_id object_id;
+  /** The type of the notification (see plasma_notification_type). */
+  int type;
+} plasma_notification;
+
+/** A notification as it is pushed onto a plasma_notification_ring. Unlike
+ *  plasma_notification, it carries the sizes of the object, so subscribers
+ *  don't need to get the object to learn them. */
+typedef struct {
+  /** The ID of the object the notification is about. */
+  object_id object_id;
+  /** The type of the notification (see plasma_notification_type). */
+  int type;
+  /** The size in bytes of the object's data. */
+  int64_t data_size;
+  /** The size in bytes of the object's metadata. */
+  int64_t metadata_size;
+} plasma_ring_notification;
+
+/** Notifications in shared memory, which a subscriber can read without system
+ *  calls. The store pushes a plasma_ring_notification for every sealed or
+ *  evicted object and writes a byte to the subscriber's socket when it pushes
+ *  onto an empty ring, so that a subscriber can sleep on the socket. If the
+ *  ring is full, the store keeps the notifications and sets store_waiting;
+ *  the subscriber then writes a byte to the socket after making room. */
+typedef struct {
+  /** The notifications. The type of a message is the type of the
+   *  notification. */
+  ring notifications;
+  /** Set by the store when it could not push because the ring was full. */
+  int64_t store_waiting;
+} plasma_notification_ring;
+
+/** The maximum size in bytes of the metadata tag of a subscription. */
+#define PLASMA_MAX_METADATA_TAG_SIZE 32
+
+/** Which notifications a subscriber gets. A filter whose fields are all zero
+ *  lets every notification through. */
+typedef struct {
+  /** If this is 1, the subscriber first gets a PLASMA_NOTIFICATION_SEALED for
+   *  every sealed object that already exists, and after that the
+   *  notifications about objects that are sealed or evicted later, without
+   *  any object missing or appearing twice. Spilled objects are only listed
+   *  if the filter has no metadata tag, because their metadata is on disk. */
+  int64_t include_existing;
+  /** Only notify about objects whose IDs start with the first id_prefix_size
+   *  bytes of id_prefix. */
+  int64_t id_prefix_size;
+  object_id id_prefix;
+  /** Only notify about objects whose metadata starts with the first
+   *  metadata_tag_size bytes of metadata_tag. */
+  int64_t metadata_tag_size;
+  uint8_t metadata_tag[PLASMA_MAX_METADATA_TAG_SIZE];
+} plasma_subscription_filter;
+
 enum plasma_message_type {
   /** Create a new object. */
   PLASMA_CREATE = 128,
-  /** Get an object. */
+  /** Get one or more objects, waiting for them up to a timeout. */
   PLASMA_GET,
   /** Check if an object is present. */
   PLASMA_CONTAINS,
@@ -52,14 +160,59 @@ enum plasma_message_type {
   PLASMA_SEAL,
   /** Delete an object. */
   PLASMA_DELETE,
-  /** Subscribe to notifications about sealed objects. */
+  /** Subscribe to notifications about sealed objects. A
+   *  plasma_subscription_filter may follow the request (see
+   *  plasma_subscription_request_filter). */
   PLASMA_SUBSCRIBE,
   /** Request transfer to another store. */
   PLASMA_TRANSFER,
   /** Header for sending data. */
   PLASMA_DATA,
+  /** Release an object that was created or gotten before. */
+  PLASMA_RELEASE,
+  /** Set up a shared memory channel for the requests of this client. */
+  PLASMA_OPEN_CHANNEL,
+  /** Ask the local Plasma Manager to pull objects from another manager. */
+  PLASMA_FETCH,
+  /** Ask a Plasma Manager to send an object to a list of other managers, which
+   *  follows the request (see plasma_broadcast_managers). */
+  PLASMA_BROADCAST,
+  /** Get statistics about the memory allocator of the store. */
+  PLASMA_ALLOCATOR_STATS,
+  /** Subscribe to notifications through a plasma_notification_ring. This
+   *  takes a filter like PLASMA_SUBSCRIBE. */
+  PLASMA_SUBSCRIBE_RING,
+  /** Throw away an object that the client created but has not sealed. */
+  PLASMA_ABORT,
+  /** Create a sealed object with the same contents as an object in the store
+   *  that has the digest and sizes of the request, without copying them. */
+  PLASMA_ALIAS,
+  /** Header for sending data in compressed blocks. */
+  PLASMA_DATA_COMPRESSED,
+  /** Tell a Plasma Manager that the sender accepts compressed data. */
+  PLASMA_COMPRESSION,
+  /** Tell the Plasma Manager that keeps the location of an object in the
+   *  object directory that the store of the sender has the object. */
+  PLASMA_LOCATION_ADD,
+  /** Tell the Plasma Manager that keeps the location of an object that the
+   *  store of the sender does not have the object anymore. */
+  PLASMA_LOCATION_REMOVE,
+  /** Ask for the Plasma Managers whose stores have an object. The answer is a
+   *  PLASMA_LOCATIONS message. */
+  PLASMA_LOCATE,
+  /** The Plasma Managers whose stores have an object, which follow the
+   *  message (see plasma_broadcast_managers). */
+  PLASMA_LOCATIONS,
 };
 
+/** The address of a Plasma Manager. */
+typedef struct {
+  /** The IP address of the Plasma Manager. */
+  uint8_t addr[4];
+  /** The port of the Plasma Manager. */
+  int port;
+} plasma_manager_addr;
+
 typedef struct {
   /** The ID of the object that the request is about. */
   object_id object_id;
@@ -68,19 +221,155 @@ typedef struct {
   /** The size of the object's metadata. */
   int64_t metadata_size;
   /** In a transfer request, this is the IP address of the Plasma Manager to
-   *  transfer the object to. */
+   *  transfer the object to. In a fetch request, it is the address of the
+   *  Plasma Manager that has the objects, or 0.0.0.0 to find them in the
+   *  object directory. In a data request that carries a digest and in
+   *  compression, location and locate requests between Plasma Managers, it
+   *  is the address of the sending Plasma Manager. */
   uint8_t addr[4];
   /** In a transfer request, this is the port of the Plasma Manager to transfer
-   *  the object to. */
+   *  the object to. In a fetch request, it is the port of the Plasma Manager
+   *  that has the objects, or 0 to find them in the object directory. In a
+   *  data request that carries a digest and in compression, location and
+   *  locate requests between Plasma Managers, it is the port of the sending
+   *  Plasma Manager. A client sends locate requests with port 0. */
   int port;
+  /** In a get or fetch request, the number of objects in object_ids. */
+  int64_t num_object_ids;
+  /** In a get request, the store replies as soon as this many of the objects
+   *  are available. */
+  int64_t num_ready;
+  /** In a get request, the number of milliseconds after which the store
+   *  replies with whatever objects are available. If this is -1, the store
+   *  waits until num_ready objects are available. In a locate request between
+   *  Plasma Managers, this is 0 to get an answer right away and -1 to wait
+   *  until some store has the object; the locations message repeats it. */
+  int64_t timeout_ms;
+  /** In a get request, whether objects that have been created but not sealed
+   *  yet are returned too. If this is 1, the store returns objects as soon as
+   *  they are created. */
+  int64_t include_unsealed;
+  /** In a data request, the offset of the range that follows the request in
+   *  the concatenated data and metadata of the object. */
+  int64_t range_offset;
+  /** In a data request, the size in bytes of the range that follows. */
+  int64_t range_size;
+  /** In an alias request, the digest of the contents of the object. In a data
+   *  request with an empty range, the receiver should create the object from
+   *  an object with this digest that it already has. In a transfer request,
+   *  the receiver did not have these contents, so all bytes must be sent. */
+  uint64_t digest;
+  /** In a get or fetch request, the IDs of the objects to get. */
+  object_id object_ids[];
 } plasma_request;
 
+/** The size in bytes of a request with num_object_ids object IDs. */
+static inline int64_t plasma_request_size(int64_t num_object_ids) {
+  return sizeof(plasma_request) + num_object_ids * sizeof(object_id);
+}
+
+/** The size in bytes of a broadcast request to num_managers managers. */
+static inline int64_t plasma_broadcast_request_size(int64_t num_managers) {
+  return sizeof(plasma_request) + num_managers * sizeof(plasma_manager_addr);
+}
+
+/** The managers of a broadcast request or a locations message. They are
+ *  stored after the request instead of in fields of it, so that plasma_request
+ *  stays small enough for the shared memory channel. */
+static inline plasma_manager_addr *plasma_broadcast_managers(
+    plasma_request *req) {
+  return (plasma_manager_addr *) (req + 1);
+}
+
+/** The filter of a subscribe request. It is stored after the request like the
+ *  managers of a broadcast request. Requests without it subscribe to all
+ *  notifications. */
+static inline plasma_subscription_filter *plasma_subscription_request_filter(
+    plasma_request *req) {
+  return (plasma_subscription_filter *) (req + 1);
+}
+
 typedef struct {
   /** The object that is returned with this reply. */
   plasma_object object;
   /** This is used only to respond to requests of type PLASMA_CONTAINS. It is 1
    *  if the object is present and 0 otherwise. Used for plasma_contains. */
   int has_object;
+  /** The result of the request (see plasma_error). Used for plasma_create. */
+  int error_code;
+  /** In a reply to a get request, the number of objects in objects. */
+  int64_t num_objects;
+  /** In a reply to a get request, the number of file descriptors that are sent
+   *  after the reply. Each one is sent with its store_fd as the payload. */
+  int64_t num_fds;
+  /** In a reply to a get request, the requested objects in the order of the
+   *  request. Objects that were not available in time have a store_fd of -1. */
+  plasma_object objects[];
 } plasma_reply;
 
+/** The size in bytes of a reply with num_objects objects. */
+static inline int64_t plasma_reply_size(int64_t num_objects) {
+  return sizeof(plasma_reply) + num_objects * sizeof(plasma_object);
+}
+
+/** The number of size classes of the slab allocator for small objects. */
+#define PLASMA_NUM_SIZE_CLASSES 15
+
+/** Statistics about one size class of the slab allocator. */
+typedef struct {
+  /** The size in bytes of the slots of this class. */
+  int64_t slot_size;
+  /** The number of slabs that are carved into slots of this class. */
+  int64_t num_slabs;
+  /** The number of slots in these slabs. */
+  int64_t num_slots;
+  /** The number of slots that are in use. */
+  int64_t num_used_slots;
+  /** The number of bytes that the allocations in the used slots asked for.
+   *  The rest of the used slots is internal fragmentation. */
+  int64_t bytes_requested;
+} plasma_size_class_stats;
+
+/** The reply to a PLASMA_ALLOCATOR_STATS request. */
+typedef struct {
+  /** The size in bytes of a slab. */
+  int64_t slab_size;
+  /** Objects whose memory, including the object header, is at most this many
+   *  bytes are allocated from slabs. If this is 0, slabs are not used. */
+  int64_t small_object_threshold;
+  /** The statistics of the size classes, from the smallest to the largest. */
+  plasma_size_class_stats size_classes[PLASMA_NUM_SIZE_CLASSES];
+  /** The number of bytes that dlmalloc has obtained from the system. */
+  int64_t footprint;
+  /** The number of bytes in chunks that dlmalloc has handed out, including
+   *  the slabs. */
+  int64_t bytes_allocated;
+  /** The number of bytes in free chunks of dlmalloc. */
+  int64_t bytes_free;
+} plasma_allocator_stats;
+
+/** A shared memory channel between a client and the store. The client pushes
+ *  create, seal, contains, release, delete and abort requests onto the
+ *  requests ring and the store pushes the replies to create and contains
+ *  requests onto the replies ring. The store is woken up by an eventfd when
+ *  the client pushes onto an empty requests ring. The client is woken up by a
+ *  second eventfd, but only while it says that it is waiting. All other
+ *  requests keep using the socket. */
+typedef struct {
+  /** Requests from the client to the store. */
+  ring requests;
+  /** Replies from the store to the client. */
+  ring replies;
+  /** Set by the client before it blocks on its eventfd, so the store knows
+   *  that it has to write to the eventfd after making progress. */
+  int64_t client_waiting;
+} plasma_channel;
+
+/** Check if requests of this type can be sent through a plasma_channel. */
+static inline int plasma_channel_message(int64_t type) {
+  return type == PLASMA_CREATE || type == PLASMA_SEAL ||
+         type == PLASMA_CONTAINS || type == PLASMA_RELEASE ||
+         type == PLASMA_DELETE || type == PLASMA_ABORT;
+}
+
 #endif
@@ -1,6 +1,7 @@
 /* PLASMA CLIENT: Client library for using the plasma store and manager */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,10 +9,13 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
 #include <sys/un.h>
 #include <strings.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
 
 #include "common.h"
 #include "io.h"
@@ -26,6 +30,11 @@ typedef struct {
   int key;
   /** The result of mmap for this file descriptor. */
   uint8_t *pointer;
+  /** The file descriptor of the segment in this process. It is kept open so
+   *  that the segment can be read with sendfile. */
+  int fd;
+  /** The size in bytes of the mapping. */
+  int64_t length;
   /** Handle for the uthash table. */
   UT_hash_handle hh;
 } client_mmap_table_entry;
@@ -37,13 +46,121 @@ struct plasma_store_conn {
   int conn;
   /** Table of dlmalloc buffer files that have been memory mapped so far. */
   client_mmap_table_entry *mmap_table;
+  /** The shared memory channel to the store, or NULL if all requests go
+   *  through the socket. */
+  plasma_channel *channel;
+  /** The eventfd that wakes up the store. */
+  int store_eventfd;
+  /** The eventfd that the store uses to wake up this client. */
+  int client_eventfd;
 };
 
+/** How often the client checks the channel before it blocks on its eventfd
+ *  while waiting for the store. */
+#define PLASMA_CHANNEL_SPIN 1000
+
+/** How often plasma_wait_bytes checks the watermark of an object before it
+ *  starts to sleep between checks. */
+#define PLASMA_STREAM_SPIN 1000
+
+/** The longest time in microseconds that plasma_wait_bytes sleeps between two
+ *  checks of the watermark. */
+#define PLASMA_STREAM_MAX_SLEEP_US 1000
+
 void plasma_send_request(int fd, int type, plasma_request *req) {
-  int req_count = sizeof(plasma_request);
+  int64_t req_count = plasma_request_size(req->num_object_ids);
   write_message(fd, type, req_count, (uint8_t *) req);
 }
 
+/* Read exactly length bytes from the socket. */
+void plasma_read_bytes(int fd, uint8_t *cursor, int64_t length) {
+  while (length > 0) {
+    ssize_t nbytes = read(fd, cursor, length);
+    if (nbytes < 0 && errno == EINTR) {
+      continue;
+    }
+    CHECKM(nbytes > 0, "read from the plasma store failed");
+    cursor += nbytes;
+    length -= nbytes;
+  }
+}
+
+int channel_has_reply(plasma_channel *channel) {
+  return !ring_empty(&channel->replies);
+}
+
+int channel_has_room(plasma_channel *channel) {
+  return !ring_full(&channel->requests);
+}
+
+int channel_is_drained(plasma_channel *channel) {
+  return ring_empty(&channel->requests);
+}
+
+/* Wait until the store made enough progress on the channel. The client spins
+ * for a while and then sleeps on its eventfd. The store only writes to the
+ * eventfd while client_waiting is set. */
+void plasma_channel_wait(plasma_store_conn *conn,
+                         int (*done)(plasma_channel *channel)) {
+  plasma_channel *channel = conn->channel;
+  for (int i = 0; i < PLASMA_CHANNEL_SPIN; ++i) {
+    if (done(channel)) {
+      return;
+    }
+  }
+  while (1) {
+    __atomic_store_n(&channel->client_waiting, 1, __ATOMIC_SEQ_CST);
+    if (done(channel)) {
+      break;
+    }
+    uint64_t count;
+    CHECKM(read(conn->client_eventfd, &count, sizeof(count)) > 0,
+           "read from the eventfd failed");
+  }
+  __atomic_store_n(&channel->client_waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Send a request to the store, through the channel if possible. Requests that
+ * go through the socket are only sent once the store has processed everything
+ * that is still in the channel, so the store sees all requests in order. */
+void plasma_store_send(plasma_store_conn *conn,
+                       int type,
+                       plasma_request *req) {
+  if (conn->channel == NULL) {
+    plasma_send_request(conn->conn, type, req);
+    return;
+  }
+  if (!plasma_channel_message(type)) {
+    plasma_channel_wait(conn, channel_is_drained);
+    plasma_send_request(conn->conn, type, req);
+    return;
+  }
+  int status;
+  while ((status = ring_push(&conn->channel->requests, type,
+                             sizeof(plasma_request), (uint8_t *) req)) == -1) {
+    plasma_channel_wait(conn, channel_has_room);
+  }
+  if (status == 1) {
+    /* The store may have gone to sleep after draining the channel. */
+    uint64_t one = 1;
+    CHECKM(write(conn->store_eventfd, &one, sizeof(one)) == sizeof(one),
+           "write to the eventfd failed");
+  }
+}
+
+/* Receive the reply to a create or contains request. */
+void plasma_store_recv_reply(plasma_store_conn *conn, plasma_reply *reply) {
+  if (conn->channel == NULL) {
+    plasma_read_bytes(conn->conn, (uint8_t *) reply, sizeof(plasma_reply));
+    return;
+  }
+  plasma_channel_wait(conn, channel_has_reply);
+  ring_message *message = ring_front(&conn->channel->replies);
+  CHECK(message->length == sizeof(plasma_reply));
+  memcpy(reply, message->data, sizeof(plasma_reply));
+  ring_pop(&conn->channel->replies);
+}
+
 /* If the file descriptor fd has been mmapped in this client process before,
  * return the pointer that was returned by mmap, otherwise mmap it and store the
  * pointer in a hash table. */
@@ -63,21 +180,58 @@ uint8_t *lookup_or_mmap(plasma_store_conn *conn,
       LOG_ERR("mmap failed");
       exit(-1);
     }
-    close(fd);
     entry = malloc(sizeof(client_mmap_table_entry));
     entry->key = store_fd_val;
     entry->pointer = result;
+    entry->fd = fd;
+    entry->length = map_size;
     HASH_ADD_INT(conn->mmap_table, key, entry);
     return result;
   }
 }
 
-void plasma_create(plasma_store_conn *conn,
-                   object_id object_id,
-                   int64_t data_size,
-                   uint8_t *metadata,
-                   int64_t metadata_size,
-                   uint8_t **data) {
+/* Return the address at which the segment store_fd_val is mapped. If the store
+ * sent its file descriptor along with the reply (because this client has not
+ * seen the segment before), receive it and map the segment first. */
+uint8_t *lookup_or_recv_mmap(plasma_store_conn *conn,
+                             int64_t num_fds,
+                             int store_fd_val,
+                             int64_t map_size) {
+  if (num_fds == 0) {
+    client_mmap_table_entry *entry;
+    HASH_FIND_INT(conn->mmap_table, &store_fd_val, entry);
+    CHECKM(entry != NULL, "the store did not send an unknown segment");
+    return entry->pointer;
+  }
+  CHECK(num_fds == 1);
+  int received_fd_val;
+  int fd = recv_fd(conn->conn, (char *) &received_fd_val, sizeof(int));
+  CHECKM(fd != -1, "recv not successful");
+  CHECK(received_fd_val == store_fd_val);
+  return lookup_or_mmap(conn, fd, store_fd_val, map_size);
+}
+
+int plasma_object_fd(plasma_store_conn *conn,
+                     uint8_t *address,
+                     int *fd,
+                     int64_t *offset) {
+  client_mmap_table_entry *entry, *tmp;
+  HASH_ITER(hh, conn->mmap_table, entry, tmp) {
+    if (address >= entry->pointer && address < entry->pointer + entry->length) {
+      *fd = entry->fd;
+      *offset = address - entry->pointer;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int plasma_create(plasma_store_conn *conn,
+                  object_id object_id,
+                  int64_t data_size,
+                  uint8_t *metadata,
+                  int64_t metadata_size,
+                  uint8_t **data) {
   LOG_DEBUG("called plasma_create on conn %d with size %" PRId64
             " and metadata size "
             "%" PRId64,
@@ -85,16 +239,22 @@ void plasma_create(plasma_store_conn *conn,
   plasma_request req = {.object_id = object_id,
                         .data_size = data_size,
                         .metadata_size = metadata_size};
-  plasma_send_request(conn->conn, PLASMA_CREATE, &req);
+  plasma_store_send(conn, PLASMA_CREATE, &req);
   plasma_reply reply;
-  int fd = recv_fd(conn->conn, (char *) &reply, sizeof(plasma_reply));
+  plasma_store_recv_reply(conn, &reply);
+  if (reply.error_code != PLASMA_OK) {
+    /* The store did not send a file descriptor along with the error. */
+    LOG_DEBUG("plasma_create failed with error code %d", reply.error_code);
+    *data = NULL;
+    return reply.error_code;
+  }
   plasma_object *object = &reply.object;
   CHECK(object->data_size == data_size);
   CHECK(object->metadata_size == metadata_size);
   /* The metadata should come right after the data. */
   CHECK(object->metadata_offset == object->data_offset + data_size);
-  *data = lookup_or_mmap(conn, fd, object->handle.store_fd,
-                         object->handle.mmap_size) +
+  *data = lookup_or_recv_mmap(conn, reply.num_fds, object->handle.store_fd,
+                              object->handle.mmap_size) +
           object->data_offset;
   /* If plasma_create is being called from a transfer, then we will not copy the
    * metadata here. The metadata will be written along with the data streamed
@@ -103,6 +263,134 @@ void plasma_create(plasma_store_conn *conn,
     /* Copy the metadata to the buffer. */
     memcpy(*data + object->data_size, metadata, metadata_size);
   }
+  return PLASMA_OK;
+}
+
+/* Send a get request and map the objects of the reply. This implements
+ * plasma_get_many and plasma_get_stream. */
+int64_t plasma_get_objects(plasma_store_conn *conn,
+                           int64_t num_object_ids,
+                           object_id object_ids[],
+                           int64_t num_ready,
+                           int64_t timeout_ms,
+                           int include_unsealed,
+                           object_buffer buffers[]) {
+  CHECK(num_object_ids > 0);
+  plasma_request *req = malloc(plasma_request_size(num_object_ids));
+  memset(req, 0, sizeof(plasma_request));
+  req->num_object_ids = num_object_ids;
+  req->num_ready = num_ready;
+  req->timeout_ms = timeout_ms;
+  req->include_unsealed = include_unsealed;
+  memcpy(req->object_ids, object_ids, num_object_ids * sizeof(object_id));
+  plasma_store_send(conn, PLASMA_GET, req);
+  free(req);
+
+  plasma_reply *reply = malloc(plasma_reply_size(num_object_ids));
+  plasma_read_bytes(conn->conn, (uint8_t *) reply, sizeof(plasma_reply));
+  CHECK(reply->num_objects == num_object_ids);
+  plasma_read_bytes(conn->conn, (uint8_t *) reply->objects,
+                    num_object_ids * sizeof(plasma_object));
+  /* Map the segments that contain the objects. Each file descriptor is sent
+   * along with the store's value for it. */
+  for (int64_t i = 0; i < reply->num_fds; ++i) {
+    int store_fd_val;
+    int fd = recv_fd(conn->conn, (char *) &store_fd_val, sizeof(int));
+    CHECKM(fd != -1, "recv not successful");
+    int64_t map_size = -1;
+    for (int64_t j = 0; j < num_object_ids; ++j) {
+      if (reply->objects[j].handle.store_fd == store_fd_val) {
+        map_size = reply->objects[j].handle.mmap_size;
+        break;
+      }
+    }
+    CHECK(map_size != -1);
+    lookup_or_mmap(conn, fd, store_fd_val, map_size);
+  }
+  int64_t num_available = 0;
+  for (int64_t i = 0; i < num_object_ids; ++i) {
+    plasma_object *object = &reply->objects[i];
+    if (object->handle.store_fd == -1) {
+      memset(&buffers[i], 0, sizeof(object_buffer));
+      continue;
+    }
+    client_mmap_table_entry *entry;
+    HASH_FIND_INT(conn->mmap_table, &object->handle.store_fd, entry);
+    CHECK(entry != NULL);
+    buffers[i].data = entry->pointer + object->data_offset;
+    buffers[i].data_size = object->data_size;
+    buffers[i].metadata = buffers[i].data + object->data_size;
+    buffers[i].metadata_size = object->metadata_size;
+    buffers[i].digest = object->digest;
+    num_available += 1;
+  }
+  free(reply);
+  return num_available;
+}
+
+int64_t plasma_get_many(plasma_store_conn *conn,
+                        int64_t num_object_ids,
+                        object_id object_ids[],
+                        int64_t num_ready,
+                        int64_t timeout_ms,
+                        object_buffer buffers[]) {
+  return plasma_get_objects(conn, num_object_ids, object_ids, num_ready,
+                            timeout_ms, 0, buffers);
+}
+
+int plasma_get_stream(plasma_store_conn *conn,
+                      object_id object_id,
+                      int64_t timeout_ms,
+                      object_buffer *buffer) {
+  return plasma_get_objects(conn, 1, &object_id, 1, timeout_ms, 1, buffer);
+}
+
+/* The header of an object is right in front of its data. */
+plasma_object_header *plasma_object_header_of(uint8_t *data) {
+  return (plasma_object_header *) (data - sizeof(plasma_object_header));
+}
+
+void plasma_mark_bytes_ready(uint8_t *data, int64_t bytes_ready) {
+  __atomic_store_n(&plasma_object_header_of(data)->bytes_ready, bytes_ready,
+                   __ATOMIC_RELEASE);
+}
+
+int64_t plasma_wait_bytes(uint8_t *data,
+                          int64_t num_bytes,
+                          int64_t timeout_ms) {
+  plasma_object_header *header = plasma_object_header_of(data);
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  int64_t sleep_us = 1;
+  for (int i = 0;; ++i) {
+    int64_t bytes_ready =
+        __atomic_load_n(&header->bytes_ready, __ATOMIC_ACQUIRE);
+    if (bytes_ready >= num_bytes) {
+      return bytes_ready;
+    }
+    if (__atomic_load_n(&header->aborted, __ATOMIC_ACQUIRE)) {
+      return -1;
+    }
+    if (i < PLASMA_STREAM_SPIN && timeout_ms != 0) {
+      continue;
+    }
+    if (timeout_ms >= 0) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      int64_t elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
+                           (now.tv_usec - start.tv_usec) / 1000;
+      if (elapsed_ms >= timeout_ms) {
+        return bytes_ready;
+      }
+    }
+    /* The writer does not wake up readers, so back off until the data comes
+     * in at the rate it arrives. */
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = sleep_us * 1000};
+    nanosleep(&pause, NULL);
+    if (sleep_us < PLASMA_STREAM_MAX_SLEEP_US) {
+      sleep_us *= 2;
+    }
+  }
 }
 
 /* This method is used to get both the data and the metadata. */
@@ -112,20 +400,14 @@ void plasma_get(plasma_store_conn *conn,
                 uint8_t **data,
                 int64_t *metadata_size,
                 uint8_t **metadata) {
-  plasma_request req = {.object_id = object_id};
-  plasma_send_request(conn->conn, PLASMA_GET, &req);
-  plasma_reply reply;
-  int fd = recv_fd(conn->conn, (char *) &reply, sizeof(plasma_reply));
-  CHECKM(fd != -1, "recv not successful");
-  plasma_object *object = &reply.object;
-  *data = lookup_or_mmap(conn, fd, object->handle.store_fd,
-                         object->handle.mmap_size) +
-          object->data_offset;
-  *size = object->data_size;
+  object_buffer buffer;
+  plasma_get_many(conn, 1, &object_id, 1, -1, &buffer);
+  *data = buffer.data;
+  *size = buffer.data_size;
   /* If requested, return the metadata as well. */
   if (metadata != NULL) {
-    *metadata = *data + object->data_size;
-    *metadata_size = object->metadata_size;
+    *metadata = buffer.metadata;
+    *metadata_size = buffer.metadata_size;
   }
 }
 
@@ -134,25 +416,89 @@ void plasma_contains(plasma_store_conn *conn,
                      object_id object_id,
                      int *has_object) {
   plasma_request req = {.object_id = object_id};
-  plasma_send_request(conn->conn, PLASMA_CONTAINS, &req);
+  plasma_store_send(conn, PLASMA_CONTAINS, &req);
   plasma_reply reply;
-  int r = read(conn->conn, &reply, sizeof(plasma_reply));
-  CHECKM(r != -1, "read error");
-  CHECKM(r != 0, "connection disconnected");
+  plasma_store_recv_reply(conn, &reply);
   *has_object = reply.has_object;
 }
 
 void plasma_seal(plasma_store_conn *conn, object_id object_id) {
   plasma_request req = {.object_id = object_id};
-  plasma_send_request(conn->conn, PLASMA_SEAL, &req);
+  plasma_store_send(conn, PLASMA_SEAL, &req);
+}
+
+void plasma_release(plasma_store_conn *conn, object_id object_id) {
+  plasma_request req = {.object_id = object_id};
+  plasma_store_send(conn, PLASMA_RELEASE, &req);
 }
 
 void plasma_delete(plasma_store_conn *conn, object_id object_id) {
   plasma_request req = {.object_id = object_id};
-  plasma_send_request(conn->conn, PLASMA_DELETE, &req);
+  plasma_store_send(conn, PLASMA_DELETE, &req);
+}
+
+void plasma_abort(plasma_store_conn *conn, object_id object_id) {
+  plasma_request req = {.object_id = object_id};
+  plasma_store_send(conn, PLASMA_ABORT, &req);
+}
+
+int plasma_create_alias(plasma_store_conn *conn,
+                        object_id object_id,
+                        uint64_t digest,
+                        int64_t data_size,
+                        int64_t metadata_size) {
+  plasma_request req = {.object_id = object_id,
+                        .data_size = data_size,
+                        .metadata_size = metadata_size,
+                        .digest = digest};
+  /* Alias requests are not sent through the channel, so the reply comes over
+   * the socket. */
+  plasma_store_send(conn, PLASMA_ALIAS, &req);
+  plasma_reply reply;
+  plasma_read_bytes(conn->conn, (uint8_t *) &reply, sizeof(plasma_reply));
+  return reply.error_code;
+}
+
+void plasma_get_allocator_stats(plasma_store_conn *conn,
+                                plasma_allocator_stats *stats) {
+  plasma_request req = {};
+  plasma_store_send(conn, PLASMA_ALLOCATOR_STATS, &req);
+  plasma_read_bytes(conn->conn, (uint8_t *) stats,
+                    sizeof(plasma_allocator_stats));
+}
+
+/* Send a subscribe request with an optional filter, followed by the socket
+ * that the store should use for the subscription. */
+void plasma_send_subscribe(plasma_store_conn *conn,
+                           int type,
+                           plasma_subscription_filter *filter,
+                           int subscriber_fd) {
+  /* The file descriptor is passed over the socket, so requests that are
+   * still in the channel must be processed first. */
+  if (conn->channel != NULL) {
+    plasma_channel_wait(conn, channel_is_drained);
+  }
+  int64_t size = sizeof(plasma_request) +
+                 (filter != NULL ? sizeof(plasma_subscription_filter) : 0);
+  plasma_request *req = malloc(size);
+  memset(req, 0, size);
+  if (filter != NULL) {
+    *plasma_subscription_request_filter(req) = *filter;
+  }
+  write_message(conn->conn, type, size, (uint8_t *) req);
+  free(req);
+  /* We include a one byte message because otherwise it seems to hang on
+   * Linux. */
+  char dummy = '\0';
+  send_fd(conn->conn, subscriber_fd, &dummy, 1);
 }
 
 int plasma_subscribe(plasma_store_conn *conn) {
+  return plasma_subscribe_filtered(conn, NULL);
+}
+
+int plasma_subscribe_filtered(plasma_store_conn *conn,
+                              plasma_subscription_filter *filter) {
   int fd[2];
   /* Create a non-blocking socket pair. This will only be used to send
    * notifications from the Plasma store to the client. */
@@ -160,19 +506,73 @@ int plasma_subscribe(plasma_store_conn *conn) {
   /* Make the socket non-blocking. */
   int flags = fcntl(fd[1], F_GETFL, 0);
   CHECK(fcntl(fd[1], F_SETFL, flags | O_NONBLOCK) == 0);
-  /* Tell the Plasma store about the subscription. */
-  plasma_request req = {};
-  plasma_send_request(conn->conn, PLASMA_SUBSCRIBE, &req);
-  /* Send the file descriptor that the Plasma store should use to push
-   * notifications about sealed objects to this client. We include a one byte
-   * message because otherwise it seems to hang on Linux. */
-  char dummy = '\0';
-  send_fd(conn->conn, fd[1], &dummy, 1);
+  /* Tell the Plasma store about the subscription and send the file
+   * descriptor that it should use to push notifications about sealed objects
+   * to this client. */
+  plasma_send_subscribe(conn, PLASMA_SUBSCRIBE, filter, fd[1]);
   /* Return the file descriptor that the client should use to read notifications
    * about sealed objects. */
   return fd[0];
 }
 
+int plasma_subscribe_ring(plasma_store_conn *conn,
+                          plasma_subscription_filter *filter,
+                          plasma_notification_ring **ring) {
+  int fd[2];
+  /* The socket pair is only used to wake up the other side. */
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+  int flags = fcntl(fd[1], F_GETFL, 0);
+  CHECK(fcntl(fd[1], F_SETFL, flags | O_NONBLOCK) == 0);
+  plasma_send_subscribe(conn, PLASMA_SUBSCRIBE_RING, filter, fd[1]);
+  close(fd[1]);
+  plasma_reply reply;
+  plasma_read_bytes(conn->conn, (uint8_t *) &reply, sizeof(plasma_reply));
+  if (reply.error_code != PLASMA_OK) {
+    LOG_DEBUG("the store could not set up a notification ring");
+    close(fd[0]);
+    return -1;
+  }
+  int store_fd_val;
+  int shm_fd = recv_fd(conn->conn, (char *) &store_fd_val, sizeof(int));
+  CHECKM(shm_fd != -1, "recv not successful");
+  *ring = mmap(NULL, sizeof(plasma_notification_ring), PROT_READ | PROT_WRITE,
+               MAP_SHARED, shm_fd, 0);
+  CHECKM(*ring != MAP_FAILED, "mmap failed");
+  close(shm_fd);
+  return fd[0];
+}
+
+int plasma_get_notification(int fd,
+                            plasma_notification_ring *ring,
+                            int64_t timeout_ms,
+                            plasma_ring_notification *notification) {
+  ring_message *message;
+  while ((message = ring_front(&ring->notifications)) == NULL) {
+    /* The store writes to the socket after pushing onto an empty ring. */
+    struct pollfd poll_fd = {.fd = fd, .events = POLLIN};
+    int status = poll(&poll_fd, 1, timeout_ms);
+    if (status == 0) {
+      return 0;
+    }
+    if (status > 0) {
+      char buffer[64];
+      if (recv(fd, buffer, sizeof(buffer), 0) == 0 &&
+          ring_empty(&ring->notifications)) {
+        /* The store went away, so no more notifications will come. */
+        return 0;
+      }
+    }
+  }
+  memcpy(notification, message->data, sizeof(plasma_ring_notification));
+  ring_pop(&ring->notifications);
+  /* Tell the store that there is room if it has notifications waiting. */
+  if (__atomic_exchange_n(&ring->store_waiting, 0, __ATOMIC_SEQ_CST)) {
+    char wakeup = 0;
+    send(fd, &wakeup, 1, 0);
+  }
+  return 1;
+}
+
 plasma_store_conn *plasma_store_connect(const char *socket_name) {
   assert(socket_name);
   /* Try to connect to the Plasma store. If unsuccessful, retry several times.
@@ -197,10 +597,56 @@ plasma_store_conn *plasma_store_connect(const char *socket_name) {
   plasma_store_conn *result = malloc(sizeof(plasma_store_conn));
   result->conn = fd;
   result->mmap_table = NULL;
+  result->channel = NULL;
+  result->store_eventfd = -1;
+  result->client_eventfd = -1;
   return result;
 }
 
+plasma_store_conn *plasma_store_connect_channel(const char *socket_name) {
+  plasma_store_conn *conn = plasma_store_connect(socket_name);
+  plasma_request req = {};
+  plasma_send_request(conn->conn, PLASMA_OPEN_CHANNEL, &req);
+  plasma_reply reply;
+  plasma_read_bytes(conn->conn, (uint8_t *) &reply, sizeof(plasma_reply));
+  if (reply.error_code != PLASMA_OK) {
+    LOG_DEBUG("the store has no channel, falling back to the socket");
+    return conn;
+  }
+  /* The store sends the shared memory and the two eventfds. */
+  CHECK(reply.num_fds == 3);
+  int fds[3];
+  for (int i = 0; i < 3; ++i) {
+    int store_fd_val;
+    fds[i] = recv_fd(conn->conn, (char *) &store_fd_val, sizeof(int));
+    CHECKM(fds[i] != -1, "recv not successful");
+  }
+  void *channel = mmap(NULL, sizeof(plasma_channel), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fds[0], 0);
+  CHECKM(channel != MAP_FAILED, "mmap failed");
+  close(fds[0]);
+  conn->channel = channel;
+  conn->store_eventfd = fds[1];
+  conn->client_eventfd = fds[2];
+  return conn;
+}
+
 void plasma_store_disconnect(plasma_store_conn *conn) {
+  if (conn->channel != NULL) {
+    /* The store processes the rest of the channel when it sees the socket
+     * close. */
+    munmap(conn->channel, sizeof(plasma_channel));
+    close(conn->store_eventfd);
+    close(conn->client_eventfd);
+  }
+  /* The segments stay mapped because buffers that were handed out may still
+   * be in use, but their file descriptors are no longer needed. */
+  client_mmap_table_entry *entry, *tmp;
+  HASH_ITER(hh, conn->mmap_table, entry, tmp) {
+    close(entry->fd);
+    HASH_DEL(conn->mmap_table, entry);
+    free(entry);
+  }
   close(conn->conn);
   free(conn);
 }
@@ -236,16 +682,77 @@ int plasma_manager_connect(const char *ip_addr, int port) {
   return fd;
 }
 
-void plasma_transfer(int manager,
-                     const char *addr,
-                     int port,
-                     object_id object_id) {
-  plasma_request req = {.object_id = object_id, .port = port};
+void plasma_parse_addr(const char *addr, uint8_t result[4]) {
   char *end = NULL;
   for (int i = 0; i < 4; ++i) {
-    req.addr[i] = strtol(end ? end : addr, &end, 10);
+    result[i] = strtol(end ? end : addr, &end, 10);
     /* skip the '.' */
     end += 1;
   }
+}
+
+void plasma_transfer(int manager,
+                     const char *addr,
+                     int port,
+                     object_id object_id) {
+  plasma_request req = {.object_id = object_id, .port = port};
+  plasma_parse_addr(addr, req.addr);
   plasma_send_request(manager, PLASMA_TRANSFER, &req);
 }
+
+void plasma_fetch(int manager,
+                  int64_t num_object_ids,
+                  object_id object_ids[],
+                  const char *addr,
+                  int port) {
+  CHECK(num_object_ids > 0);
+  plasma_request *req = malloc(plasma_request_size(num_object_ids));
+  memset(req, 0, plasma_request_size(num_object_ids));
+  req->num_object_ids = num_object_ids;
+  if (addr != NULL) {
+    req->port = port;
+    plasma_parse_addr(addr, req->addr);
+  }
+  memcpy(req->object_ids, object_ids, num_object_ids * sizeof(object_id));
+  plasma_send_request(manager, PLASMA_FETCH, req);
+  free(req);
+}
+
+int64_t plasma_locate(int manager,
+                      object_id object_id,
+                      int64_t max_managers,
+                      plasma_manager_addr managers[]) {
+  plasma_request req = {.object_id = object_id};
+  plasma_send_request(manager, PLASMA_LOCATE, &req);
+  int64_t type;
+  int64_t length;
+  plasma_request *reply;
+  read_message(manager, &type, &length, (uint8_t **) &reply);
+  CHECK(type == PLASMA_LOCATIONS);
+  int64_t num_managers = (length - plasma_broadcast_request_size(0)) /
+                         sizeof(plasma_manager_addr);
+  memcpy(managers, plasma_broadcast_managers(reply),
+         (num_managers < max_managers ? num_managers : max_managers) *
+             sizeof(plasma_manager_addr));
+  free(reply);
+  return num_managers;
+}
+
+void plasma_broadcast(int manager,
+                      object_id object_id,
+                      int64_t num_managers,
+                      const char *addrs[],
+                      int ports[]) {
+  CHECK(num_managers > 0);
+  int64_t size = plasma_broadcast_request_size(num_managers);
+  plasma_request *req = malloc(size);
+  memset(req, 0, size);
+  req->object_id = object_id;
+  plasma_manager_addr *managers = plasma_broadcast_managers(req);
+  for (int64_t i = 0; i < num_managers; ++i) {
+    plasma_parse_addr(addrs[i], managers[i].addr);
+    managers[i].port = ports[i];
+  }
+  write_message(manager, PLASMA_BROADCAST, size, (uint8_t *) req);
+  free(req);
+}
@@ -5,6 +5,21 @@
 
 typedef struct plasma_store_conn plasma_store_conn;
 
+/** The memory of an object that has been gotten from the Plasma Store. */
+typedef struct {
+  /** The address of the object's data. */
+  uint8_t *data;
+  /** The size in bytes of the object's data. */
+  int64_t data_size;
+  /** The address of the object's metadata. */
+  uint8_t *metadata;
+  /** The size in bytes of the object's metadata. */
+  int64_t metadata_size;
+  /** The digest of the object's data and metadata, or 0 if the store does
+   *  not compute digests or the object is not sealed yet. */
+  uint64_t digest;
+} object_buffer;
+
 /**
  * This is used by the Plasma Client to send a request to the Plasma Store or
  * the Plasma Manager.
@@ -26,6 +41,19 @@ void plasma_send_request(int conn, int type, plasma_request *req);
  */
 plasma_store_conn *plasma_store_connect(const char *socket_name);
 
+/**
+ * Connect to the local plasma store like plasma_store_connect, and set up a
+ * shared memory channel for create, seal, contains, release and delete
+ * requests. These requests then don't need any system calls unless the store
+ * or the client has to be woken up. If the store cannot set up the channel,
+ * the returned connection uses the socket for everything.
+ *
+ * @param socket_name The name of the socket to use to connect to the Plasma
+ *        Store.
+ * @return The object containing the connection state.
+ */
+plasma_store_conn *plasma_store_connect_channel(const char *socket_name);
+
 /**
  * Disconnect from the local plasma store.
  *
@@ -43,6 +71,15 @@ void plasma_store_disconnect(plasma_store_conn *conn);
  */
 int plasma_manager_connect(const char *addr, int port);
 
+/**
+ * Parse an IPv4 address like "127.0.0.1" into its four bytes.
+ *
+ * @param addr The address in dotted decimal notation.
+ * @param result The four bytes of the address will be written here.
+ * @return Void.
+ */
+void plasma_parse_addr(const char *addr, uint8_t result[4]);
+
 /**
  * Create an object in the Plasma Store. Any metadata for this object must be
  * be passed in when the object is created.
@@ -56,14 +93,17 @@ int plasma_manager_connect(const char *addr, int port);
  * @param metadata_size The size in bytes of the metadata. If there is no
           metadata, this should be 0.
  * @param data The address of the newly created object will be written here.
- * @return Void.
+ * @return PLASMA_OK if the object was created, PLASMA_OBJECT_EXISTS if an
+ *         object with this ID has already been created, or
+ *         PLASMA_OUT_OF_MEMORY if the store could not make enough room for it.
+ *         If the object was not created, data is set to NULL.
  */
-void plasma_create(plasma_store_conn *conn,
-                   object_id object_id,
-                   int64_t size,
-                   uint8_t *metadata,
-                   int64_t metadata_size,
-                   uint8_t **data);
+int plasma_create(plasma_store_conn *conn,
+                  object_id object_id,
+                  int64_t size,
+                  uint8_t *metadata,
+                  int64_t metadata_size,
+                  uint8_t **data);
 
 /**
  * Get an object from the Plasma Store. This function will block until the
@@ -87,6 +127,102 @@ void plasma_get(plasma_store_conn *conn,
                 int64_t *metadata_size,
                 uint8_t **metadata);
 
+/**
+ * Get several objects from the Plasma Store with a single request. This
+ * function blocks until num_ready of the objects have been sealed or until the
+ * timeout expires, whichever happens first. Each object that is returned must
+ * eventually be released with plasma_release.
+ *
+ * @param conn The object containing the connection state.
+ * @param num_object_ids The number of object IDs in object_ids.
+ * @param object_ids The IDs of the objects to get.
+ * @param num_ready The number of objects that need to be available before the
+ *        function returns. Values outside of 1..num_object_ids mean all of
+ *        them.
+ * @param timeout_ms The maximum number of milliseconds to wait. If this is -1,
+ *        wait until num_ready objects are available. If this is 0, return the
+ *        objects that are available right away.
+ * @param buffers An array of num_object_ids buffers. The buffer at index i is
+ *        filled out with object i if it is available. Otherwise its data
+ *        field is set to NULL.
+ * @return The number of objects that are available. If an object that the
+ *         request waits for is aborted, the function returns right away
+ *         without it.
+ */
+int64_t plasma_get_many(plasma_store_conn *conn,
+                        int64_t num_object_ids,
+                        object_id object_ids[],
+                        int64_t num_ready,
+                        int64_t timeout_ms,
+                        object_buffer buffers[]);
+
+/**
+ * Get an object that may still be being written, for example one that the
+ * Plasma Manager is receiving from another node. This blocks until the object
+ * has been created or the timeout expires. The object's data must not be read
+ * beyond what plasma_wait_bytes reports as ready. The object must eventually
+ * be released with plasma_release.
+ *
+ * @param conn The object containing the connection state.
+ * @param object_id The ID of the object to get.
+ * @param timeout_ms The maximum number of milliseconds to wait, or -1 to wait
+ *        until the object has been created.
+ * @param buffer The buffer is filled out with the object if it is available.
+ *        Otherwise its data field is set to NULL.
+ * @return 1 if the object is available and 0 otherwise.
+ */
+int plasma_get_stream(plasma_store_conn *conn,
+                      object_id object_id,
+                      int64_t timeout_ms,
+                      object_buffer *buffer);
+
+/**
+ * Wait until the first bytes of an object gotten with plasma_get_stream have
+ * been written. The bytes count the data followed by the metadata.
+ *
+ * @param data The address of the object's data.
+ * @param num_bytes The number of bytes to wait for.
+ * @param timeout_ms The maximum number of milliseconds to wait, or -1 to wait
+ *        until the bytes are there. If this is 0, the function returns right
+ *        away.
+ * @return The number of bytes at the beginning of the object that can be
+ *         read. This is less than num_bytes if the timeout expired, and -1 if
+ *         the object was aborted before it was sealed.
+ */
+int64_t plasma_wait_bytes(uint8_t *data, int64_t num_bytes, int64_t timeout_ms);
+
+/**
+ * Publish that the first bytes of an unsealed object have been written, so
+ * that readers which wait for them with plasma_wait_bytes can go ahead. This
+ * must only be called by the creator of the object, with growing values.
+ * Sealing the object marks all of its bytes as ready.
+ *
+ * @param data The address of the object's data.
+ * @param bytes_ready The number of bytes at the beginning of the object that
+ *        have been written.
+ * @return Void.
+ */
+void plasma_mark_bytes_ready(uint8_t *data, int64_t bytes_ready);
+
+/**
+ * Find the shared memory segment that contains an address returned by
+ * plasma_create or plasma_get. This lets callers move object data with
+ * system calls like sendfile instead of copying it through a buffer.
+ *
+ * @param conn The object containing the connection state.
+ * @param address An address inside of an object.
+ * @param fd The file descriptor of the segment will be written at this
+ *        address. It stays owned by the connection and must not be closed.
+ * @param offset The offset of the address in the segment will be written at
+ *        this address.
+ * @return 1 if the address belongs to a segment of this connection and 0
+ *         otherwise.
+ */
+int plasma_object_fd(plasma_store_conn *conn,
+                     uint8_t *address,
+                     int *fd,
+                     int64_t *offset);
+
 /**
  * Check if the object store contains a particular object and the object has
  * been sealed. The result will be stored in has_object.
@@ -113,9 +249,23 @@ void plasma_contains(plasma_store_conn *conn,
  */
 void plasma_seal(plasma_store_conn *conn, object_id object_id);
 
+/**
+ * Tell the store that the client no longer uses an object that it created or
+ * got. The store never evicts or frees objects that clients are still using,
+ * so every successful plasma_create and plasma_get should eventually be
+ * followed by plasma_release. The client must not access the object's memory
+ * after releasing it.
+ *
+ * @param conn The object containing the connection state.
+ * @param object_id The ID of the object to release.
+ * @return Void.
+ */
+void plasma_release(plasma_store_conn *conn, object_id object_id);
+
 /**
  * Delete an object from the object store. This currently assumes that the
- * object is present and has been sealed.
+ * object is present and has been sealed. If other clients still use the
+ * object, its memory is only freed once they have released it.
  *
  * @todo We may want to allow the deletion of objects that are not present or
  *       haven't been sealed.
@@ -126,6 +276,54 @@ void plasma_seal(plasma_store_conn *conn, object_id object_id);
  */
 void plasma_delete(plasma_store_conn *conn, object_id object_id);
 
+/**
+ * Throw away an object that this client created but has not sealed, for
+ * example because writing it failed. Get requests that wait for the object
+ * return without it, and readers of the unsealed object stop waiting for its
+ * bytes. The store does the same for all unsealed objects of a client that
+ * disconnects.
+ *
+ * @param conn The object containing the connection state.
+ * @param object_id The ID of the object to abort.
+ * @return Void.
+ */
+void plasma_abort(plasma_store_conn *conn, object_id object_id);
+
+/**
+ * Create a sealed object with the same contents as an object that is already
+ * in the Plasma Store, without sending or copying them. The objects share
+ * memory. This only works if the store computes digests, and only once all
+ * clients have released an object with these contents after it was sealed. A
+ * Plasma Manager uses this to receive objects whose contents the store
+ * already has.
+ *
+ * @param conn The object containing the connection state.
+ * @param object_id The ID of the object to create.
+ * @param digest The digest of the contents of the object.
+ * @param data_size The size in bytes of the object's data.
+ * @param metadata_size The size in bytes of the object's metadata.
+ * @return PLASMA_OK on success, PLASMA_OBJECT_EXISTS if the object already
+ *         exists, or PLASMA_CONTENT_NOT_FOUND if the store does not have the
+ *         contents.
+ */
+int plasma_create_alias(plasma_store_conn *conn,
+                        object_id object_id,
+                        uint64_t digest,
+                        int64_t data_size,
+                        int64_t metadata_size);
+
+/**
+ * Get statistics about the memory allocator of the Plasma Store, for example
+ * to see how much memory the slabs for small objects take up and how much of
+ * it is wasted.
+ *
+ * @param conn The object containing the connection state.
+ * @param stats The statistics will be written here.
+ * @return Void.
+ */
+void plasma_get_allocator_stats(plasma_store_conn *conn,
+                                plasma_allocator_stats *stats);
+
 /**
  * Subscribe to notifications when objects are sealed in the object store.
  * Whenever an object is sealed, a message will be written to the client socket
@@ -137,4 +335,134 @@ void plasma_delete(plasma_store_conn *conn, object_id object_id);
  */
 int plasma_subscribe(plasma_store_conn *conn);
 
+/**
+ * Subscribe to the notifications that match a filter. This can be called at
+ * any time, and the filter can ask for a notification about every sealed
+ * object that already exists first.
+ *
+ * @param conn The object containing the connection state.
+ * @param filter Which notifications to get, or NULL to get all of them.
+ * @return The file descriptor that the client should use to read notifications
+ *         from the object store.
+ */
+int plasma_subscribe_filtered(plasma_store_conn *conn,
+                              plasma_subscription_filter *filter);
+
+/**
+ * Subscribe to notifications through a ring in shared memory. The
+ * notifications also carry the sizes of the objects, and reading them does
+ * not need a system call unless the ring is empty. They must be read with
+ * plasma_get_notification.
+ *
+ * @param conn The object containing the connection state.
+ * @param filter Which notifications to get, or NULL to get all of them (see
+ *        plasma_subscribe_filtered).
+ * @param ring The ring will be written here.
+ * @return The file descriptor that is used to wait for notifications, or -1
+ *         if the store could not set up the ring.
+ */
+int plasma_subscribe_ring(plasma_store_conn *conn,
+                          plasma_subscription_filter *filter,
+                          plasma_notification_ring **ring);
+
+/**
+ * Get the next notification from a ring returned by plasma_subscribe_ring.
+ *
+ * @param fd The file descriptor returned by plasma_subscribe_ring.
+ * @param ring The ring returned by plasma_subscribe_ring.
+ * @param timeout_ms How long to wait for a notification if the ring is empty.
+ *        If this is -1, wait until there is one.
+ * @param notification The notification will be written here.
+ * @return 1 if there was a notification and 0 if there was none in time or
+ *         the store went away.
+ */
+int plasma_get_notification(int fd,
+                            plasma_notification_ring *ring,
+                            int64_t timeout_ms,
+                            plasma_ring_notification *notification);
+
+/**
+ * Ask a Plasma Manager to send an object to another Plasma Manager.
+ *
+ * @param manager The file descriptor of the connection to the Plasma Manager
+ *        that has the object.
+ * @param addr The IP address of the Plasma Manager to send the object to.
+ * @param port The port of the Plasma Manager to send the object to.
+ * @param object_id The ID of the object to send.
+ * @return Void.
+ */
+void plasma_transfer(int manager,
+                     const char *addr,
+                     int port,
+                     object_id object_id);
+
+/**
+ * Ask the local Plasma Manager to pull objects from another Plasma Manager
+ * into the local Plasma Store. This does not wait for the objects; use
+ * plasma_get or plasma_get_many for that. The manager skips objects that are
+ * already in the store and objects that are already on their way, so many
+ * clients can fetch the same object and it is only transferred once.
+ *
+ * @param manager The file descriptor of the connection to the local Plasma
+ *        Manager.
+ * @param num_object_ids The number of object IDs in object_ids.
+ * @param object_ids The IDs of the objects to fetch.
+ * @param addr The IP address of the Plasma Manager that has the objects. If
+ *        this is NULL, the objects are fetched from the closest Plasma Manager
+ *        that the object directory knows to have them, as soon as one has
+ *        them (see plasma_locate).
+ * @param port The port of the Plasma Manager that has the objects.
+ * @return Void.
+ */
+void plasma_fetch(int manager,
+                  int64_t num_object_ids,
+                  object_id object_ids[],
+                  const char *addr,
+                  int port);
+
+/**
+ * Find the Plasma Managers whose stores have an object. The Plasma Managers
+ * must have been started with a directory of object locations, to which each
+ * of them reports the objects that are sealed in its store and the objects
+ * that are evicted or deleted. Stores that have just sealed or lost the
+ * object may not be reflected yet.
+ *
+ * @param manager The file descriptor of the connection to the local Plasma
+ *        Manager.
+ * @param object_id The ID of the object.
+ * @param max_managers The number of entries in managers.
+ * @param managers The first max_managers Plasma Managers that have the object
+ *        are written here, sorted by how close they are to the local Plasma
+ *        Manager: the local one first, then the ones on the same host, then
+ *        the ones whose addresses share the most leading bytes.
+ * @return The number of Plasma Managers that have the object. This may be
+ *         more than max_managers.
+ */
+int64_t plasma_locate(int manager,
+                      object_id object_id,
+                      int64_t max_managers,
+                      plasma_manager_addr managers[]);
+
+/**
+ * Ask a Plasma Manager to send an object to many other Plasma Managers. The
+ * managers pass the object on to each other along a tree, and every manager
+ * forwards the parts of the object that it has received while the rest is
+ * still arriving, so this takes about as long as a single transfer plus one
+ * round of latency per level of the tree. The object must be in the store of
+ * the Plasma Manager or on its way there.
+ *
+ * @param manager The file descriptor of the connection to the Plasma Manager
+ *        that has the object.
+ * @param object_id The ID of the object to send.
+ * @param num_managers The number of Plasma Managers to send the object to.
+ * @param addrs The IP addresses of the Plasma Managers.
+ * @param ports The ports of the Plasma Managers.
+ * @return Void.
+ */
+void plasma_broadcast(int manager,
+                      object_id object_id,
+                      int64_t num_managers,
+                      const char *addrs[],
+                      int ports[]);
+
 #endif
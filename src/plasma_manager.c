@@ -5,6 +5,7 @@
  * transfering an object to another object store comes in, it ships the data
  * using a new connection to the target object manager. */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +21,9 @@
 #include <assert.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "uthash.h"
 #include "utlist.h"
@@ -30,17 +34,113 @@
 #include "plasma.h"
 #include "plasma_client.h"
 #include "plasma_manager.h"
+#include "compress.h"
+
+typedef struct plasma_buffer plasma_buffer;
+typedef struct object_range object_range;
+typedef struct remote_manager remote_manager;
+
+/* An object that a client asked this manager to fetch from another manager
+ * and that has not arrived yet. */
+typedef struct {
+  /* The ID of the object. */
+  object_id object_id;
+  /* Handle for the table of fetch requests. */
+  UT_hash_handle hh;
+} fetch_request;
+
+/* A broadcast that this manager has to pass on for an object that has not
+ * started to arrive yet. */
+typedef struct {
+  /* The ID of the object. */
+  object_id object_id;
+  /* The number of managers in managers. */
+  int64_t num_managers;
+  /* The managers that the object has to be sent to. */
+  plasma_manager_addr *managers;
+  /* Handle for the table of pending broadcasts. */
+  UT_hash_handle hh;
+} pending_broadcast;
+
+/* The plasma managers whose stores have an object. Every object has a home in
+ * the directory of object locations, which is the manager that keeps this
+ * entry for it. */
+typedef struct {
+  /* The ID of the object. */
+  object_id object_id;
+  /* The managers that have the object, as plasma_manager_addrs. */
+  UT_array *holders;
+  /* The managers that wait for the object to appear in some store, as
+   * plasma_manager_addrs. */
+  UT_array *waiters;
+  /* Handle for the table of object locations. */
+  UT_hash_handle hh;
+} object_location;
+
+/* A lookup of the locations of an object that this manager sent to the home
+ * of the object and that has not been answered yet. */
+typedef struct {
+  /* The ID of the object. */
+  object_id object_id;
+  /* The sockets of the clients that wait for the answer. */
+  UT_array *clients;
+  /* Whether the object is fetched as soon as some store has it. */
+  int fetch;
+  /* Handle for the table of lookups. */
+  UT_hash_handle hh;
+} pending_lookup;
+
+UT_icd manager_addr_icd = {sizeof(plasma_manager_addr), NULL, NULL, NULL};
 
 typedef struct {
   /** Connection to the local plasma store for reading or writing data. */
   plasma_store_conn *store_conn;
-  /** Hash table of all contexts for active connections to other plasma
-   * managers. These are used for writing data to other plasma stores. */
-  client_connection *manager_connections;
+  /** The IP address of this plasma manager. Other managers send the objects
+   *  that we fetch to this address. */
+  uint8_t addr[4];
+  /** The port that this plasma manager listens on. */
+  int port;
+  /** Hash table of all other plasma managers that we send data to. */
+  remote_manager *remote_managers;
+  /** Hash table of the objects that we are receiving, keyed by object ID.
+   *  The ranges of an object may arrive on several connections. */
+  plasma_buffer *incoming_objects;
+  /** Hash table of the objects that we are fetching, keyed by object ID.
+   *  Every object is only requested once, no matter how many clients fetch
+   *  it. */
+  fetch_request *fetch_requests;
+  /** Hash table of the broadcasts that wait for their object to arrive, keyed
+   *  by object ID. */
+  pending_broadcast *pending_broadcasts;
+  /** The connections that wait for more of an object that we forward while
+   *  it is being written. */
+  UT_array *stalled_streams;
+  /** Timer that puts the stalled streams back into the event loop, or -1 if
+   *  it is not running. Objects that arrive from other managers wake the
+   *  streams up right away, but we don't hear about the progress of objects
+   *  that local clients write. */
+  timer_id stall_timer;
+  /** Buffer for the data of objects that we receive but that are already in
+   *  the store. It is allocated when it is first needed. */
+  uint8_t *discard_buffer;
+  /** Whether this plasma manager compresses the objects that it sends to
+   *  other managers that accept it, and accepts compressed objects. */
+  int compression;
+  /** The plasma managers that share the directory of object locations, in
+   *  the same order on all of them. The home of an object is picked from them
+   *  by its ID (see directory_home). If this is NULL, there is no
+   *  directory. */
+  plasma_manager_addr *directory;
+  /** The number of plasma managers in directory. */
+  int64_t num_directory_managers;
+  /** Hash table of the locations of the objects whose home is this manager,
+   *  keyed by object ID. */
+  object_location *locations;
+  /** Hash table of the lookups that wait for an answer, keyed by object
+   *  ID. */
+  pending_lookup *lookups;
 } plasma_manager_state;
 
-typedef struct plasma_buffer plasma_buffer;
-
 /* Buffer for reading and writing data between plasma managers. */
 struct plasma_buffer {
   object_id object_id;
@@ -49,10 +149,66 @@ struct plasma_buffer {
   uint8_t *metadata;
   int64_t metadata_size;
   int writable;
-  /* Pointer to the next buffer that we will write to this plasma manager. This
+  /* File descriptor of the shared memory segment that contains the object, or
+   * -1 if we don't know it. This is only used for sending. */
+  int fd;
+  /* Offset of the object's data in the segment. */
+  int64_t offset;
+  /* If we are sending the object, this is its digest if only the digest is
+   * sent instead of the bytes, and 0 otherwise. */
+  uint64_t digest;
+  /* If we are sending the object, this is the number of its ranges that have
+   * not been sent yet. If we are receiving it, this is the number of bytes
+   * that have not been received yet. */
+  int64_t remaining;
+  /* If we are receiving the object, the number of bytes at its beginning that
+   * have arrived. Readers in the local store can use them before the object
+   * is sealed. */
+  int64_t bytes_ready;
+  /* If we are receiving the object, the ranges that have arrived completely
+   * but do not extend the beginning yet, as byte_intervals. */
+  UT_array *completed;
+  /* Handle for the table of incoming objects. */
+  UT_hash_handle hh;
+};
+
+/* The bytes from start up to but not including end. */
+typedef struct {
+  int64_t start;
+  int64_t end;
+} byte_interval;
+
+UT_icd byte_interval_icd = {sizeof(byte_interval), NULL, NULL, NULL};
+
+/* The header in front of every block of a range that is sent compressed. */
+typedef struct {
+  /* The number of bytes of the object in the block. */
+  int64_t size;
+  /* The number of bytes of the block that follow the header. If this is size,
+   * the block is sent as it is, because it did not get smaller. */
+  int64_t compressed_size;
+} block_header;
+
+/* A contiguous range of the concatenated data and metadata of an object. Each
+ * range is preceded by its own PLASMA_DATA or PLASMA_DATA_COMPRESSED request
+ * on the wire, so ranges of different objects can be interleaved on a
+ * connection and the ranges of one object can be spread over several
+ * connections. */
+struct object_range {
+  /* The object this range belongs to. */
+  plasma_buffer *buf;
+  /* Offset of the range in the object. */
+  int64_t offset;
+  /* Size of the range in bytes. */
+  int64_t size;
+  /* Whether the PLASMA_DATA request for this range has been sent. */
+  int header_sent;
+  /* Whether the range is sent in compressed blocks. */
+  int compressed;
+  /* Pointer to the next range that we will write to this plasma manager. This
    * field is only used if we're transferring data to another plasma manager,
    * not if we are receiving data. */
-  plasma_buffer *next;
+  object_range *next;
 };
 
 /* Context for a client connection to another plasma manager. */
@@ -60,26 +216,80 @@ struct client_connection {
   /* Current state for this plasma manager. This is shared between all client
    * connections to the plasma manager. */
   plasma_manager_state *manager_state;
-  /* Current position in the buffer. */
+  /* Current position in the range at the front of the transfer queue. */
   int64_t cursor;
-  /* Buffer that this connection is reading from. If this is a connection to
-   * write data to another plasma store, then it is a linked list of buffers to
+  /* Number of bytes we try to move per event loop callback. This adapts to how
+   * fast the socket is, see adapt_chunk_size. */
+  int64_t chunk_size;
+  /* Range that this connection is reading into. If this is a connection to
+   * write data to another plasma store, then it is a linked list of ranges to
    * write. */
-  plasma_buffer *transfer_queue;
+  object_range *transfer_queue;
+  /* Number of bytes in the transfer queue that have not been written yet. */
+  int64_t queued_bytes;
   /* File descriptor for the socket connected to the other plasma manager. */
   int fd;
-  /* Following fields are used only for connections to plasma managers. */
+  /* The block of a compressed range that is being written or read, starting
+   * with its block_header. It is allocated when it is first needed. */
+  uint8_t *block;
+  /* The number of bytes of the block, including the header, if it is being
+   * written, and 0 otherwise. */
+  int64_t block_size;
+  /* The number of bytes of the block that have been written or read. */
+  int64_t block_cursor;
+};
+
+/* The connections to another plasma manager. */
+struct remote_manager {
   /* Key that uniquely identifies the plasma manager that we're connected to.
    * We will use the string <address>:<port> as an identifier. */
   char *ip_addr_port;
+  /* The address of the plasma manager. */
+  char *ip_addr;
+  /* The port of the plasma manager. */
+  int port;
+  /* The connections that have been opened so far. Small objects go over the
+   * first one, large objects are spread over all of them. */
+  client_connection *streams[PLASMA_NUM_STREAMS];
+  /* The number of connections in streams. */
+  int num_streams;
+  /* Connection for sending requests to the plasma manager, or -1 if we
+   * haven't sent any. Requests can't go over the streams because they would
+   * end up in the middle of a range. */
+  int control_fd;
+  /* Whether the plasma manager has told us that it accepts compressed
+   * objects. */
+  int accepts_compression;
+  /* Whether we have told the plasma manager that we accept compressed
+   * objects. */
+  int announced_compression;
   /** Handle for the uthash table. */
   UT_hash_handle hh;
 };
 
-plasma_manager_state *init_plasma_manager_state(const char *store_socket_name) {
+plasma_manager_state *init_plasma_manager_state(
+    const char *store_socket_name,
+    const char *master_addr,
+    int port,
+    int compression,
+    plasma_manager_addr *directory,
+    int64_t num_directory_managers) {
   plasma_manager_state *state = malloc(sizeof(plasma_manager_state));
   state->store_conn = plasma_store_connect(store_socket_name);
-  state->manager_connections = NULL;
+  plasma_parse_addr(master_addr, state->addr);
+  state->port = port;
+  state->remote_managers = NULL;
+  state->incoming_objects = NULL;
+  state->fetch_requests = NULL;
+  state->pending_broadcasts = NULL;
+  utarray_new(state->stalled_streams, &ut_ptr_icd);
+  state->stall_timer = -1;
+  state->discard_buffer = NULL;
+  state->compression = compression;
+  state->directory = directory;
+  state->num_directory_managers = num_directory_managers;
+  state->locations = NULL;
+  state->lookups = NULL;
   return state;
 }
 
@@ -90,6 +300,152 @@ void process_message(event_loop *loop,
                      void *context,
                      int events);
 
+/* Ask the home of an object in the directory where the object is. The answer
+ * goes to the client on client_sock, or if that is -1, the object is fetched
+ * once some store has it. */
+void locate_object(event_loop *loop,
+                   plasma_manager_state *state,
+                   object_id object_id,
+                   int client_sock);
+
+/* Adapt the chunk size of a connection to how much the socket accepted. If
+ * the whole chunk went through, the socket keeps up and we can move more data
+ * per event loop iteration. Otherwise we move less so that other connections
+ * get their turn. */
+void adapt_chunk_size(client_connection *conn, ssize_t r, int64_t s) {
+  if (r == s && s == conn->chunk_size &&
+      conn->chunk_size < PLASMA_MAX_CHUNK_SIZE) {
+    conn->chunk_size *= 2;
+  } else if (r < s && conn->chunk_size > PLASMA_MIN_CHUNK_SIZE) {
+    conn->chunk_size /= 2;
+  }
+}
+
+/* Write up to s bytes of the object starting at the given position to the
+ * socket. If we know the segment file descriptor of the buffer we let the
+ * kernel copy the data straight from the segment. */
+ssize_t write_buffer_range(int fd,
+                           plasma_buffer *buf,
+                           int64_t position,
+                           int64_t s) {
+#ifdef __linux__
+  if (buf->fd != -1) {
+    off_t offset = buf->offset + position;
+    ssize_t r = sendfile(fd, buf->fd, &offset, s);
+    if (r != -1 || (errno != EINVAL && errno != ENOSYS)) {
+      return r;
+    }
+    /* The segment does not support sendfile, so copy it ourselves. */
+    buf->fd = -1;
+  }
+#endif
+  return write(fd, buf->data + position, s);
+}
+
+/* Put the connections that wait for more of an object back into the event
+ * loop, so they send whatever has been written in the meantime. */
+void wake_stalled_streams(event_loop *loop, plasma_manager_state *state) {
+  for (int i = 0; i < utarray_len(state->stalled_streams); ++i) {
+    client_connection *stream =
+        *(client_connection **) utarray_eltptr(state->stalled_streams, i);
+    event_loop_add_file(loop, stream->fd, EVENT_LOOP_WRITE, write_object_chunk,
+                        stream);
+  }
+  utarray_clear(state->stalled_streams);
+}
+
+int stall_timeout_handler(event_loop *loop, timer_id id, void *context) {
+  plasma_manager_state *state = context;
+  state->stall_timer = -1;
+  wake_stalled_streams(loop, state);
+  return EVENT_LOOP_TIMER_DONE;
+}
+
+/* Take a connection out of the event loop until the object that it sends has
+ * been written further. */
+void stall_stream(event_loop *loop, client_connection *conn) {
+  plasma_manager_state *state = conn->manager_state;
+  event_loop_remove_file(loop, conn->fd);
+  utarray_push_back(state->stalled_streams, &conn);
+  if (state->stall_timer == -1) {
+    state->stall_timer = event_loop_add_timer(loop, PLASMA_STALL_RETRY_MS,
+                                              stall_timeout_handler, state);
+  }
+}
+
+/* The buffer of a connection for the blocks of compressed ranges. */
+uint8_t *connection_block(client_connection *conn) {
+  if (conn->block == NULL) {
+    conn->block = malloc(sizeof(block_header) +
+                         plasma_compress_bound(PLASMA_COMPRESSION_BLOCK_SIZE));
+  }
+  return conn->block;
+}
+
+/* Write the blocks of the compressed range at the front of the transfer
+ * queue. Each block is compressed once the previous one has been written, so
+ * the cursor only counts the bytes of blocks that are complete. */
+void write_compressed_blocks(client_connection *conn) {
+  object_range *range = conn->transfer_queue;
+  uint8_t *block = connection_block(conn);
+  block_header *header = (block_header *) block;
+  int64_t written = 0;
+  while (conn->cursor < range->size && written < conn->chunk_size) {
+    if (conn->block_size == 0) {
+      int64_t size = range->size - conn->cursor;
+      if (size > PLASMA_COMPRESSION_BLOCK_SIZE) {
+        size = PLASMA_COMPRESSION_BLOCK_SIZE;
+      }
+      uint8_t *source = range->buf->data + range->offset + conn->cursor;
+      uint8_t *payload = block + sizeof(block_header);
+      int64_t compressed_size = plasma_compress(source, size, payload, size);
+      if (compressed_size < 0 || compressed_size >= size) {
+        memcpy(payload, source, size);
+        compressed_size = size;
+      }
+      header->size = size;
+      header->compressed_size = compressed_size;
+      conn->block_size = sizeof(block_header) + compressed_size;
+      conn->block_cursor = 0;
+    }
+    ssize_t s = conn->block_size - conn->block_cursor;
+    ssize_t r = write(conn->fd, block + conn->block_cursor, s);
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return;
+      }
+      LOG_ERR("write error");
+      exit(-1);
+    }
+    conn->block_cursor += r;
+    written += r;
+    if (r < s) {
+      /* The socket is full, so try again once it is writable. */
+      return;
+    }
+    conn->cursor += header->size;
+    conn->queued_bytes -= header->size;
+    conn->block_size = 0;
+  }
+}
+
+/* Move on to the next range of a connection once the range at the front of
+ * its transfer queue has been written. */
+void finish_writing_range(int data_sock, client_connection *conn) {
+  object_range *range = conn->transfer_queue;
+  plasma_buffer *buf = range->buf;
+  LOG_DEBUG("writing on channel %d finished", data_sock);
+  conn->cursor = 0;
+  LL_DELETE(conn->transfer_queue, range);
+  free(range);
+  if (--buf->remaining == 0) {
+    /* We are done with the object, so the local store may evict it
+     * again. */
+    plasma_release(conn->manager_state->store_conn, buf->object_id);
+    free(buf);
+  }
+}
+
 void write_object_chunk(event_loop *loop,
                         int data_sock,
                         void *context,
@@ -105,40 +461,224 @@ void write_object_chunk(event_loop *loop,
 
   LOG_DEBUG("Writing data");
   ssize_t r, s;
-  plasma_buffer *buf = conn->transfer_queue;
-  if (conn->cursor == 0) {
-    /* If the cursor is zero, we haven't sent any requests for this object yet,
-     * so send the initial PLASMA_DATA request. */
+  object_range *range = conn->transfer_queue;
+  plasma_buffer *buf = range->buf;
+  if (!range->header_sent) {
+    /* We haven't sent any requests for this range yet, so send the initial
+     * PLASMA_DATA request. */
     plasma_request manager_req = {.object_id = buf->object_id,
                                   .data_size = buf->data_size,
-                                  .metadata_size = buf->metadata_size};
-    plasma_send_request(conn->fd, PLASMA_DATA, &manager_req);
+                                  .metadata_size = buf->metadata_size,
+                                  .range_offset = range->offset,
+                                  .range_size = range->size,
+                                  .digest = buf->digest};
+    if (buf->digest != 0) {
+      /* The receiver asks us for the bytes if it lacks the contents. */
+      plasma_manager_state *state = conn->manager_state;
+      memcpy(manager_req.addr, state->addr, sizeof(manager_req.addr));
+      manager_req.port = state->port;
+    }
+    int type = range->compressed ? PLASMA_DATA_COMPRESSED : PLASMA_DATA;
+    plasma_send_request(conn->fd, type, &manager_req);
+    range->header_sent = 1;
+    conn->cursor = 0;
   }
 
-  /* Try to write one BUFSIZE at a time. */
-  s = buf->data_size + buf->metadata_size - conn->cursor;
-  if (s > BUFSIZE)
-    s = BUFSIZE;
-  r = write(conn->fd, buf->data + conn->cursor, s);
+  if (range->compressed) {
+    write_compressed_blocks(conn);
+    if (conn->cursor == range->size) {
+      finish_writing_range(data_sock, conn);
+    }
+    return;
+  }
 
-  if (r != s) {
-    if (r > 0) {
-      LOG_ERR("partial write on fd %d", conn->fd);
-    } else {
-      LOG_ERR("write error");
-      exit(-1);
+  /* Try to write one chunk at a time. If we forward an object that is still
+   * being written, we can only send the part that is there. */
+  int64_t position = range->offset + conn->cursor;
+  int64_t available =
+      plasma_wait_bytes(buf->data, range->offset + range->size, 0) - position;
+  s = range->size - conn->cursor;
+  if (s > conn->chunk_size) {
+    s = conn->chunk_size;
+  }
+  if (s > available) {
+    s = available;
+  }
+  if (s <= 0 && conn->cursor < range->size) {
+    stall_stream(loop, conn);
+    return;
+  }
+  r = s > 0 ? write_buffer_range(conn->fd, buf, position, s) : 0;
+
+  if (r == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      /* Try again once the socket is writable. */
+      return;
     }
-  } else {
-    conn->cursor += r;
+    LOG_ERR("write error");
+    exit(-1);
   }
-  if (r == 0) {
-    /* If we've finished writing this buffer, move on to the next transfer
-     * request and reset the cursor to zero. */
-    LOG_DEBUG("writing on channel %d finished", data_sock);
-    conn->cursor = 0;
-    LL_DELETE(conn->transfer_queue, buf);
+  if (r < s) {
+    LOG_DEBUG("partial write of %zd of %zd bytes on fd %d", r, s, conn->fd);
+  }
+  conn->cursor += r;
+  conn->queued_bytes -= r;
+  adapt_chunk_size(conn, r, s);
+
+  if (conn->cursor == range->size) {
+    finish_writing_range(data_sock, conn);
+  }
+}
+
+/* Record that the bytes of an incoming object from start up to end have
+ * arrived, and let readers in the local store know if that extends the part
+ * at the beginning of the object that they can use. */
+void advance_bytes_ready(event_loop *loop,
+                         plasma_manager_state *state,
+                         plasma_buffer *buf,
+                         int64_t start,
+                         int64_t end) {
+  if (buf->data == NULL || end <= buf->bytes_ready) {
+    return;
+  }
+  if (start > buf->bytes_ready) {
+    /* Another range in front of this one is still missing. Only whole ranges
+     * are remembered; partial progress is picked up on the next read. */
+    byte_interval interval = {.start = start, .end = end};
+    utarray_push_back(buf->completed, &interval);
+    return;
+  }
+  buf->bytes_ready = end;
+  /* Ranges that arrived earlier may now follow the beginning directly. */
+  int advanced = 1;
+  while (advanced) {
+    advanced = 0;
+    for (int i = utarray_len(buf->completed) - 1; i >= 0; --i) {
+      byte_interval *interval =
+          (byte_interval *) utarray_eltptr(buf->completed, i);
+      if (interval->start <= buf->bytes_ready) {
+        if (interval->end > buf->bytes_ready) {
+          buf->bytes_ready = interval->end;
+          advanced = 1;
+        }
+        utarray_erase(buf->completed, i, 1);
+      }
+    }
+  }
+  plasma_mark_bytes_ready(buf->data, buf->bytes_ready);
+  /* Managers that we forward the object to can send the new bytes now. */
+  wake_stalled_streams(loop, state);
+}
+
+/* Forget that we fetch an object, because it has arrived. */
+void finish_fetch_request(plasma_manager_state *state, object_id object_id) {
+  fetch_request *fetch;
+  HASH_FIND(hh, state->fetch_requests, &object_id, sizeof(object_id), fetch);
+  if (fetch) {
+    HASH_DELETE(hh, state->fetch_requests, fetch);
+    free(fetch);
+  }
+}
+
+/* Called when the range at the front of the transfer queue of a receiving
+ * connection is complete. The object is sealed once all of its ranges have
+ * arrived, possibly on other connections. */
+void finish_reading_range(event_loop *loop,
+                          int data_sock,
+                          client_connection *conn) {
+  plasma_manager_state *state = conn->manager_state;
+  object_range *range = conn->transfer_queue;
+  plasma_buffer *buf = range->buf;
+  LOG_DEBUG("reading on channel %d finished", data_sock);
+  buf->remaining -= range->size;
+  if (buf->remaining == 0) {
+    /* Sealing the object wakes up all clients that are waiting for it. */
+    if (buf->data != NULL) {
+      plasma_seal(state->store_conn, buf->object_id);
+      plasma_release(state->store_conn, buf->object_id);
+    }
+    finish_fetch_request(state, buf->object_id);
+    HASH_DELETE(hh, state->incoming_objects, buf);
+    utarray_free(buf->completed);
     free(buf);
   }
+  LL_DELETE(conn->transfer_queue, range);
+  free(range);
+  /* Switch to listening for requests from this socket, instead of reading
+   * data. */
+  event_loop_remove_file(loop, data_sock);
+  event_loop_add_file(loop, data_sock, EVENT_LOOP_READ, process_message, conn);
+}
+
+/* Give up on a connection because the other plasma manager went away before
+ * sending the whole range. The object stays unsealed. */
+void drop_receiving_connection(event_loop *loop,
+                               int data_sock,
+                               client_connection *conn) {
+  LOG_ERR("connection on fd %d failed in the middle of an object", data_sock);
+  object_range *range = conn->transfer_queue;
+  LL_DELETE(conn->transfer_queue, range);
+  free(range);
+  event_loop_remove_file(loop, data_sock);
+  close(data_sock);
+  free(conn->block);
+  free(conn);
+}
+
+/* Read the next part of a compressed range. The header of each block is read
+ * first, which tells how much of the block follows. Complete blocks are
+ * decompressed straight into the object. */
+void read_compressed_chunk(event_loop *loop,
+                           int data_sock,
+                           client_connection *conn) {
+  object_range *range = conn->transfer_queue;
+  uint8_t *block = connection_block(conn);
+  block_header *header = (block_header *) block;
+  int64_t s = sizeof(block_header);
+  if (conn->block_cursor >= sizeof(block_header)) {
+    s += header->compressed_size;
+  }
+  ssize_t r =
+      read(data_sock, block + conn->block_cursor, s - conn->block_cursor);
+  if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (r <= 0) {
+    drop_receiving_connection(loop, data_sock, conn);
+    return;
+  }
+  conn->block_cursor += r;
+  if (conn->block_cursor == sizeof(block_header)) {
+    CHECK(header->size > 0 && header->size <= PLASMA_COMPRESSION_BLOCK_SIZE &&
+          header->size <= range->size - conn->cursor &&
+          header->compressed_size > 0 &&
+          header->compressed_size <= header->size);
+    return;
+  }
+  if (conn->block_cursor < s) {
+    return;
+  }
+  uint8_t *payload = block + sizeof(block_header);
+  if (range->buf->data != NULL) {
+    uint8_t *destination = range->buf->data + range->offset + conn->cursor;
+    if (header->compressed_size == header->size) {
+      memcpy(destination, payload, header->size);
+    } else {
+      CHECKM(plasma_decompress(payload, header->compressed_size, destination,
+                               header->size) == header->size,
+             "received a corrupt compressed block");
+    }
+  }
+  conn->cursor += header->size;
+  conn->block_cursor = 0;
+  if (range->offset <= range->buf->bytes_ready ||
+      conn->cursor == range->size) {
+    advance_bytes_ready(loop, conn->manager_state, range->buf, range->offset,
+                        range->offset + conn->cursor);
+  }
+  if (conn->cursor == range->size) {
+    finish_reading_range(loop, data_sock, conn);
+  }
 }
 
 void read_object_chunk(event_loop *loop,
@@ -148,91 +688,349 @@ void read_object_chunk(event_loop *loop,
   LOG_DEBUG("Reading data");
   ssize_t r, s;
   client_connection *conn = (client_connection *) context;
-  plasma_buffer *buf = conn->transfer_queue;
-  CHECK(buf != NULL);
-  /* Try to read one BUFSIZE at a time. */
-  s = buf->data_size + buf->metadata_size - conn->cursor;
-  if (s > BUFSIZE) {
-    s = BUFSIZE;
+  object_range *range = conn->transfer_queue;
+  CHECK(range != NULL);
+  if (range->compressed) {
+    read_compressed_chunk(loop, data_sock, conn);
+    return;
+  }
+  /* Try to read one chunk at a time. The data goes directly into the object's
+   * shared memory, unless the store already has the object. */
+  s = range->size - conn->cursor;
+  if (s > conn->chunk_size) {
+    s = conn->chunk_size;
+  }
+  uint8_t *destination = conn->manager_state->discard_buffer;
+  if (range->buf->data != NULL) {
+    destination = range->buf->data + range->offset + conn->cursor;
   }
-  r = read(data_sock, buf->data + conn->cursor, s);
+  r = read(data_sock, destination, s);
 
-  if (r == -1) {
-    LOG_ERR("read error");
-  } else if (r == 0) {
-    LOG_DEBUG("end of file");
-  } else {
-    conn->cursor += r;
+  if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
   }
-  if (conn->cursor == buf->data_size + buf->metadata_size) {
-    LOG_DEBUG("reading on channel %d finished", data_sock);
-    plasma_seal(conn->manager_state->store_conn, buf->object_id);
-    LL_DELETE(conn->transfer_queue, buf);
-    free(buf);
-    /* Switch to listening for requests from this socket, instead of reading
-     * data. */
-    event_loop_remove_file(loop, data_sock);
-    event_loop_add_file(loop, data_sock, EVENT_LOOP_READ, process_message,
-                        conn);
+  if (r <= 0) {
+    drop_receiving_connection(loop, data_sock, conn);
+    return;
+  }
+  conn->cursor += r;
+  adapt_chunk_size(conn, r, s);
+  if (range->offset <= range->buf->bytes_ready ||
+      conn->cursor == range->size) {
+    advance_bytes_ready(loop, conn->manager_state, range->buf, range->offset,
+                        range->offset + conn->cursor);
+  }
+  if (conn->cursor == range->size) {
+    finish_reading_range(loop, data_sock, conn);
   }
-  return;
 }
 
-void start_writing_data(event_loop *loop,
-                        object_id object_id,
-                        uint8_t addr[4],
-                        int port,
-                        client_connection *conn) {
-  uint8_t *data;
-  int64_t data_size;
-  uint8_t *metadata;
-  int64_t metadata_size;
-  plasma_get(conn->manager_state->store_conn, object_id, &data_size, &data,
-             &metadata_size, &metadata);
-  assert(metadata == data + data_size);
-  plasma_buffer *buf = malloc(sizeof(plasma_buffer));
-  buf->object_id = object_id;
-  buf->data = data; /* We treat this as a pointer to the
-                       concatenated data and metadata. */
-  buf->data_size = data_size;
-  buf->metadata_size = metadata_size;
-  buf->writable = 0;
+/* Tell a remote plasma manager that we accept compressed objects, which lets
+ * it send them to us. It answers in the same way if it accepts them too. */
+void announce_compression(plasma_manager_state *state,
+                          remote_manager *manager,
+                          int fd) {
+  plasma_request req = {.port = state->port};
+  memcpy(req.addr, state->addr, sizeof(req.addr));
+  plasma_send_request(fd, PLASMA_COMPRESSION, &req);
+  manager->announced_compression = 1;
+}
+
+/* Open another connection to a remote plasma manager. */
+client_connection *add_stream(remote_manager *manager,
+                              plasma_manager_state *state) {
+  CHECK(manager->num_streams < PLASMA_NUM_STREAMS);
+  client_connection *stream = malloc(sizeof(client_connection));
+  stream->fd = plasma_manager_connect(manager->ip_addr, manager->port);
+  stream->manager_state = state;
+  stream->transfer_queue = NULL;
+  stream->queued_bytes = 0;
+  stream->cursor = 0;
+  stream->chunk_size = PLASMA_MIN_CHUNK_SIZE;
+  stream->block = NULL;
+  stream->block_size = 0;
+  stream->block_cursor = 0;
+  manager->streams[manager->num_streams++] = stream;
+  if (state->compression && !manager->announced_compression) {
+    /* Nothing has been queued on the new connection yet, so the announcement
+     * goes out before any range. */
+    announce_compression(state, manager, stream->fd);
+  }
+  return stream;
+}
 
-  /* Look to see if we already have a connection to this plasma manager. */
+/* Look up the remote plasma manager with the given address, and create an
+ * entry for it if we haven't sent anything to it yet. */
+remote_manager *get_remote_manager(plasma_manager_state *state,
+                                   uint8_t addr[4],
+                                   int port) {
   UT_string *ip_addr;
   UT_string *ip_addr_port;
   utstring_new(ip_addr);
   utstring_new(ip_addr_port);
   utstring_printf(ip_addr, "%d.%d.%d.%d", addr[0], addr[1], addr[2], addr[3]);
   utstring_printf(ip_addr_port, "%s:%d", utstring_body(ip_addr), port);
-  client_connection *manager_conn;
-  HASH_FIND_STR(conn->manager_state->manager_connections,
-                utstring_body(ip_addr_port), manager_conn);
-
-  if (!manager_conn) {
-    /* If we don't already have a connection to this manager, start one. */
-    manager_conn = malloc(sizeof(client_connection));
-    manager_conn->fd = plasma_manager_connect(utstring_body(ip_addr), port);
-    manager_conn->manager_state = conn->manager_state;
-    manager_conn->transfer_queue = NULL;
-    manager_conn->cursor = 0;
-
-    manager_conn->ip_addr_port = strdup(utstring_body(ip_addr_port));
-    HASH_ADD_KEYPTR(hh, manager_conn->manager_state->manager_connections,
-                    manager_conn->ip_addr_port,
-                    strlen(manager_conn->ip_addr_port), manager_conn);
+  remote_manager *manager;
+  HASH_FIND_STR(state->remote_managers, utstring_body(ip_addr_port), manager);
+  if (!manager) {
+    manager = malloc(sizeof(remote_manager));
+    manager->ip_addr_port = strdup(utstring_body(ip_addr_port));
+    manager->ip_addr = strdup(utstring_body(ip_addr));
+    manager->port = port;
+    manager->num_streams = 0;
+    manager->control_fd = -1;
+    manager->accepts_compression = 0;
+    manager->announced_compression = 0;
+    HASH_ADD_KEYPTR(hh, state->remote_managers, manager->ip_addr_port,
+                    strlen(manager->ip_addr_port), manager);
   }
   utstring_free(ip_addr_port);
   utstring_free(ip_addr);
+  return manager;
+}
+
+/* The connection for sending requests to a remote plasma manager. It is
+ * opened when it is first needed. */
+int get_control_fd(remote_manager *manager) {
+  if (manager->control_fd == -1) {
+    manager->control_fd =
+        plasma_manager_connect(manager->ip_addr, manager->port);
+  }
+  return manager->control_fd;
+}
 
-  if (manager_conn->transfer_queue == NULL) {
-    /* If we already have a connection to this manager and its inactive,
-     * (re)register it with the event loop again. */
-    event_loop_add_file(loop, manager_conn->fd, EVENT_LOOP_WRITE,
-                        write_object_chunk, manager_conn);
+/* Whether a range covers its whole object, which is the case for all objects
+ * up to PLASMA_RANGE_SIZE bytes. */
+int is_whole_object(object_range *range) {
+  return range->size == range->buf->data_size + range->buf->metadata_size;
+}
+
+/* Check if an object of size bytes is worth compressing by compressing a few
+ * samples spread over it. Most data that is already compressed, like images,
+ * does not get smaller, and then sending it as it is saves the time. */
+int is_compressible(uint8_t *data, int64_t size) {
+  uint8_t compressed[PLASMA_COMPRESSION_SAMPLE_SIZE];
+  int64_t total_size = 0;
+  int64_t total_compressed_size = 0;
+  for (int i = 0; i < PLASMA_COMPRESSION_SAMPLES; ++i) {
+    int64_t offset = (size - PLASMA_COMPRESSION_SAMPLE_SIZE) * i /
+                     (PLASMA_COMPRESSION_SAMPLES - 1);
+    int64_t compressed_size =
+        plasma_compress(data + offset, PLASMA_COMPRESSION_SAMPLE_SIZE,
+                        compressed, PLASMA_COMPRESSION_SAMPLE_SIZE);
+    total_size += PLASMA_COMPRESSION_SAMPLE_SIZE;
+    total_compressed_size +=
+        compressed_size < 0 ? PLASMA_COMPRESSION_SAMPLE_SIZE : compressed_size;
+  }
+  return total_compressed_size * 100 <=
+         total_size * PLASMA_COMPRESSION_MAX_PERCENT;
+}
+
+/* Add a range to the transfer queue of a connection. Ranges of small objects
+ * go ahead of the ranges of large objects that have not been started, so a
+ * large transfer does not hold up the small objects behind it. */
+void queue_range(event_loop *loop,
+                 client_connection *stream,
+                 object_range *range,
+                 int small) {
+  if (stream->transfer_queue == NULL) {
+    /* If the connection is inactive, (re)register it with the event loop
+     * again. */
+    event_loop_add_file(loop, stream->fd, EVENT_LOOP_WRITE, write_object_chunk,
+                        stream);
+  }
+  stream->queued_bytes += range->size;
+  object_range **position = &stream->transfer_queue;
+  if (small) {
+    while (*position != NULL &&
+           ((*position)->header_sent || is_whole_object(*position))) {
+      position = &(*position)->next;
+    }
+  } else {
+    while (*position != NULL) {
+      position = &(*position)->next;
+    }
+  }
+  range->next = *position;
+  *position = range;
+}
+
+/* Queue an object that we got from the local store for sending to another
+ * plasma manager. The reference to the object is released once it has been
+ * sent. The object may still be being written, in which case the connections
+ * send it as far as it has been written and wait for the rest. If by_digest
+ * is nonzero, only a header with the digest of the object is sent. Large
+ * objects that have been written completely are compressed if the other
+ * manager accepts it. */
+void queue_object(event_loop *loop,
+                  plasma_manager_state *state,
+                  remote_manager *manager,
+                  object_id object_id,
+                  object_buffer *buffer,
+                  int by_digest) {
+  assert(buffer->metadata == buffer->data + buffer->data_size);
+  plasma_buffer *buf = malloc(sizeof(plasma_buffer));
+  buf->object_id = object_id;
+  buf->data = buffer->data; /* We treat this as a pointer to the
+                               concatenated data and metadata. */
+  buf->data_size = buffer->data_size;
+  buf->metadata_size = buffer->metadata_size;
+  buf->writable = 0;
+  if (!plasma_object_fd(state->store_conn, buf->data, &buf->fd,
+                        &buf->offset)) {
+    buf->fd = -1;
+  }
+  buf->digest = by_digest ? buffer->digest : 0;
+
+  int64_t size = by_digest ? 0 : buf->data_size + buf->metadata_size;
+  int64_t num_ranges = (size + PLASMA_RANGE_SIZE - 1) / PLASMA_RANGE_SIZE;
+  if (num_ranges == 0) {
+    num_ranges = 1;
+  }
+  buf->remaining = num_ranges;
+  int compressed = manager->accepts_compression &&
+                   size >= PLASMA_COMPRESSION_MIN_SIZE &&
+                   plasma_wait_bytes(buf->data, size, 0) >= size &&
+                   is_compressible(buf->data, size);
+
+  if (num_ranges == 1) {
+    /* Send small objects over the connection with the least data queued. */
+    if (manager->num_streams == 0) {
+      add_stream(manager, state);
+    }
+    client_connection *stream = manager->streams[0];
+    for (int i = 1; i < manager->num_streams; ++i) {
+      if (manager->streams[i]->queued_bytes < stream->queued_bytes) {
+        stream = manager->streams[i];
+      }
+    }
+    object_range *range = malloc(sizeof(object_range));
+    range->buf = buf;
+    range->offset = 0;
+    range->size = size;
+    range->header_sent = 0;
+    range->compressed = compressed;
+    queue_range(loop, stream, range, 1);
+    return;
+  }
+
+  /* Spread the ranges of large objects over all connections. */
+  while (manager->num_streams < PLASMA_NUM_STREAMS &&
+         manager->num_streams < num_ranges) {
+    add_stream(manager, state);
+  }
+  for (int64_t i = 0; i < num_ranges; ++i) {
+    object_range *range = malloc(sizeof(object_range));
+    range->buf = buf;
+    range->offset = i * PLASMA_RANGE_SIZE;
+    range->size = size - range->offset < PLASMA_RANGE_SIZE
+                      ? size - range->offset
+                      : PLASMA_RANGE_SIZE;
+    range->header_sent = 0;
+    range->compressed = compressed;
+    queue_range(loop, manager->streams[i % manager->num_streams], range, 0);
+  }
+}
+
+void start_writing_data(event_loop *loop,
+                        object_id object_id,
+                        uint8_t addr[4],
+                        int port,
+                        uint64_t digest,
+                        client_connection *conn) {
+  plasma_manager_state *state = conn->manager_state;
+  object_buffer buffer;
+  plasma_get_many(state->store_conn, 1, &object_id, 1, -1, &buffer);
+  /* If the other manager already has the contents under another ID, its
+   * store can share them, so offer the digest before sending the bytes.
+   * This is skipped if it has told us that it lacks them. */
+  int by_digest = digest == 0 && buffer.digest != 0 &&
+                  buffer.data_size + buffer.metadata_size >=
+                      PLASMA_DIGEST_MIN_SIZE;
+  /* Look to see if we already have connections to this plasma manager. */
+  remote_manager *manager = get_remote_manager(state, addr, port);
+  queue_object(loop, state, manager, object_id, &buffer, by_digest);
+}
+
+/* Send an object to a list of plasma managers along a tree. The list is split
+ * into up to PLASMA_BROADCAST_FANOUT parts. We send the object to the first
+ * manager of each part and ask it to broadcast the object to the rest of its
+ * part in the same way. If the object is not in the local store yet, the
+ * broadcast waits until it starts to arrive. */
+void process_broadcast_request(event_loop *loop,
+                               plasma_manager_state *state,
+                               object_id object_id,
+                               int64_t num_managers,
+                               plasma_manager_addr managers[]) {
+  if (num_managers == 0) {
+    return;
+  }
+  object_buffer buffer;
+  if (!plasma_get_stream(state->store_conn, object_id, 0, &buffer)) {
+    pending_broadcast *pending;
+    HASH_FIND(hh, state->pending_broadcasts, &object_id, sizeof(object_id),
+              pending);
+    if (!pending) {
+      pending = malloc(sizeof(pending_broadcast));
+      pending->object_id = object_id;
+      pending->num_managers = 0;
+      pending->managers = NULL;
+      HASH_ADD(hh, state->pending_broadcasts, object_id, sizeof(object_id),
+               pending);
+    }
+    pending->managers =
+        realloc(pending->managers, (pending->num_managers + num_managers) *
+                                       sizeof(plasma_manager_addr));
+    memcpy(&pending->managers[pending->num_managers], managers,
+           num_managers * sizeof(plasma_manager_addr));
+    pending->num_managers += num_managers;
+    return;
+  }
+  int64_t num_parts = 0;
+  for (int64_t i = 0; i < PLASMA_BROADCAST_FANOUT; ++i) {
+    int64_t begin = i * num_managers / PLASMA_BROADCAST_FANOUT;
+    int64_t end = (i + 1) * num_managers / PLASMA_BROADCAST_FANOUT;
+    if (begin == end) {
+      continue;
+    }
+    if (num_parts++ > 0) {
+      /* Every outgoing copy of the object holds its own reference. */
+      CHECK(plasma_get_stream(state->store_conn, object_id, 0, &buffer));
+    }
+    remote_manager *manager =
+        get_remote_manager(state, managers[begin].addr, managers[begin].port);
+    if (end - begin > 1) {
+      /* Tell the manager where to forward the object before we send it, so
+       * that it can start forwarding the first bytes that arrive. */
+      int64_t size = plasma_broadcast_request_size(end - begin - 1);
+      plasma_request *req = malloc(size);
+      memset(req, 0, size);
+      req->object_id = object_id;
+      memcpy(plasma_broadcast_managers(req), &managers[begin + 1],
+             (end - begin - 1) * sizeof(plasma_manager_addr));
+      write_message(get_control_fd(manager), PLASMA_BROADCAST, size,
+                    (uint8_t *) req);
+      free(req);
+    }
+    queue_object(loop, state, manager, object_id, &buffer, 0);
+  }
+}
+
+/* Start to forward an object that has started to arrive if we have been asked
+ * to broadcast it. */
+void start_pending_broadcast(event_loop *loop,
+                             plasma_manager_state *state,
+                             object_id object_id) {
+  pending_broadcast *pending;
+  HASH_FIND(hh, state->pending_broadcasts, &object_id, sizeof(object_id),
+            pending);
+  if (pending) {
+    HASH_DELETE(hh, state->pending_broadcasts, pending);
+    process_broadcast_request(loop, state, object_id, pending->num_managers,
+                              pending->managers);
+    free(pending->managers);
+    free(pending);
   }
-  /* Add this transfer request to this connection's transfer queue. */
-  LL_APPEND(manager_conn->transfer_queue, buf);
 }
 
 void start_reading_data(event_loop *loop,
@@ -240,25 +1038,442 @@ void start_reading_data(event_loop *loop,
                         object_id object_id,
                         int64_t data_size,
                         int64_t metadata_size,
+                        int64_t range_offset,
+                        int64_t range_size,
+                        int compressed,
                         client_connection *conn) {
-  plasma_buffer *buf = malloc(sizeof(plasma_buffer));
-  buf->object_id = object_id;
-  buf->data_size = data_size;
-  buf->metadata_size = metadata_size;
-  buf->writable = 1;
-
-  plasma_create(conn->manager_state->store_conn, object_id, data_size, NULL,
-                metadata_size, &(buf->data));
-  LL_APPEND(conn->transfer_queue, buf);
+  plasma_manager_state *state = conn->manager_state;
+  plasma_buffer *buf;
+  HASH_FIND(hh, state->incoming_objects, &object_id, sizeof(object_id), buf);
+  if (!buf) {
+    /* This is the first range of the object that arrives, so create it. */
+    buf = malloc(sizeof(plasma_buffer));
+    buf->object_id = object_id;
+    buf->data_size = data_size;
+    buf->metadata_size = metadata_size;
+    buf->writable = 1;
+    buf->fd = -1;
+    buf->digest = 0;
+    buf->remaining = data_size + metadata_size;
+    buf->bytes_ready = 0;
+    utarray_new(buf->completed, &byte_interval_icd);
+    int error_code = plasma_create(state->store_conn, object_id, data_size,
+                                   NULL, metadata_size, &(buf->data));
+    if (error_code == PLASMA_OBJECT_EXISTS) {
+      /* The object has arrived from somewhere else in the meantime, so we
+       * read the data without storing it. */
+      LOG_DEBUG("discarding an object that is already in the store");
+      if (state->discard_buffer == NULL) {
+        state->discard_buffer = malloc(PLASMA_MAX_CHUNK_SIZE);
+      }
+    } else {
+      CHECKM(error_code == PLASMA_OK,
+             "not enough memory in the plasma store to receive the object");
+    }
+    HASH_ADD(hh, state->incoming_objects, object_id, sizeof(object_id), buf);
+    start_pending_broadcast(loop, state, object_id);
+  }
+  CHECK(range_offset >= 0 && range_size >= 0 &&
+        range_offset + range_size <= data_size + metadata_size);
+  object_range *range = malloc(sizeof(object_range));
+  range->buf = buf;
+  range->offset = range_offset;
+  range->size = range_size;
+  range->header_sent = 1;
+  range->compressed = compressed;
+  range->next = NULL;
+  LL_APPEND(conn->transfer_queue, range);
   conn->cursor = 0;
 
   /* Switch to reading the data from this socket, instead of listening for
    * other requests. */
   event_loop_remove_file(loop, client_sock);
+  if (range_size == 0) {
+    finish_reading_range(loop, client_sock, conn);
+    return;
+  }
   event_loop_add_file(loop, client_sock, EVENT_LOOP_READ, read_object_chunk,
                       conn);
 }
 
+void receive_object_by_digest(event_loop *loop,
+                              client_connection *conn,
+                              plasma_request *req) {
+  plasma_manager_state *state = conn->manager_state;
+  plasma_buffer *incoming;
+  HASH_FIND(hh, state->incoming_objects, &req->object_id, sizeof(object_id),
+            incoming);
+  if (incoming) {
+    /* The bytes of the object are already arriving from somewhere else. */
+    return;
+  }
+  int error_code =
+      plasma_create_alias(state->store_conn, req->object_id, req->digest,
+                          req->data_size, req->metadata_size);
+  if (error_code == PLASMA_OK || error_code == PLASMA_OBJECT_EXISTS) {
+    LOG_DEBUG("received an object by its digest");
+    finish_fetch_request(state, req->object_id);
+    start_pending_broadcast(loop, state, req->object_id);
+    return;
+  }
+  /* Ask for the bytes. The digest tells the other manager not to offer the
+   * digest again. */
+  remote_manager *manager = get_remote_manager(state, req->addr, req->port);
+  plasma_request transfer_req = {.object_id = req->object_id,
+                                 .port = state->port,
+                                 .digest = req->digest};
+  memcpy(transfer_req.addr, state->addr, sizeof(transfer_req.addr));
+  plasma_send_request(get_control_fd(manager), PLASMA_TRANSFER, &transfer_req);
+}
+
+void process_fetch_request(event_loop *loop,
+                           plasma_manager_state *state,
+                           object_id object_id,
+                           uint8_t addr[4],
+                           int port) {
+  fetch_request *fetch;
+  HASH_FIND(hh, state->fetch_requests, &object_id, sizeof(object_id), fetch);
+  if (fetch) {
+    /* Another client is already fetching this object. */
+    return;
+  }
+  plasma_buffer *incoming;
+  HASH_FIND(hh, state->incoming_objects, &object_id, sizeof(object_id),
+            incoming);
+  if (incoming) {
+    /* The object is already on its way. */
+    return;
+  }
+  int has_object;
+  plasma_contains(state->store_conn, object_id, &has_object);
+  if (has_object) {
+    return;
+  }
+  if (port == 0) {
+    /* The client does not know where the object is, so find it in the
+     * directory first. */
+    locate_object(loop, state, object_id, -1);
+    return;
+  }
+  fetch = malloc(sizeof(fetch_request));
+  fetch->object_id = object_id;
+  HASH_ADD(hh, state->fetch_requests, object_id, sizeof(object_id), fetch);
+
+  /* Ask the other plasma manager to send the object to us. */
+  remote_manager *manager = get_remote_manager(state, addr, port);
+  plasma_request req = {.object_id = object_id, .port = state->port};
+  memcpy(req.addr, state->addr, sizeof(req.addr));
+  plasma_send_request(get_control_fd(manager), PLASMA_TRANSFER, &req);
+}
+
+/* Another plasma manager told us that it accepts compressed objects. If we
+ * compress too, we send it compressed objects from now on and let it know
+ * that it can do the same. */
+void process_compression_request(plasma_manager_state *state,
+                                 uint8_t addr[4],
+                                 int port) {
+  if (!state->compression) {
+    return;
+  }
+  LOG_DEBUG("manager with port %d accepts compressed objects", port);
+  remote_manager *manager = get_remote_manager(state, addr, port);
+  manager->accepts_compression = 1;
+  if (!manager->announced_compression) {
+    announce_compression(state, manager, get_control_fd(manager));
+  }
+}
+
+/* Whether an address is the address of this plasma manager. */
+int is_this_manager(plasma_manager_state *state, uint8_t addr[4], int port) {
+  return port == state->port &&
+         memcmp(addr, state->addr, sizeof(state->addr)) == 0;
+}
+
+/* The plasma manager that keeps the locations of an object. Object IDs are
+ * random, so their first bytes spread the objects evenly. */
+plasma_manager_addr *directory_home(plasma_manager_state *state,
+                                    object_id object_id) {
+  uint64_t hash;
+  memcpy(&hash, object_id.id, sizeof(hash));
+  return &state->directory[hash % state->num_directory_managers];
+}
+
+/* How close a plasma manager is to this one. This manager itself is closest,
+ * then come the managers on the same host, then the managers whose addresses
+ * share more leading bytes with ours, which are usually in the same subnet or
+ * rack. */
+int manager_locality(plasma_manager_state *state,
+                     plasma_manager_addr *manager) {
+  int locality = 0;
+  while (locality < sizeof(state->addr) &&
+         manager->addr[locality] == state->addr[locality]) {
+    ++locality;
+  }
+  if (is_this_manager(state, manager->addr, manager->port)) {
+    ++locality;
+  }
+  return locality;
+}
+
+/* Sort plasma managers by how close they are to this one, the closest first.
+ * Managers that are equally close keep their order. */
+void sort_by_locality(plasma_manager_state *state,
+                      plasma_manager_addr *managers,
+                      int64_t num_managers) {
+  for (int64_t i = 1; i < num_managers; ++i) {
+    plasma_manager_addr manager = managers[i];
+    int locality = manager_locality(state, &manager);
+    int64_t j = i;
+    for (; j > 0 && manager_locality(state, &managers[j - 1]) < locality; --j) {
+      managers[j] = managers[j - 1];
+    }
+    managers[j] = manager;
+  }
+}
+
+/* Handle an answer of the home of an object to a lookup of this manager. The
+ * clients that asked get the managers sorted by locality, and a fetch takes
+ * the object from the closest manager. */
+void process_locations(event_loop *loop,
+                       plasma_manager_state *state,
+                       plasma_request *req,
+                       int64_t num_managers) {
+  pending_lookup *lookup;
+  HASH_FIND(hh, state->lookups, &req->object_id, sizeof(object_id), lookup);
+  if (!lookup) {
+    return;
+  }
+  plasma_manager_addr *managers = plasma_broadcast_managers(req);
+  sort_by_locality(state, managers, num_managers);
+  if (req->timeout_ms == 0) {
+    for (int i = 0; i < utarray_len(lookup->clients); ++i) {
+      int client_sock = *(int *) utarray_eltptr(lookup->clients, i);
+      write_message(client_sock, PLASMA_LOCATIONS,
+                    plasma_broadcast_request_size(num_managers),
+                    (uint8_t *) req);
+    }
+    utarray_clear(lookup->clients);
+  } else if (lookup->fetch) {
+    lookup->fetch = 0;
+    for (int64_t i = 0; i < num_managers; ++i) {
+      if (!is_this_manager(state, managers[i].addr, managers[i].port)) {
+        process_fetch_request(loop, state, req->object_id, managers[i].addr,
+                              managers[i].port);
+        break;
+      }
+    }
+  }
+  if (!lookup->fetch && utarray_len(lookup->clients) == 0) {
+    HASH_DELETE(hh, state->lookups, lookup);
+    utarray_free(lookup->clients);
+    free(lookup);
+  }
+}
+
+/* Send the managers that have an object to the manager that looked it up. */
+void send_locations(event_loop *loop,
+                    plasma_manager_state *state,
+                    object_id object_id,
+                    UT_array *holders,
+                    plasma_manager_addr *requester,
+                    int64_t timeout_ms) {
+  int64_t num_managers = holders != NULL ? utarray_len(holders) : 0;
+  int64_t size = plasma_broadcast_request_size(num_managers);
+  plasma_request *req = malloc(size);
+  memset(req, 0, size);
+  req->object_id = object_id;
+  req->timeout_ms = timeout_ms;
+  for (int64_t i = 0; i < num_managers; ++i) {
+    plasma_broadcast_managers(req)[i] =
+        *(plasma_manager_addr *) utarray_eltptr(holders, i);
+  }
+  if (is_this_manager(state, requester->addr, requester->port)) {
+    process_locations(loop, state, req, num_managers);
+  } else {
+    remote_manager *manager =
+        get_remote_manager(state, requester->addr, requester->port);
+    write_message(get_control_fd(manager), PLASMA_LOCATIONS, size,
+                  (uint8_t *) req);
+  }
+  free(req);
+}
+
+/* Handle a lookup of an object whose home is this manager. A lookup that
+ * waits for the object is answered once some store has it. */
+void process_locate_request(event_loop *loop,
+                            plasma_manager_state *state,
+                            plasma_request *req) {
+  plasma_manager_addr requester = {.port = req->port};
+  memcpy(requester.addr, req->addr, sizeof(requester.addr));
+  object_location *location;
+  HASH_FIND(hh, state->locations, &req->object_id, sizeof(object_id),
+            location);
+  if ((location && utarray_len(location->holders) > 0) ||
+      req->timeout_ms == 0) {
+    send_locations(loop, state, req->object_id,
+                   location ? location->holders : NULL, &requester,
+                   req->timeout_ms);
+    return;
+  }
+  if (!location) {
+    location = malloc(sizeof(object_location));
+    location->object_id = req->object_id;
+    utarray_new(location->holders, &manager_addr_icd);
+    utarray_new(location->waiters, &manager_addr_icd);
+    HASH_ADD(hh, state->locations, object_id, sizeof(object_id), location);
+  }
+  utarray_push_back(location->waiters, &requester);
+}
+
+/* Record in the directory that the store of a manager got or lost an
+ * object whose home is this manager. */
+void process_location_update(event_loop *loop,
+                             plasma_manager_state *state,
+                             int64_t type,
+                             plasma_request *req) {
+  plasma_manager_addr holder = {.port = req->port};
+  memcpy(holder.addr, req->addr, sizeof(holder.addr));
+  object_location *location;
+  HASH_FIND(hh, state->locations, &req->object_id, sizeof(object_id),
+            location);
+  if (!location) {
+    if (type == PLASMA_LOCATION_REMOVE) {
+      return;
+    }
+    location = malloc(sizeof(object_location));
+    location->object_id = req->object_id;
+    utarray_new(location->holders, &manager_addr_icd);
+    utarray_new(location->waiters, &manager_addr_icd);
+    HASH_ADD(hh, state->locations, object_id, sizeof(object_id), location);
+  }
+  int index = -1;
+  for (int i = 0; i < utarray_len(location->holders); ++i) {
+    plasma_manager_addr *other =
+        (plasma_manager_addr *) utarray_eltptr(location->holders, i);
+    if (other->port == holder.port &&
+        memcmp(other->addr, holder.addr, sizeof(holder.addr)) == 0) {
+      index = i;
+      break;
+    }
+  }
+  if (type == PLASMA_LOCATION_ADD) {
+    if (index == -1) {
+      utarray_push_back(location->holders, &holder);
+    }
+    /* Answer the lookups that waited for the object. */
+    for (int i = 0; i < utarray_len(location->waiters); ++i) {
+      plasma_manager_addr *waiter =
+          (plasma_manager_addr *) utarray_eltptr(location->waiters, i);
+      send_locations(loop, state, location->object_id, location->holders,
+                     waiter, -1);
+    }
+    utarray_clear(location->waiters);
+    return;
+  }
+  if (index != -1) {
+    utarray_erase(location->holders, index, 1);
+  }
+  if (utarray_len(location->holders) == 0 &&
+      utarray_len(location->waiters) == 0) {
+    HASH_DELETE(hh, state->locations, location);
+    utarray_free(location->holders);
+    utarray_free(location->waiters);
+    free(location);
+  }
+}
+
+void locate_object(event_loop *loop,
+                   plasma_manager_state *state,
+                   object_id object_id,
+                   int client_sock) {
+  if (state->directory == NULL) {
+    LOG_ERR("cannot locate objects without an object directory");
+    if (client_sock != -1) {
+      /* Tell the client that no manager is known to have the object. */
+      plasma_request reply = {.object_id = object_id};
+      write_message(client_sock, PLASMA_LOCATIONS,
+                    plasma_broadcast_request_size(0), (uint8_t *) &reply);
+    }
+    return;
+  }
+  pending_lookup *lookup;
+  HASH_FIND(hh, state->lookups, &object_id, sizeof(object_id), lookup);
+  if (!lookup) {
+    lookup = malloc(sizeof(pending_lookup));
+    lookup->object_id = object_id;
+    utarray_new(lookup->clients, &ut_int_icd);
+    lookup->fetch = 0;
+    HASH_ADD(hh, state->lookups, object_id, sizeof(object_id), lookup);
+  }
+  /* Lookups of clients are answered right away, lookups for fetches when the
+   * object appears. Only one lookup of each kind is sent at a time. */
+  plasma_request req = {.object_id = object_id, .port = state->port};
+  memcpy(req.addr, state->addr, sizeof(req.addr));
+  if (client_sock == -1) {
+    if (lookup->fetch) {
+      return;
+    }
+    lookup->fetch = 1;
+    req.timeout_ms = -1;
+  } else {
+    utarray_push_back(lookup->clients, &client_sock);
+    if (utarray_len(lookup->clients) > 1) {
+      return;
+    }
+    req.timeout_ms = 0;
+  }
+  plasma_manager_addr *home = directory_home(state, object_id);
+  if (is_this_manager(state, home->addr, home->port)) {
+    process_locate_request(loop, state, &req);
+  } else {
+    remote_manager *manager = get_remote_manager(state, home->addr, home->port);
+    plasma_send_request(get_control_fd(manager), PLASMA_LOCATE, &req);
+  }
+}
+
+/* Forget the lookups of a client that went away. */
+void forget_client_lookups(plasma_manager_state *state, int client_sock) {
+  pending_lookup *lookup, *temp_lookup;
+  HASH_ITER(hh, state->lookups, lookup, temp_lookup) {
+    for (int i = utarray_len(lookup->clients) - 1; i >= 0; --i) {
+      if (*(int *) utarray_eltptr(lookup->clients, i) == client_sock) {
+        utarray_erase(lookup->clients, i, 1);
+      }
+    }
+  }
+}
+
+/* Pass the objects that are sealed in the local store and the objects that
+ * leave it on to their homes in the directory. */
+void process_notification(event_loop *loop,
+                          int notification_fd,
+                          void *context,
+                          int events) {
+  plasma_manager_state *state = context;
+  plasma_notification notification;
+  ssize_t r = recv(notification_fd, &notification, sizeof(notification),
+                   MSG_WAITALL);
+  if (r != sizeof(notification)) {
+    LOG_ERR("lost the notifications of the plasma store");
+    event_loop_remove_file(loop, notification_fd);
+    close(notification_fd);
+    return;
+  }
+  int64_t type = notification.type == PLASMA_NOTIFICATION_SEALED
+                     ? PLASMA_LOCATION_ADD
+                     : PLASMA_LOCATION_REMOVE;
+  plasma_request req = {.object_id = notification.object_id,
+                        .port = state->port};
+  memcpy(req.addr, state->addr, sizeof(req.addr));
+  plasma_manager_addr *home = directory_home(state, notification.object_id);
+  if (is_this_manager(state, home->addr, home->port)) {
+    process_location_update(loop, state, type, &req);
+  } else {
+    remote_manager *manager = get_remote_manager(state, home->addr, home->port);
+    plasma_send_request(get_control_fd(manager), type, &req);
+  }
+}
+
 void process_message(event_loop *loop,
                      int client_sock,
                      void *context,
@@ -273,17 +1488,78 @@ void process_message(event_loop *loop,
   switch (type) {
   case PLASMA_TRANSFER:
     LOG_DEBUG("transfering object to manager with port %d", req->port);
-    start_writing_data(loop, req->object_id, req->addr, req->port, conn);
+    start_writing_data(loop, req->object_id, req->addr, req->port, req->digest,
+                       conn);
+    break;
+  case PLASMA_FETCH:
+    LOG_DEBUG("fetching objects from manager with port %d", req->port);
+    CHECK(length == plasma_request_size(req->num_object_ids));
+    for (int64_t i = 0; i < req->num_object_ids; ++i) {
+      process_fetch_request(loop, conn->manager_state, req->object_ids[i],
+                            req->addr, req->port);
+    }
     break;
+  case PLASMA_BROADCAST: {
+    plasma_manager_addr *managers = plasma_broadcast_managers(req);
+    int64_t num_managers =
+        (length - plasma_broadcast_request_size(0)) / sizeof(*managers);
+    CHECK(length == plasma_broadcast_request_size(num_managers));
+    LOG_DEBUG("broadcasting object to %" PRId64 " managers", num_managers);
+    /* Leave this manager out, it already has the object. */
+    int64_t num_others = 0;
+    for (int64_t i = 0; i < num_managers; ++i) {
+      if (!is_this_manager(conn->manager_state, managers[i].addr,
+                           managers[i].port)) {
+        managers[num_others++] = managers[i];
+      }
+    }
+    process_broadcast_request(loop, conn->manager_state, req->object_id,
+                              num_others, managers);
+  } break;
   case PLASMA_DATA:
+    if (req->range_size == 0 && req->digest != 0) {
+      receive_object_by_digest(loop, conn, req);
+      break;
+    }
     LOG_DEBUG("starting to stream data");
     start_reading_data(loop, client_sock, req->object_id, req->data_size,
-                       req->metadata_size, conn);
+                       req->metadata_size, req->range_offset, req->range_size,
+                       0, conn);
+    break;
+  case PLASMA_DATA_COMPRESSED:
+    LOG_DEBUG("starting to stream compressed data");
+    CHECK(conn->manager_state->compression);
+    start_reading_data(loop, client_sock, req->object_id, req->data_size,
+                       req->metadata_size, req->range_offset, req->range_size,
+                       1, conn);
+    break;
+  case PLASMA_COMPRESSION:
+    process_compression_request(conn->manager_state, req->addr, req->port);
     break;
+  case PLASMA_LOCATION_ADD:
+  case PLASMA_LOCATION_REMOVE:
+    process_location_update(loop, conn->manager_state, type, req);
+    break;
+  case PLASMA_LOCATE:
+    if (req->port == 0) {
+      /* A local client asks where the object is. */
+      locate_object(loop, conn->manager_state, req->object_id, client_sock);
+    } else {
+      process_locate_request(loop, conn->manager_state, req);
+    }
+    break;
+  case PLASMA_LOCATIONS: {
+    int64_t num_managers = (length - plasma_broadcast_request_size(0)) /
+                           sizeof(plasma_manager_addr);
+    CHECK(length == plasma_broadcast_request_size(num_managers));
+    process_locations(loop, conn->manager_state, req, num_managers);
+  } break;
   case DISCONNECT_CLIENT: {
     LOG_INFO("Disconnecting client on fd %d", client_sock);
+    forget_client_lookups(conn->manager_state, client_sock);
     event_loop_remove_file(loop, client_sock);
     close(client_sock);
+    free(conn->block);
     free(conn);
   } break;
   default:
@@ -303,13 +1579,23 @@ void new_client_connection(event_loop *loop,
   client_connection *conn = malloc(sizeof(client_connection));
   conn->manager_state = (plasma_manager_state *) context;
   conn->transfer_queue = NULL;
+  conn->queued_bytes = 0;
+  conn->fd = new_socket;
+  conn->cursor = 0;
+  conn->chunk_size = PLASMA_MIN_CHUNK_SIZE;
+  conn->block = NULL;
+  conn->block_size = 0;
+  conn->block_cursor = 0;
   event_loop_add_file(loop, new_socket, EVENT_LOOP_READ, process_message, conn);
   LOG_DEBUG("new connection with fd %d", new_socket);
 }
 
 void start_server(const char *store_socket_name,
                   const char *master_addr,
-                  int port) {
+                  int port,
+                  int compression,
+                  plasma_manager_addr *directory,
+                  int64_t num_directory_managers) {
   struct sockaddr_in name;
   int sock = socket(PF_INET, SOCK_STREAM, 0);
   if (sock < 0) {
@@ -335,12 +1621,46 @@ void start_server(const char *store_socket_name,
   }
 
   event_loop *loop = event_loop_create();
-  plasma_manager_state *state = init_plasma_manager_state(store_socket_name);
+  plasma_manager_state *state =
+      init_plasma_manager_state(store_socket_name, master_addr, port,
+                                compression, directory,
+                                num_directory_managers);
   event_loop_add_file(loop, sock, EVENT_LOOP_READ, new_client_connection,
                       state);
+  if (directory != NULL) {
+    /* The directory learns about the objects of the local store from its
+     * notifications, starting with the objects that it already has. */
+    plasma_subscription_filter filter = {.include_existing = 1};
+    int notification_fd =
+        plasma_subscribe_filtered(state->store_conn, &filter);
+    event_loop_add_file(loop, notification_fd, EVENT_LOOP_READ,
+                        process_notification, state);
+  }
   event_loop_run(loop);
 }
 
+/* Parse a comma separated list of plasma managers in the format
+ * 123.456.789.10:12345. Return the number of managers. */
+int64_t parse_manager_list(char *list, plasma_manager_addr **managers) {
+  int64_t num_managers = 0;
+  *managers = NULL;
+  for (char *entry = strtok(list, ","); entry != NULL;
+       entry = strtok(NULL, ",")) {
+    char *colon = strchr(entry, ':');
+    if (colon == NULL) {
+      LOG_ERR("plasma manager %s has no port", entry);
+      exit(-1);
+    }
+    *colon = '\0';
+    *managers =
+        realloc(*managers, (num_managers + 1) * sizeof(plasma_manager_addr));
+    plasma_parse_addr(entry, (*managers)[num_managers].addr);
+    (*managers)[num_managers].port = atoi(colon + 1);
+    ++num_managers;
+  }
+  return num_managers;
+}
+
 /* Report "success" to valgrind. */
 void signal_handler(int signal) {
   if (signal == SIGTERM) {
@@ -356,8 +1676,13 @@ int main(int argc, char *argv[]) {
   char *master_addr = NULL;
   /* Port number the manager should use. */
   int port;
+  /* Whether objects are compressed between plasma managers. */
+  int compression = 0;
+  /* The plasma managers that share the directory of object locations. */
+  plasma_manager_addr *directory = NULL;
+  int64_t num_directory_managers = 0;
   int c;
-  while ((c = getopt(argc, argv, "s:m:p:")) != -1) {
+  while ((c = getopt(argc, argv, "s:m:p:cd:")) != -1) {
     switch (c) {
     case 's':
       store_socket_name = optarg;
@@ -368,6 +1693,12 @@ int main(int argc, char *argv[]) {
     case 'p':
       port = atoi(optarg);
       break;
+    case 'c':
+      compression = 1;
+      break;
+    case 'd':
+      num_directory_managers = parse_manager_list(optarg, &directory);
+      break;
     default:
       LOG_ERR("unknown option %c", c);
       exit(-1);
@@ -385,5 +1716,6 @@ int main(int argc, char *argv[]) {
         "123.456.789.10 with -m switch");
     exit(-1);
   }
-  start_server(store_socket_name, master_addr, port);
+  start_server(store_socket_name, master_addr, port, compression, directory,
+               num_directory_managers);
 }
@@ -14,15 +14,25 @@ typedef struct client_connection client_connection;
  * @param addr The IP address of the plasma manager we are sending the object
  * to.
  * @param port The port of the plasma manager we are sending the object to.
+ * @param digest The digest of the object if the other plasma manager asked
+ *        for all bytes because it does not have the object's contents, or 0.
  * @param conn The client_connection to the other plasma manager.
  *
- * This establishes a connection to the remote manager and sends the data
- * header to the other object manager.
+ * This establishes connections to the remote manager if there are none yet
+ * and queues the object for sending. Objects larger than PLASMA_RANGE_SIZE
+ * are split into ranges that are sent over up to PLASMA_NUM_STREAMS
+ * connections in parallel. Smaller objects are sent ahead of the ranges of
+ * large objects that have not been started yet. Of sealed objects of at least
+ * PLASMA_DIGEST_MIN_SIZE bytes whose digest the store knows, only the digest
+ * is sent at first (see receive_object_by_digest). Objects of at least
+ * PLASMA_COMPRESSION_MIN_SIZE bytes are sent in compressed blocks if both
+ * managers run with compression and samples of the object compress well.
  */
 void start_writing_data(event_loop *loop,
                         object_id object_id,
                         uint8_t addr[4],
                         int port,
+                        uint64_t digest,
                         client_connection *conn);
 
 /**
@@ -33,18 +43,43 @@ void start_writing_data(event_loop *loop,
  * @param object_id The object_id of the object we will be reading.
  * @param data_size Size of the object.
  * @param metadata_size Size of the metadata.
+ * @param range_offset Offset of the range that follows in the concatenated
+ *        data and metadata.
+ * @param range_size Size of the range that follows.
+ * @param compressed Whether the range follows in compressed blocks.
  * @param conn The client_connection to the other plasma manager.
  *
- * Initializes the object we are going to write to in the
- * local plasma store and then switches the data socket to reading mode.
+ * If this is the first range of the object, initializes the object we are
+ * going to write to in the local plasma store. Then switches the data socket
+ * to reading mode. The object is sealed once all of its ranges have been
+ * read, which may happen on different connections.
  */
 void start_reading_data(event_loop *loop,
                         int client_sock,
                         object_id object_id,
                         int64_t data_size,
                         int64_t metadata_size,
+                        int64_t range_offset,
+                        int64_t range_size,
+                        int compressed,
                         client_connection *conn);
 
+/**
+ * Receive an object from another plasma manager that only sent the object's
+ * digest. If the local store has the contents, the object is created from
+ * them without any transfer. Otherwise the other manager is asked to send
+ * all bytes of the object.
+ *
+ * @param loop This is the event loop of the plasma manager.
+ * @param conn The client_connection to the other plasma manager.
+ * @param req The PLASMA_DATA request with the digest and the address of the
+ *        other plasma manager.
+ * @return Void.
+ */
+void receive_object_by_digest(event_loop *loop,
+                              client_connection *conn,
+                              plasma_request *req);
+
 /**
  * Read the next chunk of the object in transit from the plasma manager
  * that is connected to the connection with index "conn_index". Once all data
@@ -61,9 +96,10 @@ void read_object_chunk(event_loop *loop,
                        int events);
 
 /**
- * Write the next chunk of the object currently transfered to the plasma manager
- * that is connected to the socket "data_sock". If no data has been sent yet,
- * the initial handshake to transfer the object size is performed.
+ * Write the next chunk of the range currently transfered to the plasma manager
+ * that is connected to the socket "data_sock". If no data of the range has
+ * been sent yet, the PLASMA_DATA request that describes the range is sent
+ * first.
  *
  * @param loop This is the event loop of the plasma manager.
  * @param data_sock This is the socket the other plasma manager is listening on.
@@ -89,7 +125,49 @@ void new_client_connection(event_loop *loop,
                            void *context,
                            int events);
 
-/* The buffer size in bytes. Data will get transfered in multiples of this */
-#define BUFSIZE 4096
+/* The number of bytes that a connection initially moves per event loop
+ * callback. The chunk size doubles while the socket keeps up. */
+#define PLASMA_MIN_CHUNK_SIZE (64 * 1024)
+
+/* The largest number of bytes that a connection moves per callback. */
+#define PLASMA_MAX_CHUNK_SIZE (8 * 1024 * 1024)
+
+/* Objects are sent in ranges of at most this many bytes. Each range has its
+ * own header, so small objects only ever wait for one range. */
+#define PLASMA_RANGE_SIZE (16 * 1024 * 1024)
+
+/* Objects of at least this many bytes are first offered to other plasma
+ * managers by their digest, which costs a round trip if the other side does
+ * not have the contents. */
+#define PLASMA_DIGEST_MIN_SIZE (64 * 1024)
+
+/* Objects of at least this many bytes are compressed if both plasma managers
+ * have compression switched on and samples of the object get smaller. */
+#define PLASMA_COMPRESSION_MIN_SIZE (256 * 1024)
+
+/* Compressed objects are sent in blocks of this many bytes, which are
+ * compressed and decompressed independently. */
+#define PLASMA_COMPRESSION_BLOCK_SIZE (64 * 1024)
+
+/* Before an object is compressed, this many samples of it of
+ * PLASMA_COMPRESSION_SAMPLE_SIZE bytes are compressed. The object is only
+ * compressed if they shrink to at most PLASMA_COMPRESSION_MAX_PERCENT of their
+ * size, so no time is spent on data that is already compressed. */
+#define PLASMA_COMPRESSION_SAMPLES 4
+#define PLASMA_COMPRESSION_SAMPLE_SIZE 4096
+#define PLASMA_COMPRESSION_MAX_PERCENT 90
+
+/* The maximum number of connections to another plasma manager. */
+#define PLASMA_NUM_STREAMS 4
+
+/* The number of plasma managers that every manager forwards a broadcast
+ * object to. Each of them forwards it to its share of the remaining managers
+ * as it arrives, so a broadcast to N managers takes about log(N) rounds of
+ * latency but only a single pass over the data per manager and link. */
+#define PLASMA_BROADCAST_FANOUT 2
+
+/* How often in milliseconds connections check for more data of an object
+ * that they forward while a local client is still writing it. */
+#define PLASMA_STALL_RETRY_MS 10
 
 #endif /* PLASMA_MANAGER_H */
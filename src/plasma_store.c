@@ -22,31 +22,87 @@
 #include <signal.h>
 #include <limits.h>
 #include <poll.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "common.h"
 #include "event_loop.h"
 #include "io.h"
 #include "uthash.h"
 #include "utarray.h"
+#include "utlist.h"
+#include "digest.h"
 #include "fling.h"
+#include "id_table.h"
 #include "malloc.h"
 #include "plasma_store.h"
 
-void *dlmalloc(size_t);
-void dlfree(void *);
+/* Write exactly length bytes to the socket. */
+void plasma_write_bytes(int fd, uint8_t *cursor, int64_t length) {
+  while (length > 0) {
+    ssize_t nbytes = write(fd, cursor, length);
+    if (nbytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nbytes <= 0) {
+      LOG_ERR("write error, fd = %d", fd);
+      exit(-1);
+    }
+    cursor += nbytes;
+    length -= nbytes;
+  }
+}
 
 /**
  * This is used by the Plasma Store to send a reply to the Plasma Client.
  */
 void plasma_send_reply(int fd, plasma_reply *reply) {
-  int reply_count = sizeof(plasma_reply);
-  if (write(fd, reply, reply_count) != reply_count) {
-    LOG_ERR("write error, fd = %d", fd);
-    exit(-1);
-  }
+  plasma_write_bytes(fd, (uint8_t *) reply,
+                     plasma_reply_size(reply->num_objects));
 }
 
+enum object_state {
+  /** The object is still being written by its creator. */
+  OBJECT_OPEN,
+  /** The object has been sealed and can be shared with other processes. */
+  OBJECT_SEALED,
+  /** The object has been deleted but is still in use. It will be freed once
+   *  the last reference to it has been released. */
+  OBJECT_DELETED,
+};
+
+/* Memory with the contents of sealed objects, which is shared by all objects
+ * with these contents. */
 typedef struct {
+  /** The digest of the contents. This is used as a key for the hash table. */
+  uint64_t digest;
+  /** Pointer to the object header in front of the contents. */
+  uint8_t *pointer;
+  /** Memory mapped file containing the contents. */
+  int fd;
+  /** Size of the underlying map. */
+  int64_t map_size;
+  /** Offset of the data from the base of the mmap. */
+  ptrdiff_t offset;
+  /** The sizes of the data and metadata of the objects. */
+  int64_t data_size;
+  int64_t metadata_size;
+  /** The number of objects that use the memory. It is freed when the last
+   *  one goes away. */
+  int num_users;
+  /** Handle for the hash table of contents. */
+  UT_hash_handle hh;
+} object_content;
+
+typedef struct object_table_entry object_table_entry;
+
+struct object_table_entry {
   /* Object id of this object. */
   object_id object_id;
   /* Object info like size, creation time and owner. */
@@ -57,348 +113,2610 @@ typedef struct {
   int64_t map_size;
   /* Offset from the base of the mmap. */
   ptrdiff_t offset;
-  /* Handle for the uthash table. */
-  UT_hash_handle handle;
-  /* Pointer to the object data. Needed to free the object. */
+  /* Pointer to the object's header, which is followed by the data. Needed to
+   * free the object. This is NULL if the object has been spilled to disk and
+   * is not in memory. */
   uint8_t *pointer;
-} object_table_entry;
+  /* Whether a copy of the object has been written to the spill directory.
+   * Objects are immutable once sealed, so the copy stays valid after the
+   * object has been read back and it can be dropped from memory again
+   * without writing it. */
+  int spilled;
+  /* The contents that the memory of the object belongs to, if it is shared
+   * with other objects or is available for sharing, and NULL otherwise. */
+  object_content *content;
+  /* Time in microseconds when the object was last created, sealed or
+   * released. */
+  int64_t last_access;
+  /* The state of the object (see object_state). */
+  int state;
+  /* Number of clients that currently hold a reference to this object. The
+   * object can only be evicted or freed if this is zero. */
+  int ref_count;
+  /* Pointers for the list of objects that can be evicted. An object is in this
+   * list if and only if it is sealed, in memory and its ref_count is zero.
+   * Deleted objects that are still in use are kept in the list of deleted
+   * objects instead. */
+  object_table_entry *prev;
+  object_table_entry *next;
+};
+
+typedef struct {
+  /** The ID of the object. This is used as a key for the hash table. */
+  object_id object_id;
+  /** The object that is referenced. */
+  object_table_entry *entry;
+  /** How many times the client got the object without releasing it. */
+  int count;
+  /** Whether the client created the object and has not sealed or aborted it
+   *  yet. The reference is kept until then even if the client releases the
+   *  object, so that the object can be aborted when the client dies. */
+  int creating;
+} object_reference;
+
+/** The number of items that a pool allocates at once. */
+#define POOL_BLOCK_SIZE 64
+
+/* A free list of items of the same size, which saves a call to malloc and
+ * free for every object and request. Items are allocated in zeroed blocks
+ * of POOL_BLOCK_SIZE and are never given back. The free list is threaded
+ * through the first bytes of the free items, and the rest of an item keeps
+ * its contents while it is free, so that arrays in it can be reused. */
+typedef struct {
+  /** The size in bytes of an item. */
+  size_t item_size;
+  /** The items that are free. */
+  void *free_items;
+} item_pool;
+
+void item_pool_init(item_pool *pool, size_t item_size) {
+  CHECK(item_size >= sizeof(void *));
+  pool->item_size = item_size;
+  pool->free_items = NULL;
+}
+
+void *item_pool_alloc(item_pool *pool) {
+  if (pool->free_items == NULL) {
+    uint8_t *block = calloc(POOL_BLOCK_SIZE, pool->item_size);
+    CHECK(block != NULL);
+    for (int i = POOL_BLOCK_SIZE - 1; i >= 0; --i) {
+      void **item = (void **) (block + i * pool->item_size);
+      *item = pool->free_items;
+      pool->free_items = item;
+    }
+  }
+  void **item = pool->free_items;
+  pool->free_items = *item;
+  return item;
+}
+
+void item_pool_free(item_pool *pool, void *item) {
+  *(void **) item = pool->free_items;
+  pool->free_items = item;
+}
+
+typedef struct get_request get_request;
+
+typedef struct worker worker;
+
+/* Contains all information that is associated with a client connection. */
+struct client {
+  /** The socket used to communicate with the client. */
+  int sock;
+  /** A pointer to the global plasma store state. */
+  plasma_store_state *plasma_state;
+  /** The worker that serves this client. */
+  worker *worker;
+  /** The objects this client holds references to, keyed by object ID.
+   *  Objects are referenced when they are created or returned by a get and
+   *  stay referenced until the client releases them or disconnects. */
+  id_table references;
+  /** The get requests of this client that are still waiting for objects. */
+  get_request *pending_gets;
+  /** The file descriptors of the segments that were already sent to the
+   *  client. The client keeps them mapped, so they are never sent again. */
+  UT_array *sent_fds;
+  /** The shared memory channel of the client, or NULL if the client only
+   *  uses the socket. */
+  plasma_channel *channel;
+  /** The eventfd the client writes to when it pushes requests onto the empty
+   *  requests ring of the channel. */
+  int store_eventfd;
+  /** The eventfd the store writes to when the client waits for it. */
+  int client_eventfd;
+  /** The buffer that requests from the socket are read into. It grows to
+   *  the largest request and is reused for all of them. */
+  uint8_t *receive_buffer;
+  /** The size in bytes of receive_buffer. */
+  int64_t receive_buffer_size;
+};
+
+/* A get request that is waiting for objects to be sealed. */
+struct get_request {
+  /** The client that made the request. */
+  client *client_context;
+  /** The number of objects that were requested. */
+  int64_t num_object_ids;
+  /** The IDs of the requested objects. */
+  object_id *object_ids;
+  /** The objects that will be returned, in the order of object_ids. Objects
+   *  that are not available yet have a store_fd of -1. */
+  plasma_object *objects;
+  /** The number of requested objects that are available. */
+  int64_t num_satisfied;
+  /** The request is answered once this many objects are available. */
+  int64_t num_ready;
+  /** The timer that answers the request when the timeout expires, or -1. */
+  int64_t timer;
+  /** Whether objects that have been created but not sealed yet are returned
+   *  too. Their readers wait for the bytes they need with the watermark in
+   *  the object's header. */
+  int include_unsealed;
+  /** The error code of the reply. This is PLASMA_OBJECT_ABORTED if one of
+   *  the objects was aborted while the request waited for it. */
+  int error_code;
+  /** Pointers for the list of pending get requests of the client. */
+  get_request *prev;
+  get_request *next;
+};
 
 typedef struct {
   /* Object id of this object. */
   object_id object_id;
-  /* Socket connections of waiting clients. */
-  UT_array *conns;
-  /* Handle for the uthash table. */
-  UT_hash_handle handle;
+  /* Get requests that are waiting for this object. The array is kept when
+   * the entry goes back to its pool. */
+  UT_array *get_requests;
 } object_notify_entry;
 
-/* This is used to define the array of object IDs used to define the
+/* This is used to define the array of waiting get requests used to define the
+ * object_notify_entry type. */
+UT_icd get_request_icd = {sizeof(get_request *), NULL, NULL, NULL};
+
+/* This is used to define the array of notifications used to define the
  * notification_queue type. */
-UT_icd object_id_icd = {sizeof(object_id), NULL, NULL, NULL};
+UT_icd notification_icd = {sizeof(plasma_notification), NULL, NULL, NULL};
+
+/* This is used to define the array of notifications of a subscriber with a
+ * notification ring. */
+UT_icd ring_notification_icd = {sizeof(plasma_ring_notification), NULL, NULL,
+                                NULL};
 
 typedef struct {
   /** Client file descriptor. This is used as a key for the hash table. */
   int subscriber_fd;
-  /** The object IDs to notify the client about. We notify the client about the
-   *  IDs in the order that the objects were sealed. */
-  UT_array *object_ids;
+  /** The worker that sends the notifications. All sending happens on its
+   *  thread, so that only it touches the file descriptor in its event
+   *  loop. */
+  worker *worker;
+  /** The notifications to send to the client. We notify the client about the
+   *  objects in the order that the objects were sealed or evicted. These are
+   *  plasma_notification structs for the socket and plasma_ring_notification
+   *  structs for the ring. */
+  UT_array *notifications;
+  /** The number of bytes of the first notification that have already been
+   *  written to the socket. */
+  int64_t bytes_sent;
+  /** Whether the worker has been asked to send the queued notifications.
+   *  Notifications that come in before it gets to it are sent together. */
+  int flush_posted;
+  /** Whether the worker's event loop waits for room in the socket's send
+   *  buffer. */
+  int waiting_for_room;
+  /** The shared memory ring, or NULL if the notifications are written to
+   *  the socket. */
+  plasma_notification_ring *ring;
+  /** Which notifications the subscriber wants. */
+  plasma_subscription_filter filter;
+  /** While the existing objects are listed for a new subscriber, the number
+   *  of shards that have been listed. Notifications about objects in the
+   *  other shards are left out, because the listing gets to them later. */
+  int num_shards_listed;
   /** Handle for the uthash table. */
   UT_hash_handle hh;
 } notification_queue;
 
-struct plasma_store_state {
-  /* Event loop of the plasma store. */
+/* The workers that are waiting for an object of a shard to be sealed. */
+typedef struct {
+  /** The ID of the object. This is used as a key for the hash table. */
+  object_id object_id;
+  /** The workers that have get requests waiting for the object. The array
+   *  is kept when the waiters go back to their pool. */
+  UT_array *workers;
+} object_waiters;
+
+/* This is used to define the array of workers used to define the
+ * object_waiters type. */
+UT_icd worker_icd = {sizeof(worker *), NULL, NULL, NULL};
+
+/* The objects whose IDs hash to the same shard. */
+typedef struct {
+  /** Protects the tables of the shard as well as the state and the ref_count
+   *  of the entries in them. */
+  pthread_mutex_t lock;
+  /** Objects that are still being written by their owner process. */
+  id_table open_objects;
+  /** Objects that have already been sealed by their owner process and can now
+   *  be shared with other processes. */
+  id_table sealed_objects;
+  /** Workers that are waiting for objects of this shard. */
+  id_table waiters;
+  /** The pool that the waiters are allocated from. */
+  item_pool waiters_pool;
+} object_shard;
+
+enum worker_task_type {
+  /** Serve a new client connection. */
+  WORKER_TASK_NEW_CLIENT,
+  /** An object that get requests of the worker wait for has been created or
+   *  sealed. */
+  WORKER_TASK_OBJECT_SEALED,
+  /** An object that get requests of the worker wait for has been aborted. */
+  WORKER_TASK_OBJECT_ABORTED,
+  /** Notifications have been queued for a subscriber of the worker. */
+  WORKER_TASK_FLUSH_NOTIFICATIONS,
+};
+
+/* Work that one thread hands to the worker that owns a client. */
+typedef struct worker_task worker_task;
+
+struct worker_task {
+  /** The type of the task (see worker_task_type). */
+  int type;
+  /** For a new client, the socket of the connection. For notifications, the
+   *  file descriptor of the subscriber. */
+  int client_sock;
+  /** For a sealed object, the ID of the object. */
+  object_id object_id;
+  /** Pointers for the task queue of the worker. */
+  worker_task *prev;
+  worker_task *next;
+};
+
+/* A thread with its own event loop. Each client is served by exactly one
+ * worker, and all state of the client is only touched by that worker. */
+struct worker {
+  /** A pointer to the global plasma store state. */
+  plasma_store_state *plasma_state;
+  /** The event loop of this worker. */
   event_loop *loop;
-  /* Objects that are still being written by their owner process. */
-  object_table_entry *open_objects;
-  /* Objects that have already been sealed by their owner process and
-   * can now be shared with other processes. */
-  object_table_entry *sealed_objects;
-  /* Objects that processes are waiting for. */
-  object_notify_entry *objects_notify;
+  /** Get requests of this worker's clients that wait for objects. */
+  id_table objects_notify;
+  /** The pool that the entries of objects_notify are allocated from. */
+  item_pool notify_pool;
+  /** The pool that the object references of the worker's clients are
+   *  allocated from. */
+  item_pool reference_pool;
+  /** Protects the task queue. */
+  pthread_mutex_t tasks_lock;
+  /** Tasks that other threads posted to this worker. */
+  worker_task *tasks;
+  /** A pipe that wakes up the event loop of the worker when tasks are posted
+   *  to an empty queue. */
+  int tasks_pipe[2];
+  /** The thread that runs the event loop. */
+  pthread_t thread;
+};
+
+/** The number of shards the object tables are split into. */
+#define NUM_SHARDS 64
+
+struct plasma_store_state {
+  /** The workers that serve the clients. The first one runs in the main
+   *  thread and also accepts new connections. */
+  worker *workers;
+  /** The number of workers. */
+  int num_workers;
+  /** The worker that gets the next connection. */
+  int next_worker;
+  /** The object tables, sharded by object ID. */
+  object_shard shards[NUM_SHARDS];
+  /** Protects pending_notifications and the queues in it. */
+  pthread_mutex_t notifications_lock;
   /** The pending notifications that have not been sent to subscribers because
    *  the socket send buffers were full. This is a hash table from client file
-   *  descriptor to an array of object_ids to send to that client. */
+   *  descriptor to an array of notifications to send to that client. */
   notification_queue *pending_notifications;
+  /** Protects the allocator, memory_used and lru_list. A thread that holds it
+   *  may only try to lock a shard, so shard locks are taken first otherwise. */
+  pthread_mutex_t memory_lock;
+  /** The maximum number of bytes that objects may use, or 0 for no limit. */
+  int64_t memory_capacity;
+  /** The number of bytes currently used by objects in the store. */
+  int64_t memory_used;
+  /** Sealed objects that can be evicted, ordered from the least recently used
+   *  to the most recently used one. Objects that are only on disk are not in
+   *  this list. */
+  object_table_entry *lru_list;
+  /** Objects that have been deleted while clients still used them. */
+  object_table_entry *deleted_list;
+  /** The pool that the object table entries are allocated from. It is used
+   *  with the memory lock. */
+  item_pool entry_pool;
+  /** Whether seal_object computes digests, so that objects with the same
+   *  contents can share memory. */
+  int deduplicate;
+  /** Protects contents. It may be taken while holding the memory lock, but
+   *  not the other way round. */
+  pthread_mutex_t content_lock;
+  /** The contents of sealed objects that nobody uses, keyed by digest. An
+   *  object that is released with contents that are already here gives up
+   *  its memory and uses theirs. */
+  object_content *contents;
+  /** The named file that keeps the arena across restarts, or NULL. The index
+   *  of the objects in it is written next to it when the store shuts down. */
+  const char *arena_file;
+  /** The directory that objects are spilled to instead of being evicted, or
+   *  NULL if they are evicted. */
+  const char *spill_directory;
+  /** Wakes up the spill thread when memory_used grows beyond
+   *  SPILL_THRESHOLD_PERCENT of the capacity. It is used with the memory
+   *  lock. */
+  pthread_cond_t spill_cond;
+  /** The thread that writes cold objects to the spill directory ahead of
+   *  time, so that they can be dropped from memory right away when room is
+   *  needed. */
+  pthread_t spill_thread;
 };
 
-plasma_store_state *init_plasma_store(event_loop *loop) {
+/** The spill thread starts to write the least recently used objects to disk
+ *  once this percentage of the capacity is in use. */
+#define SPILL_THRESHOLD_PERCENT 75
+
+/** Objects whose memory, including the object header, is at most this many
+ *  bytes are allocated from slabs unless the -z switch says otherwise. */
+#define DEFAULT_SMALL_OBJECT_THRESHOLD 1024
+
+/* Run the tasks that were posted to a worker. */
+void process_worker_tasks(event_loop *loop,
+                          int tasks_fd,
+                          void *context,
+                          int events);
+
+plasma_store_state *init_plasma_store(int num_workers,
+                                      int64_t memory_capacity,
+                                      const char *spill_directory,
+                                      const char *arena_file,
+                                      int deduplicate) {
+  CHECK(num_workers > 0);
   plasma_store_state *state = malloc(sizeof(plasma_store_state));
-  state->loop = loop;
-  state->open_objects = NULL;
-  state->sealed_objects = NULL;
-  state->objects_notify = NULL;
+  state->workers = malloc(num_workers * sizeof(worker));
+  state->num_workers = num_workers;
+  state->next_worker = 0;
+  for (int i = 0; i < num_workers; ++i) {
+    worker *w = &state->workers[i];
+    w->plasma_state = state;
+    w->loop = event_loop_create();
+    id_table_init(&w->objects_notify, offsetof(object_notify_entry, object_id));
+    item_pool_init(&w->notify_pool, sizeof(object_notify_entry));
+    item_pool_init(&w->reference_pool, sizeof(object_reference));
+    pthread_mutex_init(&w->tasks_lock, NULL);
+    w->tasks = NULL;
+    CHECK(pipe(w->tasks_pipe) == 0);
+    for (int j = 0; j < 2; ++j) {
+      int flags = fcntl(w->tasks_pipe[j], F_GETFL, 0);
+      CHECK(fcntl(w->tasks_pipe[j], F_SETFL, flags | O_NONBLOCK) == 0);
+    }
+    event_loop_add_file(w->loop, w->tasks_pipe[0], EVENT_LOOP_READ,
+                        process_worker_tasks, w);
+  }
+  for (int i = 0; i < NUM_SHARDS; ++i) {
+    object_shard *shard = &state->shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    id_table_init(&shard->open_objects,
+                  offsetof(object_table_entry, object_id));
+    id_table_init(&shard->sealed_objects,
+                  offsetof(object_table_entry, object_id));
+    id_table_init(&shard->waiters, offsetof(object_waiters, object_id));
+    item_pool_init(&shard->waiters_pool, sizeof(object_waiters));
+  }
+  pthread_mutex_init(&state->notifications_lock, NULL);
   state->pending_notifications = NULL;
+  pthread_mutex_init(&state->memory_lock, NULL);
+  state->memory_capacity = memory_capacity;
+  state->memory_used = 0;
+  state->lru_list = NULL;
+  state->deleted_list = NULL;
+  item_pool_init(&state->entry_pool, sizeof(object_table_entry));
+  state->deduplicate = deduplicate;
+  pthread_mutex_init(&state->content_lock, NULL);
+  state->contents = NULL;
+  state->arena_file = arena_file;
+  state->spill_directory = spill_directory;
+  pthread_cond_init(&state->spill_cond, NULL);
   return state;
 }
 
+/* Return the shard that an object belongs to. Object IDs are random, so their
+ * first bytes are good enough as a hash. */
+object_shard *get_shard(plasma_store_state *s, object_id object_id) {
+  uint32_t hash;
+  memcpy(&hash, object_id.id, sizeof(hash));
+  return &s->shards[hash % NUM_SHARDS];
+}
+
+/* Return the current time in microseconds. */
+int64_t current_time_us(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/* Hand a task to a worker and wake up its event loop if necessary. */
+void post_task(worker *w, worker_task task) {
+  worker_task *posted = malloc(sizeof(worker_task));
+  *posted = task;
+  pthread_mutex_lock(&w->tasks_lock);
+  int was_empty = (w->tasks == NULL);
+  DL_APPEND(w->tasks, posted);
+  pthread_mutex_unlock(&w->tasks_lock);
+  if (was_empty) {
+    char wakeup = 0;
+    if (write(w->tasks_pipe[1], &wakeup, 1) != 1) {
+      LOG_ERR("could not wake up worker");
+    }
+  }
+}
+
+/* The number of bytes of memory that an object uses, including its
+ * header. */
+int64_t object_memory_size(int64_t data_size, int64_t metadata_size) {
+  return sizeof(plasma_object_header) + data_size + metadata_size;
+}
+
+/* Write the name of the file that an object is spilled to into name, which
+ * must have room for PATH_MAX characters. */
+void spill_file_name(plasma_store_state *s, object_id object_id, char *name) {
+  int length = snprintf(name, PATH_MAX, "%s/", s->spill_directory);
+  for (int i = 0; i < UNIQUE_ID_SIZE && length < PATH_MAX; ++i) {
+    length += snprintf(name + length, PATH_MAX - length, "%02x",
+                       object_id.id[i]);
+  }
+}
+
+/* Write the data and metadata of an object to its spill file. The object must
+ * be sealed and must not be freed while this runs. Return 0 on success and -1
+ * if the object could not be written. */
+int write_spill_file(plasma_store_state *s, object_table_entry *entry) {
+  char name[PATH_MAX];
+  spill_file_name(s, entry->object_id, name);
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    LOG_ERR("could not create spill file %s", name);
+    return -1;
+  }
+  uint8_t *cursor = entry->pointer + sizeof(plasma_object_header);
+  int64_t remaining = entry->info.data_size + entry->info.metadata_size;
+  while (remaining > 0) {
+    ssize_t nbytes = write(fd, cursor, remaining);
+    if (nbytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nbytes <= 0) {
+      LOG_ERR("could not write spill file %s", name);
+      close(fd);
+      unlink(name);
+      return -1;
+    }
+    cursor += nbytes;
+    remaining -= nbytes;
+  }
+  close(fd);
+  return 0;
+}
+
+/* Read the data and metadata of a spilled object from its spill file. Return
+ * 0 on success and -1 if the file could not be read. */
+int read_spill_file(plasma_store_state *s,
+                    object_id object_id,
+                    uint8_t *data,
+                    int64_t size) {
+  char name[PATH_MAX];
+  spill_file_name(s, object_id, name);
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERR("could not open spill file %s", name);
+    return -1;
+  }
+  while (size > 0) {
+    ssize_t nbytes = read(fd, data, size);
+    if (nbytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nbytes <= 0) {
+      LOG_ERR("could not read spill file %s", name);
+      close(fd);
+      return -1;
+    }
+    data += nbytes;
+    size -= nbytes;
+  }
+  close(fd);
+  return 0;
+}
+
+/* Free the memory of an object, which stays in the tables if it has been
+ * spilled. Memory that is shared with other objects is only freed with the
+ * last of them. The caller must hold the memory lock. Return the number of
+ * bytes that were freed. */
+int64_t free_object_memory(plasma_store_state *s, object_table_entry *entry) {
+  int64_t size =
+      object_memory_size(entry->info.data_size, entry->info.metadata_size);
+  uint8_t *pointer = entry->pointer;
+  object_content *content = entry->content;
+  entry->pointer = NULL;
+  entry->fd = -1;
+  entry->content = NULL;
+  if (content != NULL) {
+    pthread_mutex_lock(&s->content_lock);
+    content->num_users -= 1;
+    int in_use = content->num_users > 0;
+    if (!in_use) {
+      HASH_DELETE(hh, s->contents, content);
+    }
+    pthread_mutex_unlock(&s->content_lock);
+    if (in_use) {
+      return 0;
+    }
+    pointer = content->pointer;
+    free(content);
+  }
+  plasma_free(pointer, size);
+  s->memory_used -= size;
+  return size;
+}
+
+/* Free the memory of an object, its spill file and its entry. The object must
+ * not be in any of the tables anymore. The caller must hold the memory
+ * lock. Return the number of bytes that were freed. */
+int64_t free_object(plasma_store_state *s, object_table_entry *entry) {
+  int64_t size = 0;
+  if (entry->pointer != NULL) {
+    size = free_object_memory(s, entry);
+  }
+  if (entry->spilled) {
+    char name[PATH_MAX];
+    spill_file_name(s, entry->object_id, name);
+    unlink(name);
+  }
+  item_pool_free(&s->entry_pool, entry);
+  return size;
+}
+
+/* Return 1 if the file descriptor of a segment still has to be sent to the
+ * client and remember that it has been sent. Return 0 if the client already
+ * has it. */
+int client_needs_fd(client *client_context, int store_fd) {
+  for (int *fd = (int *) utarray_front(client_context->sent_fds); fd != NULL;
+       fd = (int *) utarray_next(client_context->sent_fds, fd)) {
+    if (*fd == store_fd) {
+      return 0;
+    }
+  }
+  utarray_push_back(client_context->sent_fds, &store_fd);
+  return 1;
+}
+
+/* Record that a client uses an object. The caller must hold the lock of the
+ * object's shard. */
+void add_object_reference(client *client_context, object_table_entry *entry) {
+  plasma_store_state *s = client_context->plasma_state;
+  object_reference *ref =
+      id_table_find(&client_context->references, entry->object_id);
+  if (ref == NULL) {
+    ref = item_pool_alloc(&client_context->worker->reference_pool);
+    ref->object_id = entry->object_id;
+    ref->entry = entry;
+    ref->count = 0;
+    ref->creating = 0;
+    id_table_insert(&client_context->references, ref);
+    if (entry->ref_count == 0 && entry->state == OBJECT_SEALED) {
+      /* The object is in use now, so it must not be evicted. */
+      pthread_mutex_lock(&s->memory_lock);
+      DL_DELETE(s->lru_list, entry);
+      pthread_mutex_unlock(&s->memory_lock);
+    }
+    entry->ref_count += 1;
+  }
+  ref->count += 1;
+}
+
+/* Offer the memory of a sealed object to later objects with the same
+ * contents. The caller must hold the content lock. */
+void add_content_locked(plasma_store_state *s, object_table_entry *entry) {
+  object_content *content = malloc(sizeof(object_content));
+  content->digest = entry->info.digest;
+  content->pointer = entry->pointer;
+  content->fd = entry->fd;
+  content->map_size = entry->map_size;
+  content->offset = entry->offset;
+  content->data_size = entry->info.data_size;
+  content->metadata_size = entry->info.metadata_size;
+  content->num_users = 1;
+  HASH_ADD(hh, s->contents, digest, sizeof(uint64_t), content);
+  entry->content = content;
+}
+
+/* Let a sealed object that nobody uses share the memory of an earlier object
+ * with the same contents and free its own memory, or offer its memory to
+ * later objects if there is no such object. Objects are only deduplicated
+ * once they are not referenced, so that the memory of an object never
+ * changes while a client maps it. The caller must hold the lock of the
+ * object's shard but not the memory lock. */
+void deduplicate_object(plasma_store_state *s, object_table_entry *entry) {
+  if (entry->info.digest == 0 || entry->pointer == NULL ||
+      entry->content != NULL) {
+    return;
+  }
+  int64_t data_size = entry->info.data_size;
+  int64_t metadata_size = entry->info.metadata_size;
+  pthread_mutex_lock(&s->content_lock);
+  object_content *content;
+  HASH_FIND(hh, s->contents, &entry->info.digest, sizeof(uint64_t), content);
+  if (content == NULL) {
+    add_content_locked(s, entry);
+    pthread_mutex_unlock(&s->content_lock);
+    return;
+  }
+  /* Equal digests only make equal contents likely. */
+  if (content->data_size != data_size ||
+      content->metadata_size != metadata_size ||
+      memcmp(content->pointer + sizeof(plasma_object_header),
+             entry->pointer + sizeof(plasma_object_header),
+             data_size + metadata_size) != 0) {
+    pthread_mutex_unlock(&s->content_lock);
+    return;
+  }
+  content->num_users += 1;
+  pthread_mutex_unlock(&s->content_lock);
+  LOG_DEBUG("deduplicating object of size %" PRId64, data_size);
+  pthread_mutex_lock(&s->memory_lock);
+  free_object_memory(s, entry);
+  pthread_mutex_unlock(&s->memory_lock);
+  entry->content = content;
+  entry->pointer = content->pointer;
+  entry->fd = content->fd;
+  entry->map_size = content->map_size;
+  entry->offset = content->offset;
+}
+
+/* Drop the reference a client holds on an object, no matter how many times the
+ * client got it. */
+void remove_object_reference(client *client_context, object_reference *ref) {
+  plasma_store_state *s = client_context->plasma_state;
+  object_table_entry *entry = ref->entry;
+  object_shard *shard = get_shard(s, ref->object_id);
+  id_table_remove(&client_context->references, ref->object_id);
+  item_pool_free(&client_context->worker->reference_pool, ref);
+  pthread_mutex_lock(&shard->lock);
+  entry->ref_count -= 1;
+  if (entry->ref_count == 0 && entry->state == OBJECT_SEALED) {
+    /* Nobody uses the object anymore, so it can be evicted. */
+    deduplicate_object(s, entry);
+    pthread_mutex_lock(&s->memory_lock);
+    entry->last_access = current_time_us();
+    DL_APPEND(s->lru_list, entry);
+    pthread_mutex_unlock(&s->memory_lock);
+  } else if (entry->ref_count == 0 && entry->state == OBJECT_DELETED) {
+    pthread_mutex_lock(&s->memory_lock);
+    DL_DELETE(s->deleted_list, entry);
+    free_object(s, entry);
+    pthread_mutex_unlock(&s->memory_lock);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Check if a subscriber wants notifications about an object. */
+int notification_filter_matches(plasma_subscription_filter *filter,
+                                object_table_entry *entry) {
+  if (memcmp(entry->object_id.id, filter->id_prefix.id,
+             filter->id_prefix_size) != 0) {
+    return 0;
+  }
+  if (filter->metadata_tag_size == 0) {
+    return 1;
+  }
+  if (entry->pointer == NULL ||
+      entry->info.metadata_size < filter->metadata_tag_size) {
+    return 0;
+  }
+  uint8_t *metadata =
+      entry->pointer + sizeof(plasma_object_header) + entry->info.data_size;
+  return memcmp(metadata, filter->metadata_tag, filter->metadata_tag_size) ==
+         0;
+}
+
+/* Queue a notification for a subscriber if it matches the subscriber's
+ * filter. The caller must hold the notifications lock. */
+void queue_notification_locked(notification_queue *queue,
+                               object_table_entry *entry,
+                               int type) {
+  if (!notification_filter_matches(&queue->filter, entry)) {
+    return;
+  }
+  if (queue->ring != NULL) {
+    plasma_ring_notification notification = {
+        .object_id = entry->object_id,
+        .type = type,
+        .data_size = entry->info.data_size,
+        .metadata_size = entry->info.metadata_size};
+    utarray_push_back(queue->notifications, &notification);
+  } else {
+    plasma_notification notification = {.object_id = entry->object_id,
+                                        .type = type};
+    utarray_push_back(queue->notifications, &notification);
+  }
+  if (!queue->flush_posted) {
+    queue->flush_posted = 1;
+    worker_task task = {.type = WORKER_TASK_FLUSH_NOTIFICATIONS,
+                        .client_sock = queue->subscriber_fd};
+    post_task(queue->worker, task);
+  }
+}
+
+/* Queue a notification for all subscribers. The caller must hold the lock of
+ * the object's shard, so that the notification is ordered with the listing
+ * of existing objects for new subscribers. The notifications are sent by
+ * the workers of the subscribers when they get to the next iteration of their
+ * event loops, so that all notifications of an iteration go out together. */
+void push_notification(plasma_store_state *s,
+                       object_table_entry *entry,
+                       int type) {
+  int shard_index = get_shard(s, entry->object_id) - s->shards;
+  pthread_mutex_lock(&s->notifications_lock);
+  notification_queue *queue, *temp_queue;
+  HASH_ITER(hh, s->pending_notifications, queue, temp_queue) {
+    if (shard_index < queue->num_shards_listed) {
+      queue_notification_locked(queue, entry, type);
+    }
+  }
+  pthread_mutex_unlock(&s->notifications_lock);
+}
+
+/* Evict sealed objects in least recently used order. The caller must hold the
+ * memory lock. Objects whose shard is locked by another thread are skipped,
+ * because that thread might be waiting for the memory lock. */
+int64_t evict_objects_locked(plasma_store_state *s, int64_t num_bytes) {
+  int64_t num_bytes_evicted = 0;
+  object_table_entry *entry = s->lru_list;
+  while (num_bytes_evicted < num_bytes && entry != NULL) {
+    object_table_entry *next = entry->next;
+    object_shard *shard = get_shard(s, entry->object_id);
+    if (pthread_mutex_trylock(&shard->lock) != 0) {
+      entry = next;
+      continue;
+    }
+    DL_DELETE(s->lru_list, entry);
+    if (s->spill_directory != NULL &&
+        (entry->spilled || write_spill_file(s, entry) == 0)) {
+      /* Usually the spill thread has written the object already. The object
+       * stays in the store and is read back when it is needed. */
+      LOG_DEBUG("spilling object of size %" PRId64, entry->info.data_size);
+      entry->spilled = 1;
+      num_bytes_evicted += free_object_memory(s, entry);
+      pthread_mutex_unlock(&shard->lock);
+      entry = next;
+      continue;
+    }
+    LOG_DEBUG("evicting object of size %" PRId64, entry->info.data_size);
+    id_table_remove(&shard->sealed_objects, entry->object_id);
+    /* Let subscribers know that they cannot get this object anymore. */
+    push_notification(s, entry, PLASMA_NOTIFICATION_EVICTED);
+    pthread_mutex_unlock(&shard->lock);
+    num_bytes_evicted += free_object(s, entry);
+    entry = next;
+  }
+  return num_bytes_evicted;
+}
+
+/* Write the least recently used objects to the spill directory while more
+ * than SPILL_THRESHOLD_PERCENT of the capacity is in use. Objects are pinned
+ * with a reference while they are written, so they cannot be freed in the
+ * meantime, and then go back to the cold end of the LRU list. */
+void *run_spill_thread(void *context) {
+  plasma_store_state *s = context;
+  pthread_mutex_lock(&s->memory_lock);
+  while (1) {
+    object_table_entry *entry = NULL;
+    if (s->memory_used * 100 > s->memory_capacity * SPILL_THRESHOLD_PERCENT) {
+      for (entry = s->lru_list; entry != NULL; entry = entry->next) {
+        /* Shards may only be tried while holding the memory lock. */
+        if (!entry->spilled &&
+            pthread_mutex_trylock(&get_shard(s, entry->object_id)->lock) ==
+                0) {
+          break;
+        }
+      }
+    }
+    if (entry == NULL) {
+      pthread_cond_wait(&s->spill_cond, &s->memory_lock);
+      continue;
+    }
+    object_shard *shard = get_shard(s, entry->object_id);
+    entry->ref_count += 1;
+    DL_DELETE(s->lru_list, entry);
+    pthread_mutex_unlock(&s->memory_lock);
+    pthread_mutex_unlock(&shard->lock);
+
+    int result = write_spill_file(s, entry);
+
+    pthread_mutex_lock(&shard->lock);
+    pthread_mutex_lock(&s->memory_lock);
+    entry->spilled = (result == 0);
+    entry->ref_count -= 1;
+    if (entry->ref_count == 0 && entry->state == OBJECT_SEALED) {
+      DL_PREPEND(s->lru_list, entry);
+    } else if (entry->ref_count == 0 && entry->state == OBJECT_DELETED) {
+      DL_DELETE(s->deleted_list, entry);
+      free_object(s, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (result != 0) {
+      /* The disk is full or unusable, so fall back to eviction until more
+       * memory is used. */
+      pthread_cond_wait(&s->spill_cond, &s->memory_lock);
+    }
+  }
+  return NULL;
+}
+
+int64_t evict_objects(plasma_store_state *s, int64_t num_bytes) {
+  pthread_mutex_lock(&s->memory_lock);
+  int64_t num_bytes_evicted = evict_objects_locked(s, num_bytes);
+  pthread_mutex_unlock(&s->memory_lock);
+  return num_bytes_evicted;
+}
+
+/** How often an allocation is retried when objects could not be evicted
+ *  because other threads held the locks of their shards. */
+#define MAX_ALLOCATION_ATTEMPTS 100
+
+/* Allocate memory for an object, evicting other objects if necessary. The
+ * caller must hold the memory lock. */
+uint8_t *allocate_object_memory(plasma_store_state *s, int64_t size) {
+  if (s->memory_capacity > 0 && size > s->memory_capacity) {
+    return NULL;
+  }
+  for (int attempt = 0;; ++attempt) {
+    uint8_t *pointer = NULL;
+    /* Make room for the new object if it would exceed the capacity. */
+    int64_t overflow = s->memory_used + size - s->memory_capacity;
+    if (s->memory_capacity == 0 || overflow <= 0 ||
+        evict_objects_locked(s, overflow) >= overflow) {
+      pointer = plasma_malloc(size);
+      while (pointer == NULL && evict_objects_locked(s, size) > 0) {
+        /* Because of fragmentation and dlmalloc's own overhead, the
+         * allocation can fail even if we are below the capacity, so keep
+         * evicting. */
+        pointer = plasma_malloc(size);
+      }
+    }
+    if (pointer != NULL || s->lru_list == NULL ||
+        attempt == MAX_ALLOCATION_ATTEMPTS) {
+      return pointer;
+    }
+    /* Some objects could not be evicted because their shards were locked.
+     * Let the other threads make progress and try again. */
+    pthread_mutex_unlock(&s->memory_lock);
+    sched_yield();
+    pthread_mutex_lock(&s->memory_lock);
+  }
+}
+
+/* Fill out the plasma_object that describes an object to a client. */
+void object_table_entry_to_plasma_object(object_table_entry *entry,
+                                         plasma_object *result) {
+  result->handle.store_fd = entry->fd;
+  result->handle.mmap_size = entry->map_size;
+  result->data_offset = entry->offset;
+  result->metadata_offset = entry->offset + entry->info.data_size;
+  result->data_size = entry->info.data_size;
+  result->metadata_size = entry->info.metadata_size;
+  result->digest = entry->info.digest;
+}
+
+void object_sealed(worker *w, object_id object_id);
+
+void object_aborted(worker *w, object_id object_id);
+
+/* Tell workers that an object their clients wait for has been created or
+ * sealed, or aborted if aborted is nonzero. The current worker handles this
+ * right away, the others get a task. */
+void wake_object_waiters(client *client_context,
+                         object_id object_id,
+                         UT_array *workers,
+                         int aborted) {
+  for (worker **w = (worker **) utarray_front(workers); w != NULL;
+       w = (worker **) utarray_next(workers, w)) {
+    if (*w == client_context->worker) {
+      if (aborted) {
+        object_aborted(*w, object_id);
+      } else {
+        object_sealed(*w, object_id);
+      }
+    } else {
+      worker_task task = {.type = aborted ? WORKER_TASK_OBJECT_ABORTED
+                                          : WORKER_TASK_OBJECT_SEALED,
+                          .object_id = object_id};
+      post_task(*w, task);
+    }
+  }
+}
+
 /* Create a new object buffer in the hash table. */
-void create_object(plasma_store_state *s,
-                   object_id object_id,
-                   int64_t data_size,
-                   int64_t metadata_size,
-                   plasma_object *result) {
+int create_object(client *client_context,
+                  object_id object_id,
+                  int64_t data_size,
+                  int64_t metadata_size,
+                  plasma_object *result) {
   LOG_DEBUG("creating object"); /* TODO(pcm): add object_id here */
+  plasma_store_state *s = client_context->plasma_state;
+  object_shard *shard = get_shard(s, object_id);
 
-  object_table_entry *entry;
-  HASH_FIND(handle, s->open_objects, &object_id, sizeof(object_id), entry);
-  CHECKM(entry == NULL, "Cannot create object twice.");
-
-  uint8_t *pointer = dlmalloc(data_size + metadata_size);
+  /* No shard lock may be held while allocating, because eviction needs to
+   * lock the shards of the evicted objects. */
+  int64_t size = object_memory_size(data_size, metadata_size);
+  pthread_mutex_lock(&s->memory_lock);
+  uint8_t *pointer = allocate_object_memory(s, size);
+  if (pointer == NULL) {
+    pthread_mutex_unlock(&s->memory_lock);
+    LOG_ERR("not enough memory to create an object of size %" PRId64, size);
+    return PLASMA_OUT_OF_MEMORY;
+  }
   int fd;
   int64_t map_size;
   ptrdiff_t offset;
   get_malloc_mapinfo(pointer, &fd, &map_size, &offset);
   assert(fd != -1);
+  s->memory_used += size;
+  if (s->spill_directory != NULL && s->memory_capacity > 0 &&
+      s->memory_used * 100 > s->memory_capacity * SPILL_THRESHOLD_PERCENT) {
+    pthread_cond_signal(&s->spill_cond);
+  }
+  object_table_entry *entry = item_pool_alloc(&s->entry_pool);
+  pthread_mutex_unlock(&s->memory_lock);
 
-  entry = malloc(sizeof(object_table_entry));
   memcpy(&entry->object_id, &object_id, 20);
   entry->info.data_size = data_size;
   entry->info.metadata_size = metadata_size;
+  entry->info.digest = 0;
   entry->pointer = pointer;
+  entry->spilled = 0;
+  entry->content = NULL;
   /* TODO(pcm): set the other fields */
   entry->fd = fd;
   entry->map_size = map_size;
-  entry->offset = offset;
-  HASH_ADD(handle, s->open_objects, object_id, sizeof(object_id), entry);
-  result->handle.store_fd = fd;
-  result->handle.mmap_size = map_size;
-  result->data_offset = offset;
-  result->metadata_offset = offset + data_size;
-  result->data_size = data_size;
-  result->metadata_size = metadata_size;
+  entry->offset = offset + sizeof(plasma_object_header);
+  /* Nothing has been written yet. */
+  memset(pointer, 0, sizeof(plasma_object_header));
+  entry->last_access = current_time_us();
+  entry->state = OBJECT_OPEN;
+  entry->ref_count = 0;
+  entry->prev = NULL;
+  entry->next = NULL;
+
+  pthread_mutex_lock(&shard->lock);
+  object_table_entry *existing = id_table_find(&shard->open_objects, object_id);
+  if (existing == NULL) {
+    existing = id_table_find(&shard->sealed_objects, object_id);
+  }
+  if (existing != NULL) {
+    /* Somebody else created the object first, for example two managers that
+     * received the same object. */
+    pthread_mutex_lock(&s->memory_lock);
+    free_object(s, entry);
+    pthread_mutex_unlock(&s->memory_lock);
+    pthread_mutex_unlock(&shard->lock);
+    LOG_DEBUG("an object with this ID has already been created");
+    return PLASMA_OBJECT_EXISTS;
+  }
+  id_table_insert(&shard->open_objects, entry);
+  /* The creator uses the object until it releases it. */
+  add_object_reference(client_context, entry);
+  object_reference *ref =
+      id_table_find(&client_context->references, object_id);
+  ref->creating = 1;
+  object_table_entry_to_plasma_object(entry, result);
+  /* Get requests that include unsealed objects can be answered now. The
+   * workers stay registered, because other requests wait for the seal. */
+  UT_array *workers = NULL;
+  object_waiters *waiters = id_table_find(&shard->waiters, object_id);
+  if (waiters) {
+    utarray_new(workers, &worker_icd);
+    for (worker **w = (worker **) utarray_front(waiters->workers); w != NULL;
+         w = (worker **) utarray_next(waiters->workers, w)) {
+      utarray_push_back(workers, w);
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+  if (workers) {
+    wake_object_waiters(client_context, object_id, workers, 0);
+    utarray_free(workers);
+  }
+  return PLASMA_OK;
+}
+
+/* Register a worker to be told when an object is sealed. The caller must hold
+ * the lock of the object's shard. */
+void add_object_waiter(object_shard *shard, object_id object_id, worker *w) {
+  object_waiters *waiters = id_table_find(&shard->waiters, object_id);
+  if (!waiters) {
+    waiters = item_pool_alloc(&shard->waiters_pool);
+    waiters->object_id = object_id;
+    if (waiters->workers == NULL) {
+      utarray_new(waiters->workers, &worker_icd);
+    }
+    id_table_insert(&shard->waiters, waiters);
+  }
+  for (worker **waiter = (worker **) utarray_front(waiters->workers);
+       waiter != NULL;
+       waiter = (worker **) utarray_next(waiters->workers, waiter)) {
+    if (*waiter == w) {
+      return;
+    }
+  }
+  utarray_push_back(waiters->workers, &w);
+}
+
+/* Unregister the workers that wait for an object and return them, or NULL if
+ * there are none. The workers are woken up after unlocking the shard, so the
+ * waiters go back to the pool right away and the caller frees the array. The
+ * caller must hold the lock of the object's shard. */
+UT_array *take_object_waiters(object_shard *shard, object_id object_id) {
+  object_waiters *waiters = id_table_remove(&shard->waiters, object_id);
+  if (!waiters) {
+    return NULL;
+  }
+  UT_array *workers = waiters->workers;
+  waiters->workers = NULL;
+  item_pool_free(&shard->waiters_pool, waiters);
+  return workers;
+}
+
+/* Read a spilled object back into memory. No shard lock may be held, because
+ * this has to allocate memory. Return 0 if the object could not be read back,
+ * and 1 if it is in memory now or has been deleted in the meantime. */
+int restore_object(plasma_store_state *s, object_id object_id) {
+  object_shard *shard = get_shard(s, object_id);
+  pthread_mutex_lock(&shard->lock);
+  object_table_entry *entry = id_table_find(&shard->sealed_objects, object_id);
+  if (!entry || entry->pointer != NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+  }
+  int64_t object_size = entry->info.data_size + entry->info.metadata_size;
+  pthread_mutex_unlock(&shard->lock);
+
+  int64_t size = object_size + sizeof(plasma_object_header);
+  pthread_mutex_lock(&s->memory_lock);
+  uint8_t *pointer = allocate_object_memory(s, size);
+  if (pointer != NULL) {
+    s->memory_used += size;
+  }
+  pthread_mutex_unlock(&s->memory_lock);
+  if (pointer == NULL) {
+    LOG_ERR("not enough memory to restore an object of size %" PRId64, size);
+    return 0;
+  }
+  plasma_object_header *header = (plasma_object_header *) pointer;
+  memset(header, 0, sizeof(plasma_object_header));
+  header->bytes_ready = object_size;
+  int result = read_spill_file(s, object_id,
+                               pointer + sizeof(plasma_object_header),
+                               object_size);
+
+  /* Another thread may have restored or deleted the object meanwhile. */
+  pthread_mutex_lock(&shard->lock);
+  entry = id_table_find(&shard->sealed_objects, object_id);
+  pthread_mutex_lock(&s->memory_lock);
+  if (result == 0 && entry && entry->pointer == NULL) {
+    LOG_DEBUG("restored spilled object of size %" PRId64, size);
+    entry->pointer = pointer;
+    ptrdiff_t offset;
+    get_malloc_mapinfo(pointer, &entry->fd, &entry->map_size, &offset);
+    entry->offset = offset + sizeof(plasma_object_header);
+    entry->last_access = current_time_us();
+    DL_APPEND(s->lru_list, entry);
+  } else {
+    plasma_free(pointer, size);
+    s->memory_used -= size;
+  }
+  pthread_mutex_unlock(&s->memory_lock);
+  pthread_mutex_unlock(&shard->lock);
+  return result == 0;
+}
+
+/* Look up a sealed object, or also an unsealed one if include_unsealed is
+ * nonzero, and reference it. Spilled objects are read back first. If the
+ * object is not there and wait is nonzero, the client's worker is registered
+ * to be told when the object is created or sealed. */
+int get_object_or_wait(client *client_context,
+                       object_id object_id,
+                       plasma_object *result,
+                       int include_unsealed,
+                       int wait) {
+  plasma_store_state *s = client_context->plasma_state;
+  object_shard *shard = get_shard(s, object_id);
+  pthread_mutex_lock(&shard->lock);
+  object_table_entry *entry = id_table_find(&shard->sealed_objects, object_id);
+  while (entry && entry->pointer == NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    if (!restore_object(s, object_id)) {
+      return OBJECT_NOT_FOUND;
+    }
+    pthread_mutex_lock(&shard->lock);
+    entry = id_table_find(&shard->sealed_objects, object_id);
+  }
+  if (!entry && include_unsealed) {
+    entry = id_table_find(&shard->open_objects, object_id);
+  }
+  if (entry) {
+    add_object_reference(client_context, entry);
+    object_table_entry_to_plasma_object(entry, result);
+  } else if (wait) {
+    add_object_waiter(shard, object_id, client_context->worker);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return entry ? OBJECT_FOUND : OBJECT_NOT_FOUND;
 }
 
 /* Get an object from the hash table. */
-int get_object(plasma_store_state *s,
-               int conn,
+int get_object(client *client_context,
                object_id object_id,
                plasma_object *result) {
-  object_table_entry *entry;
-  HASH_FIND(handle, s->sealed_objects, &object_id, sizeof(object_id), entry);
-  if (entry) {
-    result->handle.store_fd = entry->fd;
-    result->handle.mmap_size = entry->map_size;
-    result->data_offset = entry->offset;
-    result->metadata_offset = entry->offset + entry->info.data_size;
-    result->data_size = entry->info.data_size;
-    result->metadata_size = entry->info.metadata_size;
-    return OBJECT_FOUND;
-  } else {
-    object_notify_entry *notify_entry;
-    LOG_DEBUG("object not in hash table of sealed objects");
-    HASH_FIND(handle, s->objects_notify, &object_id, sizeof(object_id),
-              notify_entry);
+  return get_object_or_wait(client_context, object_id, result, 0, 0);
+}
+
+/* Tell the shard of an object that a worker does not wait for it anymore. */
+void remove_object_waiter(plasma_store_state *s,
+                          object_id object_id,
+                          worker *w) {
+  object_shard *shard = get_shard(s, object_id);
+  pthread_mutex_lock(&shard->lock);
+  object_waiters *waiters = id_table_find(&shard->waiters, object_id);
+  if (waiters) {
+    for (int i = utarray_len(waiters->workers) - 1; i >= 0; --i) {
+      if (*(worker **) utarray_eltptr(waiters->workers, i) == w) {
+        utarray_erase(waiters->workers, i, 1);
+      }
+    }
+    if (utarray_len(waiters->workers) == 0) {
+      id_table_remove(&shard->waiters, object_id);
+      item_pool_free(&shard->waiters_pool, waiters);
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Stop waiting for the objects of a get request that are not available and
+ * destroy the request. */
+void discard_get_request(plasma_store_state *s, get_request *get_req) {
+  client *client_context = get_req->client_context;
+  worker *w = client_context->worker;
+  for (int64_t i = 0; i < get_req->num_object_ids; ++i) {
+    if (get_req->objects[i].handle.store_fd != -1) {
+      continue;
+    }
+    object_notify_entry *notify_entry =
+        id_table_find(&w->objects_notify, get_req->object_ids[i]);
     if (!notify_entry) {
-      notify_entry = malloc(sizeof(object_notify_entry));
-      memset(notify_entry, 0, sizeof(object_notify_entry));
-      utarray_new(notify_entry->conns, &ut_int_icd);
-      memcpy(&notify_entry->object_id, &object_id, 20);
-      HASH_ADD(handle, s->objects_notify, object_id, sizeof(object_id),
-               notify_entry);
+      continue;
+    }
+    for (int j = utarray_len(notify_entry->get_requests) - 1; j >= 0; --j) {
+      get_request **r =
+          (get_request **) utarray_eltptr(notify_entry->get_requests, j);
+      if (*r == get_req) {
+        utarray_erase(notify_entry->get_requests, j, 1);
+      }
+    }
+    if (utarray_len(notify_entry->get_requests) == 0) {
+      id_table_remove(&w->objects_notify, notify_entry->object_id);
+      remove_object_waiter(s, notify_entry->object_id, w);
+      item_pool_free(&w->notify_pool, notify_entry);
     }
-    utarray_push_back(notify_entry->conns, &conn);
   }
-  return OBJECT_NOT_FOUND;
+  if (get_req->timer != -1) {
+    event_loop_remove_timer(w->loop, get_req->timer);
+  }
+  DL_DELETE(client_context->pending_gets, get_req);
+  free(get_req->object_ids);
+  free(get_req->objects);
+  free(get_req);
+}
+
+/* Send the reply to a get request along with the file descriptors of the
+ * segments that contain the objects, and destroy the request. */
+void return_from_get(plasma_store_state *s, get_request *get_req) {
+  client *client_context = get_req->client_context;
+  /* Collect the file descriptors of the segments that the client has not
+   * seen yet. */
+  UT_array *fds;
+  utarray_new(fds, &ut_int_icd);
+  for (int64_t i = 0; i < get_req->num_object_ids; ++i) {
+    int store_fd = get_req->objects[i].handle.store_fd;
+    if (store_fd != -1 && client_needs_fd(client_context, store_fd)) {
+      utarray_push_back(fds, &store_fd);
+    }
+  }
+  plasma_reply *reply = malloc(plasma_reply_size(get_req->num_object_ids));
+  memset(reply, 0, sizeof(plasma_reply));
+  reply->num_objects = get_req->num_object_ids;
+  reply->num_fds = utarray_len(fds);
+  reply->error_code = get_req->error_code;
+  memcpy(reply->objects, get_req->objects,
+         get_req->num_object_ids * sizeof(plasma_object));
+  plasma_send_reply(client_context->sock, reply);
+  for (int *fd = (int *) utarray_front(fds); fd != NULL;
+       fd = (int *) utarray_next(fds, fd)) {
+    send_fd(client_context->sock, *fd, (char *) fd, sizeof(int));
+  }
+  free(reply);
+  utarray_free(fds);
+  discard_get_request(s, get_req);
+}
+
+/* Answer a get request whose timeout expired with the objects that are
+ * available. */
+int get_timeout_handler(event_loop *loop, timer_id id, void *context) {
+  get_request *get_req = context;
+  /* The timer is removed by the event loop when we return. */
+  get_req->timer = -1;
+  return_from_get(get_req->client_context->plasma_state, get_req);
+  return EVENT_LOOP_TIMER_DONE;
+}
+
+/* Get several objects, replying once num_ready of them are available or the
+ * timeout expires. */
+void process_get_request(client *client_context,
+                         int64_t num_object_ids,
+                         object_id object_ids[],
+                         int64_t num_ready,
+                         int64_t timeout_ms,
+                         int include_unsealed) {
+  plasma_store_state *s = client_context->plasma_state;
+  worker *w = client_context->worker;
+  get_request *get_req = malloc(sizeof(get_request));
+  get_req->client_context = client_context;
+  get_req->num_object_ids = num_object_ids;
+  get_req->object_ids = malloc(num_object_ids * sizeof(object_id));
+  memcpy(get_req->object_ids, object_ids, num_object_ids * sizeof(object_id));
+  get_req->objects = malloc(num_object_ids * sizeof(plasma_object));
+  get_req->num_satisfied = 0;
+  get_req->num_ready = num_ready;
+  get_req->timer = -1;
+  get_req->include_unsealed = include_unsealed;
+  get_req->error_code = PLASMA_OK;
+  DL_APPEND(client_context->pending_gets, get_req);
+  for (int64_t i = 0; i < num_object_ids; ++i) {
+    memset(&get_req->objects[i], 0, sizeof(plasma_object));
+    if (get_object_or_wait(client_context, object_ids[i], &get_req->objects[i],
+                           include_unsealed, 0) == OBJECT_FOUND) {
+      get_req->num_satisfied += 1;
+    } else {
+      get_req->objects[i].handle.store_fd = -1;
+    }
+  }
+  if (get_req->num_satisfied >= num_ready || timeout_ms == 0) {
+    return_from_get(s, get_req);
+    return;
+  }
+  /* Wait for the missing objects to be sealed (or created, if unsealed objects
+   * are included). The lookup is repeated while registering, because they may
+   * have become available in the meantime. */
+  for (int64_t i = 0; i < num_object_ids; ++i) {
+    if (get_req->objects[i].handle.store_fd != -1) {
+      continue;
+    }
+    if (get_object_or_wait(client_context, object_ids[i], &get_req->objects[i],
+                           include_unsealed, 1) == OBJECT_FOUND) {
+      get_req->num_satisfied += 1;
+      continue;
+    }
+    object_notify_entry *notify_entry =
+        id_table_find(&w->objects_notify, object_ids[i]);
+    if (!notify_entry) {
+      notify_entry = item_pool_alloc(&w->notify_pool);
+      if (notify_entry->get_requests == NULL) {
+        utarray_new(notify_entry->get_requests, &get_request_icd);
+      }
+      memcpy(&notify_entry->object_id, &object_ids[i], sizeof(object_id));
+      id_table_insert(&w->objects_notify, notify_entry);
+    }
+    /* If the same ID is requested twice, only wait for it once. */
+    get_request **last =
+        (get_request **) utarray_back(notify_entry->get_requests);
+    if (last == NULL || *last != get_req) {
+      utarray_push_back(notify_entry->get_requests, &get_req);
+    }
+  }
+  if (get_req->num_satisfied >= num_ready) {
+    return_from_get(s, get_req);
+    return;
+  }
+  if (timeout_ms > 0) {
+    get_req->timer =
+        event_loop_add_timer(w->loop, timeout_ms, get_timeout_handler, get_req);
+  }
 }
 
 /* Check if an object is present. */
 int contains_object(plasma_store_state *s, object_id object_id) {
-  object_table_entry *entry;
-  HASH_FIND(handle, s->sealed_objects, &object_id, sizeof(object_id), entry);
+  object_shard *shard = get_shard(s, object_id);
+  pthread_mutex_lock(&shard->lock);
+  object_table_entry *entry = id_table_find(&shard->sealed_objects, object_id);
+  pthread_mutex_unlock(&shard->lock);
   return entry ? OBJECT_FOUND : OBJECT_NOT_FOUND;
 }
 
+/* Answer the get requests of a worker that wait for an object that has just
+ * been created or sealed. Requests that only take sealed objects keep waiting
+ * if the object is not sealed. This runs on the worker's own thread. */
+void object_sealed(worker *w, object_id object_id) {
+  plasma_store_state *s = w->plasma_state;
+  object_notify_entry *notify_entry =
+      id_table_find(&w->objects_notify, object_id);
+  if (!notify_entry) {
+    /* The get requests have already been answered or discarded. */
+    return;
+  }
+  object_shard *shard = get_shard(s, object_id);
+  pthread_mutex_lock(&shard->lock);
+  object_table_entry *entry = id_table_find(&shard->sealed_objects, object_id);
+  if (entry && entry->pointer == NULL) {
+    /* The object has been spilled since it was sealed. */
+    pthread_mutex_unlock(&shard->lock);
+    restore_object(s, object_id);
+    pthread_mutex_lock(&shard->lock);
+    entry = id_table_find(&shard->sealed_objects, object_id);
+    if (entry && entry->pointer == NULL) {
+      entry = NULL;
+    }
+  }
+  if (!entry) {
+    entry = id_table_find(&shard->open_objects, object_id);
+  }
+  if (!entry || entry->state != OBJECT_SEALED) {
+    /* The object was evicted or deleted before this worker got to it, or it
+     * has only been created. Keep waiting for it to be sealed. */
+    add_object_waiter(shard, object_id, w);
+  }
+  UT_array *satisfied;
+  utarray_new(satisfied, &get_request_icd);
+  for (int j = utarray_len(notify_entry->get_requests) - 1; entry && j >= 0;
+       --j) {
+    get_request *get_req =
+        *(get_request **) utarray_eltptr(notify_entry->get_requests, j);
+    if (entry->state != OBJECT_SEALED && !get_req->include_unsealed) {
+      continue;
+    }
+    for (int64_t i = 0; i < get_req->num_object_ids; ++i) {
+      if (get_req->objects[i].handle.store_fd == -1 &&
+          memcmp(&get_req->object_ids[i], &object_id, sizeof(object_id)) ==
+              0) {
+        add_object_reference(get_req->client_context, entry);
+        object_table_entry_to_plasma_object(entry, &get_req->objects[i]);
+        get_req->num_satisfied += 1;
+      }
+    }
+    utarray_erase(notify_entry->get_requests, j, 1);
+    utarray_push_back(satisfied, &get_req);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  if (utarray_len(notify_entry->get_requests) == 0) {
+    id_table_remove(&w->objects_notify, object_id);
+    item_pool_free(&w->notify_pool, notify_entry);
+  }
+  for (get_request **r = (get_request **) utarray_front(satisfied); r != NULL;
+       r = (get_request **) utarray_next(satisfied, r)) {
+    if ((*r)->num_satisfied >= (*r)->num_ready) {
+      return_from_get(s, *r);
+    }
+  }
+  utarray_free(satisfied);
+}
+
+/* Answer the get requests of a worker that wait for an object that has been
+ * aborted. They do not wait for their other objects either, because the
+ * client has to find out that the object will not come. This runs on the
+ * worker's own thread. */
+void object_aborted(worker *w, object_id object_id) {
+  plasma_store_state *s = w->plasma_state;
+  object_notify_entry *notify_entry =
+      id_table_find(&w->objects_notify, object_id);
+  if (!notify_entry) {
+    return;
+  }
+  /* Answering a request changes the list, so copy it first. */
+  UT_array *aborted;
+  utarray_new(aborted, &get_request_icd);
+  for (get_request **r =
+           (get_request **) utarray_front(notify_entry->get_requests);
+       r != NULL;
+       r = (get_request **) utarray_next(notify_entry->get_requests, r)) {
+    utarray_push_back(aborted, r);
+  }
+  for (get_request **r = (get_request **) utarray_front(aborted); r != NULL;
+       r = (get_request **) utarray_next(aborted, r)) {
+    (*r)->error_code = PLASMA_OBJECT_ABORTED;
+    return_from_get(s, *r);
+  }
+  utarray_free(aborted);
+}
+
+/* Drop the extra hold of the creator on an object that has been sealed or
+ * aborted. If the creator already released the object, its reference goes
+ * away. */
+void finish_creating(client *client_context, object_id object_id) {
+  object_reference *ref =
+      id_table_find(&client_context->references, object_id);
+  if (ref == NULL || !ref->creating) {
+    return;
+  }
+  ref->creating = 0;
+  if (ref->count == 0) {
+    remove_object_reference(client_context, ref);
+  }
+}
+
 /* Seal an object that has been created in the hash table. */
-void seal_object(plasma_store_state *s,
-                 object_id object_id,
-                 UT_array **conns,
-                 plasma_object *result) {
+void seal_object(client *client_context, object_id object_id) {
   LOG_DEBUG("sealing object");  // TODO(pcm): add object_id here
-  object_table_entry *entry;
-  HASH_FIND(handle, s->open_objects, &object_id, sizeof(object_id), entry);
+  plasma_store_state *s = client_context->plasma_state;
+  object_shard *shard = get_shard(s, object_id);
+  /* The digest is computed before locking the shard. The creator's reference
+   * keeps the memory of the object from going away in the meantime. */
+  uint64_t digest = 0;
+  object_reference *ref =
+      id_table_find(&client_context->references, object_id);
+  if (s->deduplicate && ref != NULL && ref->creating) {
+    object_table_entry *created = ref->entry;
+    digest = plasma_digest(created->pointer + sizeof(plasma_object_header),
+                           created->info.data_size +
+                               created->info.metadata_size);
+  }
+  pthread_mutex_lock(&shard->lock);
+  object_table_entry *entry = id_table_remove(&shard->open_objects, object_id);
   if (!entry) {
+    pthread_mutex_unlock(&shard->lock);
     return; /* TODO(pcm): return error */
   }
-  HASH_DELETE(handle, s->open_objects, entry);
-  HASH_ADD(handle, s->sealed_objects, object_id, sizeof(object_id), entry);
+  id_table_insert(&shard->sealed_objects, entry);
+  entry->info.digest = digest;
+  entry->state = OBJECT_SEALED;
+  /* Readers of the unsealed object may wait for the rest of it. */
+  plasma_object_header *header = (plasma_object_header *) entry->pointer;
+  __atomic_store_n(&header->bytes_ready,
+                   entry->info.data_size + entry->info.metadata_size,
+                   __ATOMIC_RELEASE);
+  if (entry->ref_count == 0) {
+    /* Sealed objects that nobody uses can be evicted. */
+    pthread_mutex_lock(&s->memory_lock);
+    entry->last_access = current_time_us();
+    DL_APPEND(s->lru_list, entry);
+    pthread_mutex_unlock(&s->memory_lock);
+  }
+  UT_array *workers = take_object_waiters(shard, object_id);
+  /* Inform all subscribers that a new object has been sealed. */
+  push_notification(s, entry, PLASMA_NOTIFICATION_SEALED);
+  pthread_mutex_unlock(&shard->lock);
+  finish_creating(client_context, object_id);
+
+  /* Inform the workers whose clients are getting this object that the object
+   * is ready now. */
+  if (!workers) {
+    return;
+  }
+  wake_object_waiters(client_context, object_id, workers, 0);
+  utarray_free(workers);
+}
 
-  /* Inform all subscribers that a new object has been sealed. */
-  notification_queue *queue, *temp_queue;
-  HASH_ITER(hh, s->pending_notifications, queue, temp_queue) {
-    utarray_push_back(queue->object_ids, &object_id);
-    send_notifications(s->loop, queue->subscriber_fd, s, 0);
+/* Release an object that the client got before. */
+void release_object(client *client_context, object_id object_id) {
+  object_reference *ref =
+      id_table_find(&client_context->references, object_id);
+  if (ref == NULL) {
+    LOG_DEBUG("released an object that is not referenced by the client");
+    return;
+  }
+  ref->count -= 1;
+  if (ref->count == 0 && !ref->creating) {
+    remove_object_reference(client_context, ref);
   }
+}
 
-  /* Inform processes getting this object that the object is ready now. */
-  object_notify_entry *notify_entry;
-  HASH_FIND(handle, s->objects_notify, &object_id, sizeof(object_id),
-            notify_entry);
-  if (!notify_entry) {
-    *conns = NULL;
+/* Abort an object that the client created but has not sealed. Its memory is
+ * freed once the readers that got it before it was sealed have released it,
+ * and they see that it was aborted in its header. Get requests that wait for
+ * the object are answered with PLASMA_OBJECT_ABORTED. */
+void abort_object(client *client_context, object_id object_id) {
+  plasma_store_state *s = client_context->plasma_state;
+  object_reference *ref =
+      id_table_find(&client_context->references, object_id);
+  if (ref == NULL || !ref->creating) {
+    LOG_DEBUG("aborted an object that the client is not creating");
     return;
   }
-  result->handle.store_fd = entry->fd;
-  result->handle.mmap_size = entry->map_size;
-  result->data_offset = entry->offset;
-  result->metadata_offset = entry->offset + entry->info.data_size;
-  result->data_size = entry->info.data_size;
-  result->metadata_size = entry->info.metadata_size;
-  HASH_DELETE(handle, s->objects_notify, notify_entry);
-  *conns = notify_entry->conns;
-  free(notify_entry);
+  object_table_entry *entry = ref->entry;
+  object_shard *shard = get_shard(s, object_id);
+  pthread_mutex_lock(&shard->lock);
+  if (entry->state != OBJECT_OPEN) {
+    /* Another client sealed the object. */
+    pthread_mutex_unlock(&shard->lock);
+    finish_creating(client_context, object_id);
+    return;
+  }
+  LOG_DEBUG("aborting object");
+  id_table_remove(&shard->open_objects, object_id);
+  entry->state = OBJECT_DELETED;
+  plasma_object_header *header = (plasma_object_header *) entry->pointer;
+  __atomic_store_n(&header->aborted, 1, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&s->memory_lock);
+  DL_APPEND(s->deleted_list, entry);
+  pthread_mutex_unlock(&s->memory_lock);
+  UT_array *workers = take_object_waiters(shard, object_id);
+  pthread_mutex_unlock(&shard->lock);
+  /* The creator cannot use the object anymore, no matter how often it got
+   * it. */
+  remove_object_reference(client_context, ref);
+  if (workers) {
+    wake_object_waiters(client_context, object_id, workers, 1);
+    utarray_free(workers);
+  }
 }
 
 /* Delete an object that has been created in the hash table. */
 void delete_object(plasma_store_state *s, object_id object_id) {
   LOG_DEBUG("deleting object");  // TODO(rkn): add object_id here
-  object_table_entry *entry;
-  HASH_FIND(handle, s->sealed_objects, &object_id, sizeof(object_id), entry);
+  object_shard *shard = get_shard(s, object_id);
+  pthread_mutex_lock(&shard->lock);
+  object_table_entry *entry = id_table_find(&shard->sealed_objects, object_id);
   /* TODO(rkn): This should probably not fail, but should instead throw an
    * error. Maybe we should also support deleting objects that have been created
    * but not sealed. */
   CHECKM(entry != NULL, "To delete an object it must have been sealed.");
-  uint8_t *pointer = entry->pointer;
-  HASH_DELETE(handle, s->sealed_objects, entry);
-  dlfree(pointer);
-  free(entry);
+  id_table_remove(&shard->sealed_objects, object_id);
+  push_notification(s, entry, PLASMA_NOTIFICATION_DELETED);
+  if (entry->ref_count > 0) {
+    /* Clients still use the object, so only free it once they release it. */
+    entry->state = OBJECT_DELETED;
+    pthread_mutex_lock(&s->memory_lock);
+    DL_APPEND(s->deleted_list, entry);
+    pthread_mutex_unlock(&s->memory_lock);
+  } else {
+    pthread_mutex_lock(&s->memory_lock);
+    if (entry->pointer != NULL) {
+      DL_DELETE(s->lru_list, entry);
+    }
+    free_object(s, entry);
+    pthread_mutex_unlock(&s->memory_lock);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Create a sealed object that uses the memory of objects with the same
+ * contents. */
+int alias_object(client *client_context,
+                 object_id object_id,
+                 uint64_t digest,
+                 int64_t data_size,
+                 int64_t metadata_size) {
+  plasma_store_state *s = client_context->plasma_state;
+  object_shard *shard = get_shard(s, object_id);
+  pthread_mutex_lock(&shard->lock);
+  if (id_table_find(&shard->open_objects, object_id) != NULL ||
+      id_table_find(&shard->sealed_objects, object_id) != NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    return PLASMA_OBJECT_EXISTS;
+  }
+  pthread_mutex_lock(&s->memory_lock);
+  pthread_mutex_lock(&s->content_lock);
+  object_content *content;
+  HASH_FIND(hh, s->contents, &digest, sizeof(uint64_t), content);
+  if (content == NULL || content->data_size != data_size ||
+      content->metadata_size != metadata_size) {
+    pthread_mutex_unlock(&s->content_lock);
+    pthread_mutex_unlock(&s->memory_lock);
+    pthread_mutex_unlock(&shard->lock);
+    return PLASMA_CONTENT_NOT_FOUND;
+  }
+  content->num_users += 1;
+  pthread_mutex_unlock(&s->content_lock);
+  LOG_DEBUG("aliasing object of size %" PRId64, data_size);
+  object_table_entry *entry = item_pool_alloc(&s->entry_pool);
+  memset(entry, 0, sizeof(object_table_entry));
+  entry->object_id = object_id;
+  entry->info.data_size = data_size;
+  entry->info.metadata_size = metadata_size;
+  entry->info.digest = digest;
+  entry->content = content;
+  entry->pointer = content->pointer;
+  entry->fd = content->fd;
+  entry->map_size = content->map_size;
+  entry->offset = content->offset;
+  entry->last_access = current_time_us();
+  entry->state = OBJECT_SEALED;
+  DL_APPEND(s->lru_list, entry);
+  pthread_mutex_unlock(&s->memory_lock);
+  id_table_insert(&shard->sealed_objects, entry);
+  UT_array *workers = take_object_waiters(shard, object_id);
+  push_notification(s, entry, PLASMA_NOTIFICATION_SEALED);
+  pthread_mutex_unlock(&shard->lock);
+  if (workers) {
+    wake_object_waiters(client_context, object_id, workers, 0);
+    utarray_free(workers);
+  }
+  return PLASMA_OK;
+}
+
+/* Write as many of the queued notifications to the socket of a subscriber as
+ * fit into its send buffer with a single system call. If some are left, the
+ * event loop calls send_notifications again once there is room. */
+void send_queued_notifications(notification_queue *queue) {
+  int64_t size = utarray_len(queue->notifications) *
+                     sizeof(plasma_notification) -
+                 queue->bytes_sent;
+  if (size > 0) {
+    uint8_t *start = (uint8_t *) utarray_front(queue->notifications);
+    ssize_t nbytes =
+        send(queue->subscriber_fd, start + queue->bytes_sent, size, 0);
+    if (nbytes > 0) {
+      int64_t bytes_sent = queue->bytes_sent + nbytes;
+      utarray_erase(queue->notifications, 0,
+                    bytes_sent / sizeof(plasma_notification));
+      queue->bytes_sent = bytes_sent % sizeof(plasma_notification);
+    } else if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      LOG_DEBUG(
+          "The socket's send buffer is full, so we are caching the "
+          "notifications and will send them later.");
+    } else if (!(nbytes == -1 && errno == EINTR)) {
+      CHECKM(0, "This code should be unreachable.");
+    }
+  }
+  int pending = utarray_len(queue->notifications) > 0;
+  if (pending && !queue->waiting_for_room) {
+    event_loop_add_file(queue->worker->loop, queue->subscriber_fd,
+                        EVENT_LOOP_WRITE, send_notifications,
+                        queue->worker->plasma_state);
+    queue->waiting_for_room = 1;
+  } else if (!pending && queue->waiting_for_room) {
+    event_loop_remove_file(queue->worker->loop, queue->subscriber_fd);
+    queue->waiting_for_room = 0;
+  }
+}
+
+/* Push as many of the queued notifications onto the ring of a subscriber as
+ * fit, and wake up the subscriber if it may be sleeping. */
+void push_queued_notifications(notification_queue *queue) {
+  plasma_notification_ring *ring = queue->ring;
+  int wake_up = 0;
+  int64_t num_pushed = 0;
+  for (plasma_ring_notification *notification =
+           (plasma_ring_notification *) utarray_front(queue->notifications);
+       notification != NULL;
+       notification = (plasma_ring_notification *) utarray_next(
+           queue->notifications, notification)) {
+    int status = ring_push(&ring->notifications, notification->type,
+                           sizeof(plasma_ring_notification),
+                           (uint8_t *) notification);
+    if (status == -1) {
+      /* Ask the subscriber to tell us when there is room again. It may have
+       * made room before it saw the flag, so try once more. */
+      __atomic_store_n(&ring->store_waiting, 1, __ATOMIC_SEQ_CST);
+      status = ring_push(&ring->notifications, notification->type,
+                         sizeof(plasma_ring_notification),
+                         (uint8_t *) notification);
+      if (status == -1) {
+        break;
+      }
+    }
+    wake_up |= (status == 1);
+    num_pushed += 1;
+  }
+  utarray_erase(queue->notifications, 0, num_pushed);
+  if (wake_up) {
+    /* If the socket buffer is full, the subscriber has enough wakeups. */
+    char wakeup = 0;
+    if (send(queue->subscriber_fd, &wakeup, 1, 0) < 0 && errno != EAGAIN &&
+        errno != EWOULDBLOCK) {
+      LOG_DEBUG("could not wake up the subscriber on fd %d",
+                queue->subscriber_fd);
+    }
+  }
+}
+
+/* Send the queued notifications of a subscriber. This must run on the thread
+ * of the subscriber's worker. */
+void flush_notifications(plasma_store_state *s, int subscriber_fd) {
+  pthread_mutex_lock(&s->notifications_lock);
+  notification_queue *queue;
+  HASH_FIND_INT(s->pending_notifications, &subscriber_fd, queue);
+  if (queue != NULL) {
+    queue->flush_posted = 0;
+    if (queue->ring != NULL) {
+      push_queued_notifications(queue);
+    } else {
+      send_queued_notifications(queue);
+    }
+  }
+  pthread_mutex_unlock(&s->notifications_lock);
 }
 
-/* Send more notifications to a subscriber. */
 void send_notifications(event_loop *loop,
                         int client_sock,
                         void *context,
                         int events) {
-  plasma_store_state *s = context;
+  flush_notifications(context, client_sock);
+}
 
+/* Handle the bytes that a ring subscriber writes to its socket after making
+ * room in a full ring. If the subscriber closed the socket, it is dropped. */
+void process_ring_subscriber(event_loop *loop,
+                             int subscriber_fd,
+                             void *context,
+                             int events) {
+  plasma_store_state *s = context;
+  char buffer[64];
+  ssize_t nbytes = recv(subscriber_fd, buffer, sizeof(buffer), 0);
+  if (nbytes > 0 || (nbytes == -1 && (errno == EAGAIN || errno == EINTR))) {
+    flush_notifications(s, subscriber_fd);
+    return;
+  }
+  LOG_DEBUG("dropping the notification ring of fd %d", subscriber_fd);
+  pthread_mutex_lock(&s->notifications_lock);
   notification_queue *queue;
-  HASH_FIND_INT(s->pending_notifications, &client_sock, queue);
-  CHECK(queue != NULL);
-
-  int num_processed = 0;
-  /* Loop over the array of pending notifications and send as many of them as
-   * possible. */
-  for (object_id *obj_id = (object_id *) utarray_front(queue->object_ids);
-       obj_id != NULL;
-       obj_id = (object_id *) utarray_next(queue->object_ids, obj_id)) {
-    /* Attempt to send a notification about this object ID. */
-    int nbytes = send(client_sock, obj_id, sizeof(object_id), 0);
-    if (nbytes >= 0) {
-      CHECK(nbytes == sizeof(object_id));
-    } else if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-      LOG_DEBUG(
-          "The socket's send buffer is full, so we are caching this "
-          "notification and will send it later.");
-      break;
-    } else {
-      CHECKM(0, "This code should be unreachable.");
+  HASH_FIND_INT(s->pending_notifications, &subscriber_fd, queue);
+  HASH_DEL(s->pending_notifications, queue);
+  pthread_mutex_unlock(&s->notifications_lock);
+  event_loop_remove_file(loop, subscriber_fd);
+  close(subscriber_fd);
+  munmap(queue->ring, sizeof(plasma_notification_ring));
+  utarray_free(queue->notifications);
+  free(queue);
+}
+
+/* Register a subscriber whose notifications go to subscriber_fd, or to a
+ * ring if ring is not NULL. If the filter asks for it, the sealed objects that
+ * already exist are queued first, one shard at a time. */
+void add_subscriber(client *client_context,
+                    int subscriber_fd,
+                    plasma_notification_ring *ring,
+                    plasma_subscription_filter *filter) {
+  plasma_store_state *s = client_context->plasma_state;
+  /* Create a new array to buffer notifications until the worker sends them.
+   * TODO(rkn): the queue of a socket subscriber never gets freed. */
+  notification_queue *queue =
+      (notification_queue *) malloc(sizeof(notification_queue));
+  queue->subscriber_fd = subscriber_fd;
+  queue->worker = client_context->worker;
+  utarray_new(queue->notifications,
+              ring != NULL ? &ring_notification_icd : &notification_icd);
+  queue->bytes_sent = 0;
+  queue->flush_posted = 0;
+  queue->waiting_for_room = 0;
+  queue->ring = ring;
+  memset(&queue->filter, 0, sizeof(queue->filter));
+  if (filter != NULL) {
+    CHECK(filter->id_prefix_size >= 0 &&
+          filter->id_prefix_size <= (int64_t) sizeof(object_id));
+    CHECK(filter->metadata_tag_size >= 0 &&
+          filter->metadata_tag_size <= PLASMA_MAX_METADATA_TAG_SIZE);
+    queue->filter = *filter;
+  }
+  int include_existing = queue->filter.include_existing;
+  queue->num_shards_listed = include_existing ? 0 : NUM_SHARDS;
+  pthread_mutex_lock(&s->notifications_lock);
+  HASH_ADD_INT(s->pending_notifications, subscriber_fd, queue);
+  pthread_mutex_unlock(&s->notifications_lock);
+  if (!include_existing) {
+    return;
+  }
+  for (int i = 0; i < NUM_SHARDS; ++i) {
+    object_shard *shard = &s->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    pthread_mutex_lock(&s->notifications_lock);
+    int64_t index = 0;
+    object_table_entry *entry;
+    while ((entry = id_table_next(&shard->sealed_objects, &index)) != NULL) {
+      queue_notification_locked(queue, entry, PLASMA_NOTIFICATION_SEALED);
     }
-    num_processed += 1;
+    queue->num_shards_listed = i + 1;
+    pthread_mutex_unlock(&s->notifications_lock);
+    pthread_mutex_unlock(&shard->lock);
   }
-  /* Remove the sent notifications from the array. */
-  utarray_erase(queue->object_ids, 0, num_processed);
 }
 
 /* Subscribe to notifications about sealed objects. */
-void subscribe_to_updates(plasma_store_state *s, int conn) {
+void subscribe_to_updates(client *client_context,
+                          plasma_subscription_filter *filter) {
   LOG_DEBUG("subscribing to updates");
   char dummy;
-  int fd = recv_fd(conn, &dummy, 1);
-  CHECKM(HASH_CNT(handle, s->open_objects) == 0,
-         "plasma_subscribe should be called before any objects are created.");
-  CHECKM(HASH_CNT(handle, s->sealed_objects) == 0,
-         "plasma_subscribe should be called before any objects are created.");
-  /* Create a new array to buffer notifications that can't be sent to the
-   * subscriber yet because the socket send buffer is full. TODO(rkn): the queue
-   * never gets freed. */
-  notification_queue *queue =
-      (notification_queue *) malloc(sizeof(notification_queue));
-  queue->subscriber_fd = fd;
-  utarray_new(queue->object_ids, &object_id_icd);
-  HASH_ADD_INT(s->pending_notifications, subscriber_fd, queue);
-  /* Add a callback to the event loop to send queued notifications whenever
-   * there is room in the socket's send buffer. */
-  event_loop_add_file(s->loop, fd, EVENT_LOOP_WRITE, send_notifications, s);
+  int fd = recv_fd(client_context->sock, &dummy, 1);
+  add_subscriber(client_context, fd, NULL, filter);
 }
 
-void process_message(event_loop *loop,
-                     int client_sock,
+/* Subscribe to notifications through a ring in shared memory. The reply says
+ * if the ring could be created and is followed by its file descriptor. */
+void subscribe_to_ring(client *client_context,
+                       plasma_subscription_filter *filter) {
+  LOG_DEBUG("subscribing to updates through a ring");
+  char dummy;
+  int fd = recv_fd(client_context->sock, &dummy, 1);
+  plasma_reply reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.error_code = PLASMA_CHANNEL_UNAVAILABLE;
+  plasma_notification_ring *ring = MAP_FAILED;
+  int shm_fd = create_buffer(sizeof(plasma_notification_ring));
+  if (shm_fd >= 0) {
+    ring = mmap(NULL, sizeof(plasma_notification_ring),
+                PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  }
+  if (ring != MAP_FAILED) {
+    ring_init(&ring->notifications);
+    ring->store_waiting = 0;
+    reply.error_code = PLASMA_OK;
+    reply.num_fds = 1;
+  } else {
+    LOG_ERR("could not set up the notification ring for client on fd %d",
+            client_context->sock);
+  }
+  plasma_send_reply(client_context->sock, &reply);
+  if (reply.error_code != PLASMA_OK) {
+    close(fd);
+    if (shm_fd >= 0) {
+      close(shm_fd);
+    }
+    return;
+  }
+  send_fd(client_context->sock, shm_fd, (char *) &shm_fd, sizeof(int));
+  /* The mapping stays valid after the file descriptor is closed. */
+  close(shm_fd);
+  add_subscriber(client_context, fd, ring, filter);
+  event_loop_add_file(client_context->worker->loop, fd, EVENT_LOOP_READ,
+                      process_ring_subscriber, client_context->plasma_state);
+}
+
+/* Clean up after a client that disconnected. The references it holds are
+ * released and it stops waiting for objects. */
+void disconnect_client(client *client_context) {
+  plasma_store_state *s = client_context->plasma_state;
+  LOG_DEBUG("Disconnecting client on fd %d", client_context->sock);
+  event_loop_remove_file(client_context->worker->loop, client_context->sock);
+  close(client_context->sock);
+  /* Requests that the client pushed onto its channel before it disconnected
+   * still have to take effect. */
+  if (client_context->channel != NULL) {
+    drain_channel(client_context, 1);
+  }
+  /* Stop waiting for objects on behalf of the client. */
+  get_request *get_req, *temp_get_req;
+  DL_FOREACH_SAFE(client_context->pending_gets, get_req, temp_get_req) {
+    /* Mark all objects as unavailable so they are all unregistered. */
+    for (int64_t i = 0; i < get_req->num_object_ids; ++i) {
+      get_req->objects[i].handle.store_fd = -1;
+    }
+    discard_get_request(s, get_req);
+  }
+  /* Abort the objects the client did not get to seal and release all the
+   * objects the client still uses. */
+  int64_t index = 0;
+  object_reference *ref;
+  while ((ref = id_table_next(&client_context->references, &index)) != NULL) {
+    if (ref->creating) {
+      abort_object(client_context, ref->object_id);
+    } else {
+      remove_object_reference(client_context, ref);
+    }
+    /* The removal may have moved another reference into this slot. */
+    index -= 1;
+  }
+  id_table_free(&client_context->references);
+  if (client_context->channel != NULL) {
+    close_channel(client_context);
+  }
+  utarray_free(client_context->sent_fds);
+  free(client_context->receive_buffer);
+  free(client_context);
+}
+
+
+/* Send the reply to a create or contains request. Requests that came through
+ * the client's channel are answered through the channel. */
+void send_channel_reply(client *client_context,
+                        int from_channel,
+                        plasma_reply *reply) {
+  if (from_channel) {
+    /* The client waits for each reply, so the replies ring cannot be full. */
+    CHECK(ring_push(&client_context->channel->replies, 0, sizeof(plasma_reply),
+                    (uint8_t *) reply) != -1);
+  } else {
+    plasma_send_reply(client_context->sock, reply);
+  }
+}
+
+/* Process the requests that the client pushed onto its channel. If the client
+ * is disconnecting, requests that would be answered are dropped. */
+void drain_channel(client *client_context, int disconnecting) {
+  plasma_channel *channel = client_context->channel;
+  ring_message *message;
+  while ((message = ring_front(&channel->requests)) != NULL) {
+    /* Copy the request out of the shared memory, so the client cannot change
+     * it while it is being processed. */
+    int64_t type = message->type;
+    union {
+      plasma_request req;
+      uint8_t bytes[RING_MESSAGE_SIZE];
+    } buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    memcpy(buffer.bytes, message->data, sizeof(plasma_request));
+    ring_pop(&channel->requests);
+    if (!plasma_channel_message(type)) {
+      LOG_ERR("ignoring request of type %" PRId64 " from the channel", type);
+      continue;
+    }
+    if (disconnecting && (type == PLASMA_CREATE || type == PLASMA_CONTAINS)) {
+      continue;
+    }
+    process_request(client_context, type, sizeof(plasma_request), &buffer.req,
+                    1);
+  }
+  /* Wake up the client if it waits for a reply or for the ring to drain. */
+  if (__atomic_load_n(&channel->client_waiting, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    if (write(client_context->client_eventfd, &one, sizeof(one)) < 0) {
+      LOG_ERR("could not wake up client on fd %d", client_context->sock);
+    }
+  }
+}
+
+/* Called when the client pushed requests onto an empty requests ring. */
+void process_channel(event_loop *loop,
+                     int store_eventfd,
                      void *context,
                      int events) {
-  plasma_store_state *s = context;
-  int64_t type;
-  int64_t length;
-  plasma_request *req;
-  read_message(client_sock, &type, &length, (uint8_t **) &req);
+  client *client_context = context;
+  /* Reset the eventfd. All requests are processed below, no matter how many
+   * wakeups the counter adds up. */
+  uint64_t count;
+  if (read(store_eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG_ERR("could not read eventfd of client on fd %d", client_context->sock);
+  }
+  drain_channel(client_context, 0);
+}
+
+/* Set up a shared memory channel for the client. The reply is followed by the
+ * file descriptors of the shared memory, the store's eventfd and the client's
+ * eventfd, which the client needs to use the channel. */
+void open_channel(client *client_context) {
+  plasma_reply reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.error_code = PLASMA_CHANNEL_UNAVAILABLE;
+  int shm_fd = -1;
+#ifdef __linux__
+  if (client_context->channel == NULL) {
+    shm_fd = create_buffer(sizeof(plasma_channel));
+  }
+  if (shm_fd >= 0) {
+    void *pointer = mmap(NULL, sizeof(plasma_channel), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, shm_fd, 0);
+    int store_eventfd = eventfd(0, EFD_NONBLOCK);
+    int client_eventfd = eventfd(0, 0);
+    if (pointer != MAP_FAILED && store_eventfd >= 0 && client_eventfd >= 0) {
+      client_context->channel = pointer;
+      ring_init(&client_context->channel->requests);
+      ring_init(&client_context->channel->replies);
+      client_context->channel->client_waiting = 0;
+      client_context->store_eventfd = store_eventfd;
+      client_context->client_eventfd = client_eventfd;
+      reply.error_code = PLASMA_OK;
+      reply.num_fds = 3;
+    } else {
+      LOG_ERR("could not set up the channel for client on fd %d",
+              client_context->sock);
+      if (pointer != MAP_FAILED) {
+        munmap(pointer, sizeof(plasma_channel));
+      }
+      if (store_eventfd >= 0) {
+        close(store_eventfd);
+      }
+      if (client_eventfd >= 0) {
+        close(client_eventfd);
+      }
+    }
+  }
+#endif
+  plasma_send_reply(client_context->sock, &reply);
+  if (reply.error_code == PLASMA_OK) {
+    int fds[3] = {shm_fd, client_context->store_eventfd,
+                  client_context->client_eventfd};
+    for (int i = 0; i < 3; ++i) {
+      send_fd(client_context->sock, fds[i], (char *) &fds[i], sizeof(int));
+    }
+    event_loop_add_file(client_context->worker->loop,
+                        client_context->store_eventfd,
+                        EVENT_LOOP_READ, process_channel, client_context);
+  }
+  if (shm_fd >= 0) {
+    /* The mapping stays valid after the file descriptor is closed. */
+    close(shm_fd);
+  }
+}
+
+void close_channel(client *client_context) {
+  event_loop_remove_file(client_context->worker->loop,
+                         client_context->store_eventfd);
+  close(client_context->store_eventfd);
+  close(client_context->client_eventfd);
+  munmap(client_context->channel, sizeof(plasma_channel));
+  client_context->channel = NULL;
+}
+
+void process_request(client *client_context,
+                     int64_t type,
+                     int64_t length,
+                     plasma_request *req,
+                     int from_channel) {
+  plasma_store_state *s = client_context->plasma_state;
+  int client_sock = client_context->sock;
   plasma_reply reply;
   memset(&reply, 0, sizeof(reply));
-  UT_array *conns;
 
   switch (type) {
   case PLASMA_CREATE:
-    create_object(s, req->object_id, req->data_size, req->metadata_size,
-                  &reply.object);
-    send_fd(client_sock, reply.object.handle.store_fd, (char *) &reply,
-            sizeof(reply));
-    break;
-  case PLASMA_GET:
-    if (get_object(s, client_sock, req->object_id, &reply.object) ==
-        OBJECT_FOUND) {
-      send_fd(client_sock, reply.object.handle.store_fd, (char *) &reply,
-              sizeof(reply));
+    reply.error_code =
+        create_object(client_context, req->object_id, req->data_size,
+                      req->metadata_size, &reply.object);
+    /* The segment's file descriptor is only sent if the client does not have
+     * it yet. If the object could not be created, no file descriptor is
+     * sent. */
+    if (reply.error_code == PLASMA_OK &&
+        client_needs_fd(client_context, reply.object.handle.store_fd)) {
+      reply.num_fds = 1;
+    }
+    send_channel_reply(client_context, from_channel, &reply);
+    if (reply.num_fds > 0) {
+      send_fd(client_sock, reply.object.handle.store_fd,
+              (char *) &reply.object.handle.store_fd, sizeof(int));
     }
     break;
+  case PLASMA_GET: {
+    CHECK(length >= plasma_request_size(0));
+    CHECK(req->num_object_ids > 0);
+    CHECK(length == plasma_request_size(req->num_object_ids));
+    int64_t num_ready = req->num_ready;
+    if (num_ready <= 0 || num_ready > req->num_object_ids) {
+      num_ready = req->num_object_ids;
+    }
+    process_get_request(client_context, req->num_object_ids, req->object_ids,
+                        num_ready, req->timeout_ms, req->include_unsealed);
+  } break;
   case PLASMA_CONTAINS:
     if (contains_object(s, req->object_id) == OBJECT_FOUND) {
       reply.has_object = 1;
     }
-    plasma_send_reply(client_sock, &reply);
+    send_channel_reply(client_context, from_channel, &reply);
     break;
   case PLASMA_SEAL:
-    seal_object(s, req->object_id, &conns, &reply.object);
-    if (conns) {
-      for (int *c = (int *) utarray_front(conns); c != NULL;
-           c = (int *) utarray_next(conns, c)) {
-        send_fd(*c, reply.object.handle.store_fd, (char *) &reply,
-                sizeof(reply));
-      }
-      utarray_free(conns);
-    }
+    seal_object(client_context, req->object_id);
+    break;
+  case PLASMA_RELEASE:
+    release_object(client_context, req->object_id);
     break;
   case PLASMA_DELETE:
     delete_object(s, req->object_id);
     break;
+  case PLASMA_ABORT:
+    abort_object(client_context, req->object_id);
+    break;
+  case PLASMA_ALIAS:
+    reply.error_code =
+        alias_object(client_context, req->object_id, req->digest,
+                     req->data_size, req->metadata_size);
+    plasma_send_reply(client_sock, &reply);
+    break;
   case PLASMA_SUBSCRIBE:
-    subscribe_to_updates(s, client_sock);
+  case PLASMA_SUBSCRIBE_RING: {
+    plasma_subscription_filter *filter = NULL;
+    if (length == sizeof(plasma_request) + sizeof(*filter)) {
+      filter = plasma_subscription_request_filter(req);
+    } else {
+      CHECK(length == sizeof(plasma_request));
+    }
+    if (type == PLASMA_SUBSCRIBE) {
+      subscribe_to_updates(client_context, filter);
+    } else {
+      subscribe_to_ring(client_context, filter);
+    }
+  } break;
+  case PLASMA_OPEN_CHANNEL:
+    open_channel(client_context);
     break;
-  case DISCONNECT_CLIENT: {
-    LOG_DEBUG("Disconnecting client on fd %d", client_sock);
-    event_loop_remove_file(loop, client_sock);
+  case PLASMA_ALLOCATOR_STATS: {
+    plasma_allocator_stats stats;
+    pthread_mutex_lock(&s->memory_lock);
+    plasma_malloc_stats(&stats);
+    pthread_mutex_unlock(&s->memory_lock);
+    plasma_write_bytes(client_sock, (uint8_t *) &stats, sizeof(stats));
   } break;
+  case DISCONNECT_CLIENT:
+    disconnect_client(client_context);
+    break;
   default:
     /* This code should be unreachable. */
     CHECK(0);
   }
+}
+
+/* Read exactly length bytes from the socket. Return 0 on success and -1 if
+ * the connection was closed or broken. */
+int read_request_bytes(int fd, uint8_t *cursor, int64_t length) {
+  while (length > 0) {
+    ssize_t nbytes = read(fd, cursor, length);
+    if (nbytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nbytes <= 0) {
+      return -1;
+    }
+    cursor += nbytes;
+    length -= nbytes;
+  }
+  return 0;
+}
+
+/* Read a message written by write_message into the receive buffer of the
+ * client, which grows if the message does not fit. This replaces
+ * read_message, which allocates a new buffer for every message. If the
+ * client went away, the type is DISCONNECT_CLIENT. */
+void read_request(client *client_context, int64_t *type, int64_t *length) {
+  int fd = client_context->sock;
+  if (read_request_bytes(fd, (uint8_t *) type, sizeof(int64_t)) != 0 ||
+      read_request_bytes(fd, (uint8_t *) length, sizeof(int64_t)) != 0 ||
+      *length < 0) {
+    *type = DISCONNECT_CLIENT;
+    *length = 0;
+    return;
+  }
+  if (*length > client_context->receive_buffer_size) {
+    /* Requests are usually small, so this rarely happens more than once. */
+    int64_t size = *length > 2 * client_context->receive_buffer_size
+                       ? *length
+                       : 2 * client_context->receive_buffer_size;
+    client_context->receive_buffer =
+        realloc(client_context->receive_buffer, size);
+    CHECK(client_context->receive_buffer != NULL);
+    client_context->receive_buffer_size = size;
+  }
+  if (read_request_bytes(fd, client_context->receive_buffer, *length) != 0) {
+    *type = DISCONNECT_CLIENT;
+    *length = 0;
+  }
+}
+
+void process_message(event_loop *loop,
+                     int client_sock,
+                     void *context,
+                     int events) {
+  client *client_context = context;
+  int64_t type;
+  int64_t length;
+  read_request(client_context, &type, &length);
+  process_request(client_context, type, length,
+                  (plasma_request *) client_context->receive_buffer, 0);
+}
+
+/* Start serving a client connection on the worker's event loop. This runs on
+ * the worker's own thread. */
+void add_client(worker *w, int client_sock) {
+  client *client_context = malloc(sizeof(client));
+  client_context->sock = client_sock;
+  client_context->plasma_state = w->plasma_state;
+  client_context->worker = w;
+  id_table_init(&client_context->references,
+                offsetof(object_reference, object_id));
+  client_context->pending_gets = NULL;
+  utarray_new(client_context->sent_fds, &ut_int_icd);
+  client_context->channel = NULL;
+  client_context->store_eventfd = -1;
+  client_context->client_eventfd = -1;
+  client_context->receive_buffer_size = sizeof(plasma_request);
+  client_context->receive_buffer = malloc(client_context->receive_buffer_size);
+  event_loop_add_file(w->loop, client_sock, EVENT_LOOP_READ, process_message,
+                      client_context);
+  LOG_DEBUG("new connection with fd %d", client_sock);
+}
 
-  free(req);
+void process_worker_tasks(event_loop *loop,
+                          int tasks_fd,
+                          void *context,
+                          int events) {
+  worker *w = context;
+  /* Empty the pipe before taking the tasks, so that tasks posted after this
+   * point wake up the loop again. */
+  char buffer[64];
+  while (read(tasks_fd, buffer, sizeof(buffer)) > 0) {
+  }
+  pthread_mutex_lock(&w->tasks_lock);
+  worker_task *tasks = w->tasks;
+  w->tasks = NULL;
+  pthread_mutex_unlock(&w->tasks_lock);
+  worker_task *task, *temp_task;
+  DL_FOREACH_SAFE(tasks, task, temp_task) {
+    DL_DELETE(tasks, task);
+    switch (task->type) {
+    case WORKER_TASK_NEW_CLIENT:
+      add_client(w, task->client_sock);
+      break;
+    case WORKER_TASK_OBJECT_SEALED:
+      object_sealed(w, task->object_id);
+      break;
+    case WORKER_TASK_OBJECT_ABORTED:
+      object_aborted(w, task->object_id);
+      break;
+    case WORKER_TASK_FLUSH_NOTIFICATIONS:
+      flush_notifications(w->plasma_state, task->client_sock);
+      break;
+    default:
+      CHECK(0);
+    }
+    free(task);
+  }
 }
 
+/* Accept a new connection and hand it to the workers in turn. */
 void new_client_connection(event_loop *loop,
                            int listener_sock,
                            void *context,
                            int events) {
+  plasma_store_state *s = context;
   int new_socket = accept_client(listener_sock);
-  event_loop_add_file(loop, new_socket, EVENT_LOOP_READ, process_message,
-                      context);
-  LOG_DEBUG("new connection with fd %d", new_socket);
+  worker *w = &s->workers[s->next_worker];
+  s->next_worker = (s->next_worker + 1) % s->num_workers;
+  if (w == &s->workers[0]) {
+    /* The first worker runs on this thread. */
+    add_client(w, new_socket);
+  } else {
+    worker_task task = {.type = WORKER_TASK_NEW_CLIENT,
+                        .client_sock = new_socket};
+    post_task(w, task);
+  }
+}
+
+void *run_worker(void *context) {
+  worker *w = context;
+  event_loop_run(w->loop);
+  return NULL;
+}
+
+/** Identifies the index files that save_snapshot writes. */
+#define SNAPSHOT_MAGIC INT64_C(0x504c41534d413032)
+
+/* The beginning of an index file. It is followed by the state of the
+ * allocator, padded to a multiple of 8 bytes, and by num_objects
+ * snapshot_records. The file is mapped and read in place on restart. */
+typedef struct {
+  /** This is SNAPSHOT_MAGIC. */
+  int64_t magic;
+  /** The size in bytes of the arena. */
+  int64_t arena_size;
+  /** The address that the arena was mapped at. The state of the allocator
+   *  points into the arena, so it can only be used at the same address. */
+  uint64_t arena_address;
+  /** The size in bytes of the state of the allocator. */
+  int64_t allocator_state_size;
+  /** The number of objects in the index. */
+  int64_t num_objects;
+} snapshot_header;
+
+/* A sealed object in an index file. */
+typedef struct {
+  /** The ID of the object. */
+  object_id object_id;
+  /** The sizes and other information about the object. */
+  plasma_object_info info;
+  /** The offset of the object's header in the arena, or -1 if the object is
+   *  only in the spill directory. */
+  int64_t offset;
+  /** Whether the object has a copy in the spill directory. */
+  int64_t spilled;
+} snapshot_record;
+
+/* Write the name of the index file of the arena into name, which must have
+ * room for PATH_MAX characters. */
+void snapshot_file_name(const char *arena_file, char *name) {
+  snprintf(name, PATH_MAX, "%s.index", arena_file);
+}
+
+/* The offset of the records in an index file. */
+int64_t snapshot_records_offset(int64_t allocator_state_size) {
+  return sizeof(snapshot_header) + (allocator_state_size + 7) / 8 * 8;
+}
+
+/* Fill out the record of a sealed object in an index file. */
+void entry_to_snapshot_record(object_table_entry *entry,
+                              snapshot_record *record) {
+  record->object_id = entry->object_id;
+  record->info = entry->info;
+  record->offset = -1;
+  if (entry->pointer != NULL) {
+    record->offset = entry->pointer - (uint8_t *) plasma_arena_base();
+  }
+  record->spilled = entry->spilled;
+}
+
+/* Write the index of the sealed objects and the state of the allocator next
+ * to the arena file, so that a restarted store can continue with the objects
+ * in the arena. This takes all locks and keeps them, because the store exits
+ * right after. Objects that are still being written are freed first, as are
+ * deleted objects whose clients are about to lose their connection, so that
+ * their memory is not leaked by the next store. */
+void save_snapshot(plasma_store_state *s) {
+  for (int i = 0; i < NUM_SHARDS; ++i) {
+    pthread_mutex_lock(&s->shards[i].lock);
+  }
+  pthread_mutex_lock(&s->memory_lock);
+  int64_t num_objects = 0;
+  for (int i = 0; i < NUM_SHARDS; ++i) {
+    id_table *open_objects = &s->shards[i].open_objects;
+    int64_t index = 0;
+    object_table_entry *entry;
+    while ((entry = id_table_next(open_objects, &index)) != NULL) {
+      free_object(s, entry);
+    }
+    id_table_free(open_objects);
+    num_objects += s->shards[i].sealed_objects.size;
+  }
+  object_table_entry *entry, *temp_entry;
+  DL_FOREACH_SAFE(s->deleted_list, entry, temp_entry) {
+    DL_DELETE(s->deleted_list, entry);
+    free_object(s, entry);
+  }
+
+  int64_t allocator_state_size = plasma_malloc_state_size();
+  int64_t records_offset = snapshot_records_offset(allocator_state_size);
+  int64_t size = records_offset + num_objects * sizeof(snapshot_record);
+  uint8_t *buffer = calloc(1, size);
+  snapshot_header *header = (snapshot_header *) buffer;
+  header->magic = SNAPSHOT_MAGIC;
+  header->arena_size = s->memory_capacity;
+  header->arena_address = (uintptr_t) plasma_arena_base();
+  header->allocator_state_size = allocator_state_size;
+  header->num_objects = num_objects;
+  plasma_malloc_save_state(buffer + sizeof(snapshot_header));
+  /* Write the evictable objects in least recently used order, so the order
+   * survives the restart, followed by the objects that were in use or only
+   * on disk. */
+  snapshot_record *record = (snapshot_record *) (buffer + records_offset);
+  DL_FOREACH(s->lru_list, entry) {
+    entry_to_snapshot_record(entry, record++);
+  }
+  for (int i = 0; i < NUM_SHARDS; ++i) {
+    int64_t index = 0;
+    while ((entry = id_table_next(&s->shards[i].sealed_objects, &index)) !=
+           NULL) {
+      if (entry->ref_count > 0 || entry->pointer == NULL) {
+        entry_to_snapshot_record(entry, record++);
+      }
+    }
+  }
+  CHECK((uint8_t *) record == buffer + size);
+
+  /* Write the index under a temporary name, so that a store that is killed
+   * in the middle never leaves a partial index behind. */
+  char name[PATH_MAX];
+  char temp_name[PATH_MAX + 4];
+  snapshot_file_name(s->arena_file, name);
+  snprintf(temp_name, sizeof(temp_name), "%s.tmp", name);
+  FILE *file = fopen(temp_name, "wb");
+  if (file == NULL || fwrite(buffer, size, 1, file) != 1 ||
+      fclose(file) != 0 || rename(temp_name, name) != 0) {
+    LOG_ERR("could not write the index of the arena to %s", name);
+  } else {
+    LOG_DEBUG("wrote the index of %" PRId64 " objects to %s", num_objects,
+              name);
+  }
+  free(buffer);
+}
+
+/* Map the index file of an arena file, if there is one that belongs to an
+ * arena of the given size. The index file is removed, because the arena is
+ * going to change and the index would no longer describe it after a crash.
+ * The result has to be unmapped with munmap_snapshot. */
+snapshot_header *mmap_snapshot(const char *arena_file, int64_t arena_size) {
+  char name[PATH_MAX];
+  snapshot_file_name(arena_file, name);
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  unlink(name);
+  off_t size = lseek(fd, 0, SEEK_END);
+  snapshot_header *header = NULL;
+  if (size >= (off_t) sizeof(snapshot_header)) {
+    header = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (header == NULL || header == MAP_FAILED) {
+    return NULL;
+  }
+  int64_t records_offset =
+      snapshot_records_offset(header->allocator_state_size);
+  if (header->magic != SNAPSHOT_MAGIC || header->arena_size != arena_size ||
+      header->allocator_state_size != plasma_malloc_state_size() ||
+      size != records_offset + header->num_objects * sizeof(snapshot_record)) {
+    LOG_ERR("ignoring the index %s, which does not match the arena", name);
+    munmap(header, size);
+    return NULL;
+  }
+  return header;
+}
+
+void munmap_snapshot(snapshot_header *header) {
+  munmap(header, snapshot_records_offset(header->allocator_state_size) +
+                     header->num_objects * sizeof(snapshot_record));
+}
+
+/* Continue with the objects of an index that save_snapshot wrote. The arena
+ * must have been mapped at the address it had back then. Objects that shared
+ * memory share it again. */
+void load_snapshot(plasma_store_state *s, snapshot_header *header) {
+  uint8_t *base = plasma_arena_base();
+  plasma_malloc_load_state((uint8_t *) header + sizeof(snapshot_header));
+  snapshot_record *records =
+      (snapshot_record *) ((uint8_t *) header +
+                           snapshot_records_offset(
+                               header->allocator_state_size));
+  for (int64_t i = 0; i < header->num_objects; ++i) {
+    snapshot_record *record = &records[i];
+    if (record->offset == -1 &&
+        (!record->spilled || s->spill_directory == NULL)) {
+      /* The object was only in a spill directory that we don't use. */
+      continue;
+    }
+    object_table_entry *entry = item_pool_alloc(&s->entry_pool);
+    memset(entry, 0, sizeof(object_table_entry));
+    entry->object_id = record->object_id;
+    entry->info = record->info;
+    entry->spilled = record->spilled && s->spill_directory != NULL;
+    entry->fd = -1;
+    entry->last_access = current_time_us();
+    entry->state = OBJECT_SEALED;
+    if (record->offset != -1) {
+      entry->pointer = base + record->offset;
+      ptrdiff_t offset;
+      get_malloc_mapinfo(entry->pointer, &entry->fd, &entry->map_size, &offset);
+      entry->offset = offset + sizeof(plasma_object_header);
+      object_content *content = NULL;
+      if (entry->info.digest != 0) {
+        HASH_FIND(hh, s->contents, &entry->info.digest, sizeof(uint64_t),
+                  content);
+      }
+      if (content != NULL && content->pointer == entry->pointer) {
+        content->num_users += 1;
+        entry->content = content;
+      } else if (content == NULL && entry->info.digest != 0) {
+        add_content_locked(s, entry);
+      }
+      if (entry->content == NULL || entry->content->num_users == 1) {
+        s->memory_used += object_memory_size(entry->info.data_size,
+                                             entry->info.metadata_size);
+      }
+      DL_APPEND(s->lru_list, entry);
+    }
+    id_table_insert(&get_shard(s, entry->object_id)->sealed_objects, entry);
+  }
+  LOG_INFO("restored %" PRId64 " objects from the arena",
+           header->num_objects);
+}
+
+/* The pipe that the signal handler uses to ask the main thread to write the
+ * index of the arena before the store exits, or -1 if there is no arena
+ * file. */
+int shutdown_pipe[2] = {-1, -1};
+
+void process_shutdown(event_loop *loop,
+                      int shutdown_fd,
+                      void *context,
+                      int events) {
+  save_snapshot(context);
+  exit(0);
 }
 
 /* Report "success" to valgrind. */
 void signal_handler(int signal) {
   if (signal == SIGTERM) {
+    char wakeup = 0;
+    if (shutdown_pipe[1] != -1 && write(shutdown_pipe[1], &wakeup, 1) == 1) {
+      return;
+    }
     exit(0);
   }
 }
 
-void start_server(char *socket_name) {
+void start_server(char *socket_name,
+                  int num_workers,
+                  int64_t memory_capacity,
+                  const char *spill_directory,
+                  const char *arena_file,
+                  snapshot_header *snapshot,
+                  int deduplicate) {
   int socket = bind_ipc_sock(socket_name);
   CHECK(socket >= 0);
-  event_loop *loop = event_loop_create();
-  plasma_store_state *state = init_plasma_store(loop);
-  event_loop_add_file(loop, socket, EVENT_LOOP_READ, new_client_connection,
-                      state);
-  event_loop_run(loop);
+  plasma_store_state *state =
+      init_plasma_store(num_workers, memory_capacity, spill_directory,
+                        arena_file, deduplicate);
+  if (snapshot != NULL) {
+    load_snapshot(state, snapshot);
+    munmap_snapshot(snapshot);
+  }
+  if (arena_file != NULL) {
+    /* Write the index in the main thread when the store is terminated. */
+    CHECK(pipe(shutdown_pipe) == 0);
+    event_loop_add_file(state->workers[0].loop, shutdown_pipe[0],
+                        EVENT_LOOP_READ, process_shutdown, state);
+  }
+  if (spill_directory != NULL && memory_capacity > 0) {
+    CHECK(pthread_create(&state->spill_thread, NULL, run_spill_thread,
+                         state) == 0);
+  }
+  event_loop_add_file(state->workers[0].loop, socket, EVENT_LOOP_READ,
+                      new_client_connection, state);
+  for (int i = 1; i < num_workers; ++i) {
+    CHECK(pthread_create(&state->workers[i].thread, NULL, run_worker,
+                         &state->workers[i]) == 0);
+  }
+  run_worker(&state->workers[0]);
 }
 
 int main(int argc, char *argv[]) {
   signal(SIGTERM, signal_handler);
   char *socket_name = NULL;
+  /* Directory for the memory mapped files, e.g. a hugetlbfs mount. */
+  char *directory = NULL;
+  /* Size in bytes of the arena to reserve up front, or 0 for none. This is
+   * also the capacity of the store; objects get evicted beyond it. */
+  int64_t arena_size = 0;
+  /* Whether to prefault the arena. */
+  int populate = 0;
+  /* The number of threads that serve clients. */
+  int num_workers = 1;
+  /* Directory that objects are spilled to once the arena is full. */
+  char *spill_directory = NULL;
+  /* File that keeps the arena and its objects across restarts. */
+  char *arena_file = NULL;
+  /* Objects up to this size, including their header, are allocated from
+   * slabs. */
+  int64_t small_object_threshold = DEFAULT_SMALL_OBJECT_THRESHOLD;
+  /* Whether objects with the same contents share memory. */
+  int deduplicate = 0;
   int c;
-  while ((c = getopt(argc, argv, "s:")) != -1) {
+  while ((c = getopt(argc, argv, "s:m:d:pt:x:f:z:u")) != -1) {
     switch (c) {
     case 's':
       socket_name = optarg;
       break;
+    case 'm':
+      arena_size = strtoll(optarg, NULL, 10);
+      break;
+    case 'd':
+      directory = optarg;
+      break;
+    case 'p':
+      populate = 1;
+      break;
+    case 't':
+      num_workers = atoi(optarg);
+      break;
+    case 'x':
+      spill_directory = optarg;
+      break;
+    case 'f':
+      arena_file = optarg;
+      break;
+    case 'z':
+      small_object_threshold = strtoll(optarg, NULL, 10);
+      break;
+    case 'u':
+      deduplicate = 1;
+      break;
     default:
       exit(-1);
     }
@@ -407,6 +2725,48 @@ int main(int argc, char *argv[]) {
     LOG_ERR("please specify socket for incoming connections with -s switch");
     exit(-1);
   }
+  if (arena_size < 0) {
+    LOG_ERR("the size passed with the -m switch must be positive");
+    exit(-1);
+  }
+  if (num_workers <= 0) {
+    LOG_ERR("the number of threads passed with the -t switch must be positive");
+    exit(-1);
+  }
+  if (small_object_threshold < 0) {
+    LOG_ERR("the size passed with the -z switch must not be negative");
+    exit(-1);
+  }
+  if (spill_directory != NULL && access(spill_directory, W_OK) != 0) {
+    LOG_ERR("the directory passed with the -x switch must be writable");
+    exit(-1);
+  }
+  if (spill_directory != NULL && arena_size == 0) {
+    LOG_INFO("objects are only spilled if a size is passed with -m");
+  }
+  if (arena_file != NULL && arena_size == 0) {
+    LOG_ERR("the -f switch needs the size of the arena passed with -m");
+    exit(-1);
+  }
+  /* Pick up the objects of the previous store on the same arena file. */
+  snapshot_header *snapshot = NULL;
+  void *arena_address = NULL;
+  if (arena_file != NULL) {
+    snapshot = mmap_snapshot(arena_file, arena_size);
+  }
+  if (snapshot != NULL) {
+    arena_address = (void *) (uintptr_t) snapshot->arena_address;
+  }
+  if (init_plasma_malloc(directory, arena_size, populate, arena_file,
+                         arena_address, small_object_threshold) != 0) {
+    exit(-1);
+  }
+  if (snapshot != NULL && plasma_arena_base() != arena_address) {
+    LOG_ERR("could not map the arena at its old address, starting empty");
+    munmap_snapshot(snapshot);
+    snapshot = NULL;
+  }
   LOG_DEBUG("starting server listening on %s", socket_name);
-  start_server(socket_name);
+  start_server(socket_name, num_workers, arena_size, spill_directory,
+               arena_file, snapshot, deduplicate);
 }
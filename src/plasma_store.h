@@ -5,47 +5,104 @@
 
 typedef struct plasma_store_state plasma_store_state;
 
+typedef struct client client;
+
 /**
- * Create a new object:
+ * Create a new object. The creating client holds a reference to the object
+ * until it releases it.
  *
- * @param s The plasma store state.
+ * @param client_context The context of the client making this request.
  * @param object_id Object ID of the object to be created.
  * @param data_size Size in bytes of the object to be created.
  * @param metadata_size Size in bytes of the object metadata.
- * @return Void.
+ * @return PLASMA_OK on success, PLASMA_OBJECT_EXISTS if an object with the
+ *         same ID has already been created, or PLASMA_OUT_OF_MEMORY if the
+ *         object does not fit into the store even after evicting all unused
+ *         sealed objects.
  */
-void create_object(plasma_store_state *s,
-                   object_id object_id,
-                   int64_t data_size,
-                   int64_t metadata_size,
-                   plasma_object *result);
+int create_object(client *client_context,
+                  object_id object_id,
+                  int64_t data_size,
+                  int64_t metadata_size,
+                  plasma_object *result);
 
 /**
- * Get an object:
+ * Get an object. If the object is found, the client holds a reference to it
+ * until it releases it.
  *
- * @param s The plasma store state.
- * @param conn The client connection that requests the object.
+ * @param client_context The context of the client making this request.
  * @param object_id Object ID of the object to be gotten.
+ * @param result The object that has been found.
  * @return The status of the object (object_status in plasma.h).
  */
-int get_object(plasma_store_state *s,
-               int conn,
+int get_object(client *client_context,
                object_id object_id,
                plasma_object *result);
 
 /**
- * Seal an object:
+ * Get several objects. The client is answered once num_ready of the objects
+ * are sealed or the timeout expires, whichever happens first. The client holds
+ * a reference to each object that is returned.
  *
- * @param s The plasma store state.
+ * @param client_context The context of the client making this request.
+ * @param num_object_ids The number of object IDs.
+ * @param object_ids Object IDs of the objects to be gotten.
+ * @param num_ready The number of objects that need to be available.
+ * @param timeout_ms The timeout in milliseconds. If this is -1, wait until
+ *        num_ready objects are available. If this is 0, answer right away.
+ * @param include_unsealed If this is 1, objects count as available as soon
+ *        as they have been created, and readers use the bytes_ready
+ *        watermark in the object header to wait for the data.
+ * @return Void.
+ */
+void process_get_request(client *client_context,
+                         int64_t num_object_ids,
+                         object_id object_ids[],
+                         int64_t num_ready,
+                         int64_t timeout_ms,
+                         int include_unsealed);
+
+/**
+ * Seal an object. Get requests that are waiting for it are answered once
+ * enough of their objects are available. Requests of clients that are served
+ * by other workers are handed to those workers.
+ *
+ * @param client_context The context of the client that seals the object.
  * @param object_id Object ID of the object to be sealed.
- * @param conns Returns the connection that are waiting for this object.
-                The caller is responsible for destroying this array.
  * @return Void.
  */
-void seal_object(plasma_store_state *s,
+void seal_object(client *client_context, object_id object_id);
+
+/**
+ * Create a sealed object that shares the memory of the objects in the store
+ * with the given contents, which the store only knows of if it computes
+ * digests. No memory is allocated and nothing is copied.
+ *
+ * @param client_context The context of the client making this request.
+ * @param object_id Object ID of the object to be created.
+ * @param digest The digest of the contents of the object.
+ * @param data_size Size in bytes of the object's data.
+ * @param metadata_size Size in bytes of the object's metadata.
+ * @return PLASMA_OK on success, PLASMA_OBJECT_EXISTS if an object with the
+ *         same ID has already been created, or PLASMA_CONTENT_NOT_FOUND if
+ *         no object with these contents has been released by all clients
+ *         since it was sealed.
+ */
+int alias_object(client *client_context,
                  object_id object_id,
-                 UT_array **conns,
-                 plasma_object *result);
+                 uint64_t digest,
+                 int64_t data_size,
+                 int64_t metadata_size);
+
+/**
+ * Release a reference that a client holds to an object. The object will not be
+ * evicted or freed while any client holds a reference to it.
+ *
+ * @param client_context The context of the client making this request.
+ * @param object_id Object ID of the object to be released.
+ * @return Void.
+ */
+void release_object(client *client_context, object_id object_id);
 
 /**
  * Check if the plasma store contains an object:
@@ -57,7 +114,8 @@ void seal_object(plasma_store_state *s,
 int contains_object(plasma_store_state *s, object_id object_id);
 
 /**
- * Delete an object from the plasma store:
+ * Delete an object from the plasma store. If clients still hold references to
+ * the object, its memory is freed once the last reference is released.
  *
  * @param s The plasma store state.
  * @param object_id Object ID of the object to be deleted.
@@ -66,9 +124,24 @@ int contains_object(plasma_store_state *s, object_id object_id);
 void delete_object(plasma_store_state *s, object_id object_id);
 
 /**
- * Send notifications about sealed objects to the subscribers. This is called
- * in seal_object. If the socket's send buffer is full, the notification will be
- * buffered, and this will be called again when the send buffer has room.
+ * Evict sealed objects from the plasma store in least recently used order.
+ * Subscribers are notified about every evicted object. Objects whose shard is
+ * locked by another thread at that moment are skipped. If the store has a
+ * spill directory, the objects are written to it instead and only their
+ * memory is freed. They are read back when they are gotten again.
+ *
+ * @param s The plasma store state.
+ * @param num_bytes The number of bytes that should be freed.
+ * @return The number of bytes that were actually freed.
+ */
+int64_t evict_objects(plasma_store_state *s, int64_t num_bytes);
+
+/**
+ * Send the notifications about sealed and evicted objects that are queued for
+ * a subscriber. seal_object and evict_objects only queue notifications, and
+ * the worker of the subscriber sends all that are queued in one go. If the
+ * socket's send buffer is full, the rest stay queued, and this will be called
+ * again when the send buffer has room.
  *
  * @param loop The Plasma store event loop.
  * @param client_sock The file descriptor to send the notification to.
@@ -82,4 +155,40 @@ void send_notifications(event_loop *loop,
                         void *context,
                         int events);
 
+/**
+ * Handle a request of a client.
+ *
+ * @param client_context The context of the client making this request.
+ * @param type The type of the request (see plasma_message_type).
+ * @param length The size in bytes of the request.
+ * @param req The request.
+ * @param from_channel If this is nonzero, the request came through the
+ *        client's shared memory channel and is answered through it.
+ * @return Void.
+ */
+void process_request(client *client_context,
+                     int64_t type,
+                     int64_t length,
+                     plasma_request *req,
+                     int from_channel);
+
+/**
+ * Process all requests that a client pushed onto its shared memory channel
+ * and wake up the client if it is waiting.
+ *
+ * @param client_context The context of the client that owns the channel.
+ * @param disconnecting If this is nonzero, the client is disconnecting and
+ *        requests that would be answered are dropped.
+ * @return Void.
+ */
+void drain_channel(client *client_context, int disconnecting);
+
+/**
+ * Tear down the shared memory channel of a client.
+ *
+ * @param client_context The context of the client that owns the channel.
+ * @return Void.
+ */
+void close_channel(client *client_context);
+
 #endif /* PLASMA_STORE_H */
@@ -0,0 +1,51 @@
+#include "ring.h"
+
+#include <string.h>
+
+#include "common.h"
+
+/* All accesses of head and tail are sequentially consistent. A producer that
+ * publishes a message and then reads the tail, and a consumer that publishes
+ * the tail and then reads the head, therefore cannot both miss each other's
+ * update, which is what makes the wakeup protocol free of lost wakeups. */
+
+void ring_init(ring *r) {
+  memset(r, 0, sizeof(ring));
+}
+
+int ring_push(ring *r, int64_t type, int64_t length, uint8_t *data) {
+  CHECK(length >= 0 && length <= RING_MESSAGE_SIZE);
+  int64_t head = r->head;
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == RING_CAPACITY) {
+    return -1;
+  }
+  ring_message *message = &r->messages[head % RING_CAPACITY];
+  message->type = type;
+  message->length = length;
+  memcpy(message->data, data, length);
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head;
+}
+
+ring_message *ring_front(ring *r) {
+  int64_t tail = r->tail;
+  if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == tail) {
+    return NULL;
+  }
+  return &r->messages[tail % RING_CAPACITY];
+}
+
+void ring_pop(ring *r) {
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+}
+
+int ring_empty(ring *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) ==
+         __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+}
+
+int ring_full(ring *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) -
+             __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) ==
+         RING_CAPACITY;
+}
@@ -0,0 +1,98 @@
+/* RING: Single producer, single consumer message queue in shared memory
+ *
+ * A ring lives in memory that is shared between two processes. One of them
+ * pushes messages and the other one pops them, without any system calls and
+ * without locks. The processes only need to wake each other up when one of
+ * them is about to sleep, which is what the return value of ring_push and the
+ * waiting flag of the plasma channel are for. */
+
+#ifndef RING_H
+#define RING_H
+
+#include <inttypes.h>
+
+/** The number of messages a ring can hold. */
+#define RING_CAPACITY 256
+
+/** The maximum size in bytes of the payload of a message. */
+#define RING_MESSAGE_SIZE 112
+
+typedef struct {
+  /** The type of the message. */
+  int64_t type;
+  /** The size in bytes of the payload. */
+  int64_t length;
+  /** The payload of the message. */
+  uint8_t data[RING_MESSAGE_SIZE];
+} ring_message;
+
+typedef struct {
+  /** The number of messages that have been pushed so far. This is only
+   *  written by the producer. */
+  int64_t head;
+  /** Keep head and tail in different cache lines. */
+  uint8_t head_padding[56];
+  /** The number of messages that have been popped so far. This is only
+   *  written by the consumer. */
+  int64_t tail;
+  uint8_t tail_padding[56];
+  /** The messages. Message i is stored at index i % RING_CAPACITY. */
+  ring_message messages[RING_CAPACITY];
+} ring;
+
+/**
+ * Initialize an empty ring.
+ *
+ * @param r The ring to initialize.
+ * @return Void.
+ */
+void ring_init(ring *r);
+
+/**
+ * Push a message onto the ring. This must only be called by the producer.
+ *
+ * @param r The ring.
+ * @param type The type of the message.
+ * @param length The size in bytes of the payload, at most RING_MESSAGE_SIZE.
+ * @param data The payload.
+ * @return -1 if the ring is full, 1 if the consumer had already popped all
+ *         earlier messages and may be going to sleep (so it has to be woken
+ *         up), and 0 otherwise.
+ */
+int ring_push(ring *r, int64_t type, int64_t length, uint8_t *data);
+
+/**
+ * Return the oldest message of the ring without removing it. This must only
+ * be called by the consumer.
+ *
+ * @param r The ring.
+ * @return The oldest message or NULL if the ring is empty.
+ */
+ring_message *ring_front(ring *r);
+
+/**
+ * Remove the oldest message from the ring. This must only be called by the
+ * consumer after ring_front returned a message.
+ *
+ * @param r The ring.
+ * @return Void.
+ */
+void ring_pop(ring *r);
+
+/**
+ * Check if the ring is empty. This can be called by both processes.
+ *
+ * @param r The ring.
+ * @return 1 if all pushed messages have been popped and 0 otherwise.
+ */
+int ring_empty(ring *r);
+
+/**
+ * Check if the ring is full. This can be called by both processes.
+ *
+ * @param r The ring.
+ * @return 1 if no more messages can be pushed and 0 otherwise.
+ */
+int ring_full(ring *r);
+
+#endif /* RING_H */
@@ -1,5 +1,6 @@
 from __future__ import print_function
 
+import binascii
 import os
 import signal
 import socket
@@ -8,8 +9,10 @@ import subprocess
 import sys
 import unittest
 import random
+import shutil
 import time
 import tempfile
+import threading
 
 import plasma
 
@@ -43,20 +46,35 @@ def create_object(client, data_size, metadata_size, seal=True):
     client.seal(object_id)
   return object_id, memory_buffer, metadata
 
+def start_plasma_store(extra_args=[]):
+  plasma_store_executable = os.path.join(os.path.abspath(os.path.dirname(__file__)), "../build/plasma_store")
+  store_name = "/tmp/store{}".format(random.randint(0, 10000))
+  command = [plasma_store_executable, "-s", store_name] + extra_args
+  if USE_VALGRIND:
+    p = subprocess.Popen(["valgrind", "--track-origins=yes", "--leak-check=full"] + command)
+    time.sleep(2.0)
+  else:
+    p = subprocess.Popen(command)
+  return store_name, p
+
+def start_plasma_manager(store_name, port, extra_args=[]):
+  plasma_manager_executable = os.path.join(os.path.abspath(os.path.dirname(__file__)), "../build/plasma_manager")
+  command = [plasma_manager_executable, "-s", store_name, "-m", "127.0.0.1", "-p", str(port)] + extra_args
+  if USE_VALGRIND:
+    p = subprocess.Popen(["valgrind", "--track-origins=yes", "--error-exitcode=1"] + command)
+    time.sleep(2.0)
+  else:
+    p = subprocess.Popen(command)
+    time.sleep(0.1)
+  return p
+
 class TestPlasmaClient(unittest.TestCase):
 
   def setUp(self):
     # Start Plasma.
-    plasma_store_executable = os.path.join(os.path.abspath(os.path.dirname(__file__)), "../build/plasma_store")
-    store_name = "/tmp/store{}".format(random.randint(0, 10000))
-    command = [plasma_store_executable, "-s", store_name]
-    if USE_VALGRIND:
-      self.p = subprocess.Popen(["valgrind", "--track-origins=yes", "--leak-check=full"] + command)
-      time.sleep(2.0)
-    else:
-      self.p = subprocess.Popen(command)
+    self.store_name, self.p = start_plasma_store()
     # Connect to Plasma.
-    self.plasma_client = plasma.PlasmaClient(store_name)
+    self.plasma_client = plasma.PlasmaClient(self.store_name)
 
   def tearDown(self):
     # Kill the plasma store process.
@@ -181,6 +199,108 @@ class TestPlasmaClient(unittest.TestCase):
     def illegal_assignment():
       memory_buffer[0] = chr(0)
     self.assertRaises(Exception, illegal_assignment)
+    # Make sure the object cannot be created again.
+    self.assertRaises(Exception, lambda : self.plasma_client.create(object_id, length))
+
+  def test_get_many(self):
+    object_ids = [random_object_id() for _ in range(10)]
+    for object_id in object_ids[:5]:
+      memory_buffer = self.plasma_client.create(object_id, 100)
+      memory_buffer[0] = object_id[0]
+      self.plasma_client.seal(object_id)
+    # With a timeout, the objects that are missing come back as None.
+    buffers = self.plasma_client.get_many(object_ids, timeout_ms=100)
+    for object_id, memory_buffer in zip(object_ids[:5], buffers[:5]):
+      self.assertEqual(memory_buffer[0], object_id[0])
+    self.assertEqual(buffers[5:], 5 * [None])
+    # A timeout of 0 answers right away.
+    buffers = self.plasma_client.get_many(object_ids[4:6], timeout_ms=0)
+    self.assertIsNotNone(buffers[0])
+    self.assertIsNone(buffers[1])
+    # If enough objects are available, there is no need to wait.
+    start = time.time()
+    buffers = self.plasma_client.get_many(object_ids, num_ready=5, timeout_ms=10000)
+    self.assertLess(time.time() - start, 5)
+    self.assertEqual(len([b for b in buffers if b is not None]), 5)
+
+  def test_get_many_waits_for_seal(self):
+    object_ids = [random_object_id() for _ in range(3)]
+    other_client = plasma.PlasmaClient(self.store_name)
+    def create_objects():
+      for object_id in object_ids:
+        other_client.create(object_id, 100)
+        other_client.seal(object_id)
+    timer = threading.Timer(0.1, create_objects)
+    timer.start()
+    # Without a timeout, this blocks until all the objects are sealed.
+    buffers = self.plasma_client.get_many(object_ids)
+    timer.join()
+    self.assertTrue(all([len(memory_buffer) == 100 for memory_buffer in buffers]))
+
+  def test_get_stream(self):
+    object_id = random_object_id()
+    self.assertEqual(self.plasma_client.get_stream(object_id, timeout_ms=10), None)
+    other_client = plasma.PlasmaClient(self.store_name)
+    memory_buffer = other_client.create(object_id, 1000)
+    for i in range(500):
+      memory_buffer[i] = chr(i % 256)
+    other_client.mark_bytes_ready(memory_buffer, 500)
+    # The object can be read up to the watermark before it is sealed.
+    stream = self.plasma_client.get_stream(object_id)
+    self.assertEqual(stream.wait(500), 500)
+    self.assertEqual(stream.buffer[:500], memory_buffer[:500])
+    self.assertEqual(stream.wait(1000, timeout_ms=10), 500)
+    for i in range(500, 1000):
+      memory_buffer[i] = chr(i % 256)
+    other_client.seal(object_id)
+    self.assertEqual(stream.wait(1000), 1000)
+    self.assertEqual(stream.buffer[:], memory_buffer[:])
+
+  def test_get_stream_waits_for_create(self):
+    object_id = random_object_id()
+    other_client = plasma.PlasmaClient(self.store_name)
+    timer = threading.Timer(0.1, lambda : other_client.create(object_id, 100))
+    timer.start()
+    # This returns once the object is created, without waiting for the seal.
+    stream = self.plasma_client.get_stream(object_id)
+    timer.join()
+    self.assertEqual(len(stream.buffer), 100)
+    self.assertEqual(stream.wait(100, timeout_ms=0), 0)
+    # Regular gets still wait for the seal.
+    self.assertEqual(self.plasma_client.get_many([object_id], timeout_ms=10), [None])
+
+  def test_abort(self):
+    object_id = random_object_id()
+    other_client = plasma.PlasmaClient(self.store_name)
+    other_client.create(object_id, 1000)
+    stream = self.plasma_client.get_stream(object_id)
+    timer = threading.Timer(0.1, lambda : other_client.abort(object_id))
+    timer.start()
+    # Waiting for the seal ends with the object missing instead of blocking.
+    self.assertEqual(self.plasma_client.get_many([object_id, random_object_id()], num_ready=1), [None, None])
+    timer.join()
+    self.assertEqual(stream.wait(1000), -1)
+    # The ID can be used again.
+    memory_buffer = other_client.create(object_id, 100)
+    memory_buffer[0] = "x"
+    other_client.seal(object_id)
+    self.assertEqual(self.plasma_client.get(object_id)[0], "x")
+
+  def test_unsealed_objects_of_dead_client_are_aborted(self):
+    object_id = random_object_id()
+    # A writer that dies before sealing its object.
+    script = "import plasma, os; plasma.PlasmaClient({!r}).create({!r}, 1000); os._exit(0)".format(self.store_name, object_id)
+    subprocess.check_call([sys.executable, "-c", script])
+    for _ in range(100):
+      try:
+        self.plasma_client.create(object_id, 100)
+        break
+      except Exception:
+        time.sleep(0.01)
+    else:
+      self.fail("The object of the dead client was not aborted.")
+    self.plasma_client.seal(object_id)
+    self.assertEqual(len(self.plasma_client.get(object_id)), 100)
 
   def test_subscribe(self):
     # Subscribe to notifications from the Plasma Store.
@@ -193,11 +313,411 @@ class TestPlasmaClient(unittest.TestCase):
         self.plasma_client.seal(object_id)
       # Check that we received notifications for all of the objects.
       for object_id in object_ids:
-        message_data = self.plasma_client.get_next_notification()
-        self.assertEqual(object_id, message_data)
+        notified_id, notification_type = self.plasma_client.get_next_notification()
+        self.assertEqual(object_id, notified_id)
+        self.assertEqual(notification_type, plasma.PLASMA_NOTIFICATION_SEALED)
+
+  def test_subscribe_ring(self):
+    self.plasma_client.subscribe(use_ring=True)
+    # More notifications than fit into the ring at once must not get lost.
+    for i in [1, 10, 100, 1000]:
+      objects = [(random_object_id(), random.randint(1, 5000), random.randint(0, 99)) for _ in range(i)]
+      for object_id, data_size, metadata_size in objects:
+        self.plasma_client.create(object_id, data_size, bytearray(metadata_size))
+        self.plasma_client.seal(object_id)
+      for object_id, data_size, metadata_size in objects:
+        notification = self.plasma_client.get_next_notification(with_sizes=True)
+        self.assertEqual(notification, (object_id, plasma.PLASMA_NOTIFICATION_SEALED, data_size, metadata_size))
+
+  def test_subscribe_late_with_filter(self):
+    def create_tagged(tag, object_id=None):
+      object_id = object_id or random_object_id()
+      self.plasma_client.create(object_id, 10, buffer(tag + "!"))
+      self.plasma_client.seal(object_id)
+      return object_id
+    existing_a = set(create_tagged("a") for _ in range(100))
+    existing_b = set(create_tagged("b") for _ in range(100))
+    # A subscriber that joins later first learns about the matching objects
+    # that are already there.
+    tag_client = plasma.PlasmaClient(self.store_name)
+    tag_client.subscribe(include_existing=True, metadata_tag="a")
+    prefix_client = plasma.PlasmaClient(self.store_name)
+    prefix_client.subscribe(use_ring=True, id_prefix="\x01\x02")
+    notified = set(tag_client.get_next_notification()[0] for _ in range(100))
+    self.assertEqual(notified, existing_a)
+    # Later notifications skip the objects that do not match.
+    new_a = [create_tagged(tag) for tag in "abab"][::2]
+    prefixed = create_tagged("b", "\x01\x02" + random_object_id()[2:])
+    last_a = create_tagged("a")
+    for object_id in new_a + [last_a]:
+      self.assertEqual(tag_client.get_next_notification(), (object_id, plasma.PLASMA_NOTIFICATION_SEALED))
+    self.assertEqual(prefix_client.get_next_notification(), (prefixed, plasma.PLASMA_NOTIFICATION_SEALED))
+
+  def test_small_objects_use_slabs(self):
+    stats = self.plasma_client.allocator_stats()
+    self.assertGreater(stats["small_object_threshold"], 0)
+    # Objects of 100 bytes plus their header go into the slots of 128 bytes.
+    size_class = [c["slot_size"] for c in stats["size_classes"]].index(128)
+    object_ids = [random_object_id() for _ in range(1000)]
+    for object_id in object_ids:
+      self.plasma_client.create(object_id, 100)
+      self.plasma_client.seal(object_id)
+      self.plasma_client.release(object_id)
+    stats = self.plasma_client.allocator_stats()
+    class_stats = stats["size_classes"][size_class]
+    self.assertEqual(class_stats["num_used_slots"], 1000)
+    self.assertGreaterEqual(class_stats["num_slots"], 1000)
+    self.assertGreaterEqual(class_stats["num_slabs"] * stats["slab_size"], 1000 * 128)
+    self.assertEqual(class_stats["bytes_requested"], 1000 * 116)
+    # Deleting the objects gives the slabs back to dlmalloc.
+    for object_id in object_ids:
+      self.plasma_client.delete(object_id)
+    class_stats = self.plasma_client.allocator_stats()["size_classes"][size_class]
+    self.assertEqual(class_stats["num_used_slots"], 0)
+    self.assertEqual(class_stats["num_slabs"], 0)
+
+class TestPlasmaClientArena(TestPlasmaClient):
+  """Run the client tests against a store that preallocates all its memory."""
+
+  def setUp(self):
+    # Start Plasma with a prefaulted 200MB arena. This process keeps the
+    # segments of every test mapped, so the arenas must not be too large.
+    self.store_name, self.p = start_plasma_store(["-m", str(2 * 10 ** 8), "-p"])
+    # Connect to Plasma.
+    self.plasma_client = plasma.PlasmaClient(self.store_name)
+
+class TestPlasmaClientChannel(TestPlasmaClient):
+  """Run the client tests with requests going through a shared memory channel."""
+
+  def setUp(self):
+    # Start Plasma.
+    self.store_name, self.p = start_plasma_store()
+    # Connect to Plasma through a channel.
+    self.plasma_client = plasma.PlasmaClient(self.store_name, use_channel=True)
+
+  def test_channel_is_used(self):
+    if not sys.platform.startswith("linux"):
+      return
+    # The client holds the two eventfds of the channel.
+    fd_dir = "/proc/self/fd"
+    links = []
+    for fd in os.listdir(fd_dir):
+      try:
+        links.append(os.readlink(os.path.join(fd_dir, fd)))
+      except OSError:
+        # This was the file descriptor used to list the directory.
+        pass
+    self.assertGreaterEqual(len([link for link in links if "eventfd" in link]), 2)
+
+  def test_many_small_requests(self):
+    # Fill the channel faster than the store drains it.
+    object_ids = [random_object_id() for _ in range(5000)]
+    for object_id in object_ids:
+      self.plasma_client.create(object_id, 10)
+      self.plasma_client.seal(object_id)
+      self.plasma_client.release(object_id)
+    for object_id in object_ids:
+      self.plasma_client.delete(object_id)
+    # Requests that go through the socket see the effects of all of them.
+    self.assertEqual(self.plasma_client.get_many(object_ids[:10], timeout_ms=0), 10 * [None])
+
+class TestPlasmaClientThreads(TestPlasmaClient):
+  """Run the client tests against a store that serves clients on 4 threads."""
+
+  def setUp(self):
+    # Start Plasma with 4 worker threads.
+    self.store_name, self.p = start_plasma_store(["-t", "4"])
+    # Connect to Plasma.
+    self.plasma_client = plasma.PlasmaClient(self.store_name)
+
+  def test_concurrent_clients(self):
+    # The clients are served by different threads. Each one gets the objects
+    # of the next one, so seals have to wake up waiters on other threads.
+    num_clients = 4
+    clients = [plasma.PlasmaClient(self.store_name) for _ in range(num_clients)]
+    object_ids = [[random_object_id() for _ in range(200)] for _ in range(num_clients)]
+    errors = []
+    def run(i):
+      try:
+        for object_id in object_ids[i]:
+          memory_buffer = clients[i].create(object_id, 100)
+          memory_buffer[0] = object_id[0]
+          clients[i].seal(object_id)
+          clients[i].release(object_id)
+        buffers = clients[i].get_many(object_ids[(i + 1) % num_clients])
+        for object_id, memory_buffer in zip(object_ids[(i + 1) % num_clients], buffers):
+          if memory_buffer[0] != object_id[0]:
+            errors.append(object_id)
+      except Exception as e:
+        errors.append(e)
+    threads = [threading.Thread(target=run, args=(i,)) for i in range(num_clients)]
+    for thread in threads:
+      thread.start()
+    for thread in threads:
+      thread.join()
+    self.assertEqual(errors, [])
+
+class TestPlasmaEviction(unittest.TestCase):
+
+  def setUp(self):
+    # Start Plasma with a capacity of 10MB.
+    self.store_name, self.p = start_plasma_store(["-m", str(10 ** 7)])
+    # Connect to Plasma.
+    self.plasma_client = plasma.PlasmaClient(self.store_name)
+
+  def tearDown(self):
+    # Kill the plasma store process.
+    if USE_VALGRIND:
+      self.p.send_signal(signal.SIGTERM)
+      self.p.wait()
+      if self.p.returncode != 0:
+        os._exit(-1)
+    else:
+      self.p.kill()
+
+  def test_eviction(self):
+    self.plasma_client.subscribe()
+    # Create 20MB of objects, so the first half has to be evicted.
+    object_ids = [random_object_id() for _ in range(200)]
+    for object_id in object_ids:
+      self.plasma_client.create(object_id, 10 ** 5)
+      self.plasma_client.seal(object_id)
+      self.plasma_client.release(object_id)
+    # The most recently created objects are still there.
+    for object_id in object_ids[-50:]:
+      self.assertTrue(self.plasma_client.contains(object_id))
+    # The objects are evicted in least recently used order.
+    evicted = [object_id for object_id in object_ids if not self.plasma_client.contains(object_id)]
+    self.assertGreater(len(evicted), 0)
+    self.assertEqual(evicted, object_ids[:len(evicted)])
+    # Subscribers are told about the evictions.
+    evicted_notifications = []
+    for _ in range(len(object_ids) + len(evicted)):
+      notified_id, notification_type = self.plasma_client.get_next_notification()
+      if notification_type == plasma.PLASMA_NOTIFICATION_EVICTED:
+        evicted_notifications.append(notified_id)
+    self.assertEqual(evicted, evicted_notifications)
+
+  def test_referenced_objects_are_not_evicted(self):
+    # This object is not released by its creator.
+    object_id, memory_buffer, _ = create_object(self.plasma_client, 10 ** 5, 0)
+    # Another client gets and releases this object.
+    other_id, _, _ = create_object(self.plasma_client, 10 ** 5, 0)
+    self.plasma_client.release(other_id)
+    other_client = plasma.PlasmaClient(self.store_name)
+    other_client.get(other_id)
+    other_client.release(other_id)
+    # Fill the store with objects that are released right away.
+    for _ in range(200):
+      new_id, _, _ = create_object(self.plasma_client, 10 ** 5, 0)
+      self.plasma_client.release(new_id)
+    self.assertTrue(self.plasma_client.contains(object_id))
+    self.assertFalse(self.plasma_client.contains(other_id))
+    # Once the object is released, it can be evicted.
+    self.plasma_client.release(object_id)
+    for _ in range(200):
+      new_id, _, _ = create_object(self.plasma_client, 10 ** 5, 0)
+      self.plasma_client.release(new_id)
+    self.assertFalse(self.plasma_client.contains(object_id))
+
+  def test_delete_while_in_use(self):
+    object_id, memory_buffer, _ = create_object(self.plasma_client, 10 ** 5, 0)
+    self.plasma_client.release(object_id)
+    other_client = plasma.PlasmaClient(self.store_name)
+    other_buffer = other_client.get(object_id)
+    contents = other_buffer[:]
+    self.plasma_client.delete(object_id)
+    self.assertFalse(self.plasma_client.contains(object_id))
+    # The memory is not reused while the other client still uses the object.
+    for _ in range(200):
+      new_id, _, _ = create_object(self.plasma_client, 10 ** 5, 0)
+      self.plasma_client.release(new_id)
+    self.assertEqual(contents, other_buffer[:])
+    other_client.release(object_id)
+
+  def test_out_of_memory(self):
+    # Objects larger than the capacity can never be created.
+    self.assertRaises(Exception, lambda : self.plasma_client.create(random_object_id(), 2 * 10 ** 7))
+    # Objects that are in use are not evicted to make room.
+    self.assertRaises(Exception, lambda : [create_object(self.plasma_client, 10 ** 6, 0) for _ in range(20)])
+    # The store still works afterwards.
+    object_id, _, _ = create_object(self.plasma_client, 1000, 0)
+    self.assertTrue(self.plasma_client.contains(object_id))
+
+class TestPlasmaSpilling(unittest.TestCase):
+
+  def setUp(self):
+    # Start Plasma with a capacity of 10MB and a directory to spill to.
+    self.spill_directory = tempfile.mkdtemp()
+    self.store_name, self.p = start_plasma_store(["-m", str(10 ** 7), "-x", self.spill_directory])
+    self.plasma_client = plasma.PlasmaClient(self.store_name)
+
+  def tearDown(self):
+    if USE_VALGRIND:
+      self.p.send_signal(signal.SIGTERM)
+      self.p.wait()
+      if self.p.returncode != 0:
+        os._exit(-1)
+    else:
+      self.p.kill()
+    shutil.rmtree(self.spill_directory)
+
+  def test_spilled_objects_are_restored(self):
+    # Create three times as many objects as fit into memory.
+    objects = []
+    for _ in range(300):
+      object_id, memory_buffer, metadata = create_object(self.plasma_client, 10 ** 5, 10)
+      objects.append((object_id, memory_buffer[:], metadata))
+      self.plasma_client.release(object_id)
+    self.assertGreater(len(os.listdir(self.spill_directory)), 0)
+    # None of them are lost, and getting them reads them back from disk.
+    for object_id, data, metadata in objects:
+      self.assertTrue(self.plasma_client.contains(object_id))
+      self.assertEqual(data, self.plasma_client.get(object_id)[:])
+      self.assertEqual(metadata[:], self.plasma_client.get_metadata(object_id)[:])
+      self.plasma_client.release(object_id)
+      self.plasma_client.release(object_id)
+    # Deleting a spilled object removes its file.
+    spill_file = os.path.join(self.spill_directory, binascii.hexlify(objects[0][0]))
+    self.assertTrue(os.path.exists(spill_file))
+    self.plasma_client.delete(objects[0][0])
+    self.assertFalse(self.plasma_client.contains(objects[0][0]))
+    self.assertFalse(os.path.exists(spill_file))
+
+class TestPlasmaSnapshot(unittest.TestCase):
+
+  def setUp(self):
+    self.directory = tempfile.mkdtemp()
+    self.arena_file = os.path.join(self.directory, "arena")
+    self.p = None
+
+  def tearDown(self):
+    if self.p is not None:
+      self.p.kill()
+    shutil.rmtree(self.directory)
+
+  def restart_store(self, shutdown=True):
+    if self.p is not None:
+      if shutdown:
+        # The store writes the index of the arena when it is terminated.
+        self.p.send_signal(signal.SIGTERM)
+      else:
+        self.p.kill()
+      self.p.wait()
+    self.store_name, self.p = start_plasma_store(["-m", str(10 ** 7), "-f", self.arena_file])
+    time.sleep(0.1)
+    return plasma.PlasmaClient(self.store_name)
+
+  def test_objects_survive_a_restart(self):
+    client = self.restart_store()
+    objects = [create_object(client, 10 ** 4, 10) for _ in range(100)]
+    for object_id, _, _ in objects:
+      client.release(object_id)
+    objects = [(object_id, data[:], metadata[:]) for object_id, data, metadata in objects]
+    unsealed_id, _, _ = create_object(client, 1000, 0, seal=False)
+    client = self.restart_store()
+    self.assertFalse(os.path.exists(self.arena_file + ".index"))
+    for object_id, data, metadata in objects:
+      self.assertEqual(data, client.get(object_id)[:])
+      self.assertEqual(metadata, client.get_metadata(object_id)[:])
+    self.assertFalse(client.contains(unsealed_id))
+    # The restored store keeps working with the same heap.
+    new_id, new_buffer, _ = create_object(client, 10 ** 5, 0)
+    self.assertEqual(new_buffer[:], client.get(new_id)[:])
+    self.assertEqual(objects[0][1], client.get(objects[0][0])[:])
+    # After a crash there is no index, so the store starts empty.
+    client = self.restart_store(shutdown=False)
+    self.assertFalse(client.contains(objects[0][0]))
+
+class TestPlasmaDeduplication(unittest.TestCase):
+
+  def setUp(self):
+    # Start Plasma with deduplication of identical objects.
+    self.store_name, self.p = start_plasma_store(["-u"])
+    self.plasma_client = plasma.PlasmaClient(self.store_name)
+
+  def tearDown(self):
+    if USE_VALGRIND:
+      self.p.send_signal(signal.SIGTERM)
+      self.p.wait()
+      if self.p.returncode != 0:
+        os._exit(-1)
+    else:
+      self.p.kill()
+
+  def put(self, client, contents, metadata=""):
+    object_id = random_object_id()
+    memory_buffer = client.create(object_id, len(contents), buffer(metadata))
+    memory_buffer[:] = contents
+    client.seal(object_id)
+    client.release(object_id)
+    return object_id
+
+  def test_identical_objects_share_memory(self):
+    contents = os.urandom(10 ** 5)
+    first_id = self.put(self.plasma_client, contents, "meta")
+    allocated = self.plasma_client.allocator_stats()["bytes_allocated"]
+    # The second copy gives up its memory once it is released. Growing the
+    # heap for it may have cost a few bytes of the allocator's own.
+    second_id = self.put(self.plasma_client, contents, "meta")
+    self.assertLess(self.plasma_client.allocator_stats()["bytes_allocated"], allocated + len(contents))
+    digest = self.plasma_client.digest(first_id)
+    self.assertNotEqual(digest, 0)
+    self.assertEqual(digest, self.plasma_client.digest(second_id))
+    self.assertEqual(contents, self.plasma_client.get(first_id)[:])
+    self.assertEqual(contents, self.plasma_client.get(second_id)[:])
+    self.assertEqual("meta", self.plasma_client.get_metadata(second_id)[:])
+    # Objects with other contents keep their own memory.
+    other_id = self.put(self.plasma_client, contents, "data")
+    self.assertNotEqual(digest, self.plasma_client.digest(other_id))
+    self.assertGreater(self.plasma_client.allocator_stats()["bytes_allocated"], allocated)
+    allocated = self.plasma_client.allocator_stats()["bytes_allocated"]
+    # Aliases are created without sending the contents.
+    alias_id = random_object_id()
+    self.assertEqual(plasma.PLASMA_OK, self.plasma_client.create_alias(alias_id, digest, len(contents), 4))
+    self.assertEqual(plasma.PLASMA_OBJECT_EXISTS, self.plasma_client.create_alias(alias_id, digest, len(contents), 4))
+    self.assertEqual(plasma.PLASMA_CONTENT_NOT_FOUND, self.plasma_client.create_alias(random_object_id(), digest, len(contents), 5))
+    self.assertEqual(allocated, self.plasma_client.allocator_stats()["bytes_allocated"])
+    self.assertEqual(contents, self.plasma_client.get(alias_id)[:])
+    # The memory stays as long as one of the objects uses it.
+    for object_id in [first_id, second_id, second_id, alias_id]:
+      self.plasma_client.release(object_id)
+    self.plasma_client.delete(first_id)
+    self.plasma_client.delete(second_id)
+    self.assertEqual(contents, self.plasma_client.get(alias_id)[:])
+    self.plasma_client.release(alias_id)
+    self.plasma_client.delete(alias_id)
+    self.assertLess(self.plasma_client.allocator_stats()["bytes_allocated"], allocated)
+
+  def test_transfer_by_digest(self):
+    other_store_name, other_p = start_plasma_store(["-u"])
+    self.addCleanup(other_p.kill)
+    port1 = random.randint(10000, 50000)
+    port2 = random.randint(10000, 50000)
+    self.addCleanup(start_plasma_manager(self.store_name, port1).kill)
+    self.addCleanup(start_plasma_manager(other_store_name, port2).kill)
+    client1 = plasma.PlasmaClient(self.store_name, "127.0.0.1", port1)
+    client2 = plasma.PlasmaClient(other_store_name, "127.0.0.1", port2)
+    # The other store already has the contents under another ID.
+    contents = os.urandom(10 ** 6)
+    self.put(client2, contents)
+    object_id = self.put(client1, contents)
+    allocated = client2.allocator_stats()["bytes_allocated"]
+    client1.transfer("127.0.0.1", port2, object_id)
+    self.assertEqual(contents, client2.get(object_id)[:])
+    self.assertLess(client2.allocator_stats()["bytes_allocated"], allocated + len(contents))
+    # Contents that the other store does not have are sent in full.
+    new_contents = os.urandom(10 ** 6)
+    new_id = self.put(client1, new_contents)
+    client1.transfer("127.0.0.1", port2, new_id)
+    self.assertEqual(new_contents, client2.get(new_id)[:])
 
 class TestPlasmaManager(unittest.TestCase):
 
+  # Extra command line arguments of all plasma managers. The ports of the two
+  # plasma managers are filled in for {port1} and {port2}.
+  manager_args = []
+
   def setUp(self):
     # Start two PlasmaStores.
     plasma_store_executable = os.path.join(os.path.abspath(os.path.dirname(__file__)), "../build/plasma_store")
@@ -216,9 +736,10 @@ class TestPlasmaManager(unittest.TestCase):
     # Start two PlasmaManagers.
     self.port1 = random.randint(10000, 50000)
     self.port2 = random.randint(10000, 50000)
+    self.manager_args = [arg.format(port1=self.port1, port2=self.port2) for arg in self.manager_args]
     plasma_manager_executable = os.path.join(os.path.abspath(os.path.dirname(__file__)), "../build/plasma_manager")
-    plasma_manager_command1 = [plasma_manager_executable, "-s", store_name1, "-m", "127.0.0.1", "-p", str(self.port1)]
-    plasma_manager_command2 = [plasma_manager_executable, "-s", store_name2, "-m", "127.0.0.1", "-p", str(self.port2)]
+    plasma_manager_command1 = [plasma_manager_executable, "-s", store_name1, "-m", "127.0.0.1", "-p", str(self.port1)] + self.manager_args
+    plasma_manager_command2 = [plasma_manager_executable, "-s", store_name2, "-m", "127.0.0.1", "-p", str(self.port2)] + self.manager_args
 
     if USE_VALGRIND:
       self.p4 = subprocess.Popen(["valgrind", "--track-origins=yes", "--error-exitcode=1"] + plasma_manager_command1)
@@ -281,6 +802,98 @@ class TestPlasmaManager(unittest.TestCase):
       self.assertEqual(metadata2[:], self.client2.get_metadata(object_id2)[:])
       self.assertEqual(self.client1.get_metadata(object_id2)[:], self.client2.get_metadata(object_id2)[:])
 
+  def test_transfer_large_objects(self):
+    # These objects are sent in many chunks of growing size.
+    for data_size in [10 ** 6, 3 * 10 ** 7]:
+      object_id, memory_buffer, metadata = create_object(self.client1, data_size, 1000)
+      self.client1.transfer("127.0.0.1", self.port2, object_id)
+      self.assertEqual(memory_buffer[:], self.client2.get(object_id)[:])
+      self.assertEqual(metadata[:], self.client2.get_metadata(object_id)[:])
+
+  def test_transfer_small_objects_during_large_transfer(self):
+    # The large object is split into ranges over several connections, and the
+    # small objects are sent in between.
+    large_id, large_buffer, _ = create_object(self.client1, 10 ** 8, 0)
+    small_objects = [create_object(self.client1, 100, 10) for _ in range(10)]
+    self.client1.transfer("127.0.0.1", self.port2, large_id)
+    for object_id, _, _ in small_objects:
+      self.client1.transfer("127.0.0.1", self.port2, object_id)
+    for object_id, memory_buffer, metadata in small_objects:
+      self.assertEqual(memory_buffer[:], self.client2.get(object_id)[:])
+      self.assertEqual(metadata[:], self.client2.get_metadata(object_id)[:])
+    self.assertEqual(large_buffer[:], self.client2.get(large_id)[:])
+
+  def test_stream_while_receiving(self):
+    object_id, memory_buffer, metadata = create_object(self.client1, 10 ** 8, 100)
+    self.client2.fetch("127.0.0.1", self.port1, [object_id])
+    stream = self.client2.get_stream(object_id)
+    # Read the object in pieces as it arrives.
+    piece = 10 ** 7
+    for start in range(0, 10 ** 8, piece):
+      self.assertGreaterEqual(stream.wait(start + piece), start + piece)
+      self.assertEqual(stream.buffer[start:start + piece], memory_buffer[start:start + piece])
+    self.assertEqual(stream.wait(10 ** 8 + 100), 10 ** 8 + 100)
+    self.assertEqual(metadata[:], self.client2.get_metadata(object_id)[:])
+
+  def test_broadcast(self):
+    # Start three more nodes, so the object goes along a tree with relays.
+    processes = []
+    clients = [self.client2]
+    ports = [self.port2]
+    try:
+      for _ in range(3):
+        store_name, store_process = start_plasma_store()
+        processes.append(store_process)
+        port = random.randint(10000, 50000)
+        processes.append(start_plasma_manager(store_name, port, self.manager_args))
+        clients.append(plasma.PlasmaClient(store_name, "127.0.0.1", port))
+        ports.append(port)
+      large_id, large_buffer, large_metadata = create_object(self.client1, 5 * 10 ** 7, 100)
+      small_id, small_buffer, _ = create_object(self.client1, 100, 0)
+      managers = [("127.0.0.1", port) for port in ports]
+      self.client1.broadcast(large_id, managers)
+      self.client1.broadcast(small_id, managers)
+      for client in clients:
+        self.assertEqual(small_buffer[:], client.get(small_id)[:])
+        self.assertEqual(large_buffer[:], client.get(large_id)[:])
+        self.assertEqual(large_metadata[:], client.get_metadata(large_id)[:])
+      # An object that is still being written is broadcast as it is written.
+      object_id, memory_buffer, _ = create_object(self.client1, 1000, 0, seal=False)
+      self.client1.broadcast(object_id, managers)
+      time.sleep(0.1)
+      self.client1.seal(object_id)
+      for client in clients:
+        self.assertEqual(memory_buffer[:], client.get(object_id)[:])
+    finally:
+      for process in processes:
+        process.kill()
+
+  def test_fetch(self):
+    objects = [create_object(self.client1, 1000, 100) for _ in range(10)]
+    object_ids = [object_id for object_id, _, _ in objects]
+    # Pull the objects from the first manager.
+    self.client2.fetch("127.0.0.1", self.port1, object_ids)
+    for object_id, memory_buffer, metadata in objects:
+      self.assertEqual(memory_buffer[:], self.client2.get(object_id)[:])
+      self.assertEqual(metadata[:], self.client2.get_metadata(object_id)[:])
+    # Fetching objects that are already there does nothing.
+    self.client2.fetch("127.0.0.1", self.port1, object_ids)
+    self.assertEqual(objects[0][1][:], self.client2.get(object_ids[0])[:])
+
+  def test_concurrent_fetches_of_the_same_object(self):
+    object_id, memory_buffer, _ = create_object(self.client1, 10 ** 7, 0)
+    # The object is only transferred once, even though many fetches for it
+    # arrive while it is in flight.
+    for _ in range(10):
+      self.client2.fetch("127.0.0.1", self.port1, [object_id])
+    self.assertEqual(memory_buffer[:], self.client2.get(object_id)[:])
+    # Pushing an object that is already in the store does not create it twice.
+    self.client1.transfer("127.0.0.1", self.port2, object_id)
+    other_id, other_buffer, _ = create_object(self.client1, 100, 0)
+    self.client1.transfer("127.0.0.1", self.port2, other_id)
+    self.assertEqual(other_buffer[:], self.client2.get(other_id)[:])
+    self.assertRaises(Exception, lambda : self.client2.create(object_id, 100))
+
   def test_illegal_functionality(self):
     # Create an object id string.
     object_id = random_object_id()
@@ -304,6 +917,72 @@ class TestPlasmaManager(unittest.TestCase):
 
     print("it took", b, "seconds to put and transfer the objects")
 
+class TestPlasmaManagerCompression(TestPlasmaManager):
+
+  # Run the same tests with managers that compress the objects they send.
+  manager_args = ["-c"]
+
+  def put(self, client, contents):
+    object_id = random_object_id()
+    memory_buffer = client.create(object_id, len(contents), buffer("meta"))
+    memory_buffer[:] = contents
+    client.seal(object_id)
+    return object_id
+
+  def test_transfer_compressed(self):
+    # The managers agree on compression with the first connection.
+    warm_up_id, _, _ = create_object(self.client1, 100, 0)
+    self.client1.transfer("127.0.0.1", self.port2, warm_up_id)
+    self.client2.get(warm_up_id)
+    # Compressible data, data that does not compress and data that compresses
+    # in parts, which is sent in blocks of both kinds.
+    random_part = os.urandom(3 * 10 ** 6)
+    for contents in ["plasma" * (10 ** 6), os.urandom(6 * 10 ** 6), random_part + "\0" * len(random_part)]:
+      object_id = self.put(self.client1, contents)
+      self.client1.transfer("127.0.0.1", self.port2, object_id)
+      self.assertEqual(contents, self.client2.get(object_id)[:])
+      self.assertEqual("meta", self.client2.get_metadata(object_id)[:])
+
+class TestPlasmaManagerDirectory(TestPlasmaManager):
+
+  # Run the same tests with managers that keep a directory of the objects.
+  manager_args = ["-d", "127.0.0.1:{port1},127.0.0.1:{port2}"]
+
+  def wait_for_locations(self, client, object_id, expected):
+    # The stores report their objects to the directory asynchronously.
+    for _ in range(100):
+      locations = client.locate(object_id)
+      if locations == expected:
+        break
+      time.sleep(0.01)
+    self.assertEqual(expected, locations)
+
+  def test_locate(self):
+    first = ("127.0.0.1", self.port1)
+    second = ("127.0.0.1", self.port2)
+    object_ids = [create_object(self.client1, 1000, 100)[0] for _ in range(10)]
+    for object_id in object_ids:
+      self.wait_for_locations(self.client2, object_id, [first])
+      self.client1.transfer("127.0.0.1", self.port2, object_id)
+      self.client2.get(object_id)
+      # Every client sees its own manager first.
+      self.wait_for_locations(self.client1, object_id, [first, second])
+      self.wait_for_locations(self.client2, object_id, [second, first])
+      self.client2.release(object_id)
+      self.client2.delete(object_id)
+      self.wait_for_locations(self.client1, object_id, [first])
+    self.assertEqual([], self.client1.locate(random_object_id()))
+
+  def test_fetch_from_directory(self):
+    objects = [create_object(self.client1, 1000, 100) for _ in range(10)]
+    # Objects that do not exist yet are fetched when they are sealed.
+    later = create_object(self.client1, 20000, 100, seal=False)
+    self.client2.fetch(None, None, [object_id for object_id, _, _ in objects + [later]])
+    self.client1.seal(later[0])
+    for object_id, memory_buffer, metadata in objects + [later]:
+      self.assertEqual(memory_buffer[:], self.client2.get(object_id)[:])
+      self.assertEqual(metadata[:], self.client2.get_metadata(object_id)[:])
+
 if __name__ == "__main__":
   if len(sys.argv) > 1:
     # pop the argument so we don't mess with unittest's own argument parser